@@ -0,0 +1,107 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <grpcpp/grpcpp.h>
+#include "thread_pool.h"
+
+// Building blocks of the completion queue server. Every queued operation carries its call object as
+// the tag, and the polling thread that dequeues it hands the result back through proceed().
+class call_state {
+  public:
+    virtual ~call_state() = default;
+    // ok is the completion queue's verdict on the operation the call was waiting for
+    virtual void proceed(bool ok) = 0;
+};
+
+// Recycles the call objects of one method on one queue instead of allocating one per rpc.
+template <class Call>
+class call_pool {
+  public:
+    using factory = std::function<std::unique_ptr<Call>(call_pool*)>;
+
+    explicit call_pool(factory make) : make_(std::move(make)) {}
+
+    Call* acquire() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (free_.empty()) {
+        all_.push_back(make_(this));
+        return all_.back().get();
+      }
+      Call* call = free_.back();
+      free_.pop_back();
+      return call;
+    }
+
+    void release(Call* call) {
+      call->reset();
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_.push_back(call);
+    }
+
+  private:
+    factory make_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Call>> all_;
+    std::vector<Call*> free_;
+};
+
+// Unary rpc. Once a request is accepted a replacement is armed, then the handler runs on the executor,
+// or inline on the polling thread when there is none.
+template <class Request, class Response>
+class unary_call : public call_state {
+  public:
+    using request_fn = std::function<void(grpc::ServerContext*, Request*, grpc::ServerAsyncResponseWriter<Response>*, void*)>;
+    using handler_fn = std::function<grpc::Status(const Request&, Response&)>;
+
+    unary_call(call_pool<unary_call>* pool, request_fn request, handler_fn handler, ThreadPool* executor)
+      : pool_(pool), request_(std::move(request)), handler_(std::move(handler)), executor_(executor), finishing_(false) {
+      reset();
+    }
+
+    void arm() {
+      finishing_ = false;
+      request_(ctx_.get(), &request_msg_, responder_.get(), this);
+    }
+
+    void reset() {
+      ctx_ = std::make_unique<grpc::ServerContext>();
+      responder_ = std::make_unique<grpc::ServerAsyncResponseWriter<Response>>(ctx_.get());
+      request_msg_ = Request();
+      response_ = Response();
+    }
+
+    void proceed(bool ok) override {
+      // a finished call, or a request slot cancelled by shutdown
+      if (finishing_ || !ok) {
+        pool_->release(this);
+        return;
+      }
+
+      pool_->acquire()->arm();
+      if (executor_) {
+        executor_->submit([this]() { respond(); });
+      } else {
+        respond();
+      }
+    }
+
+  private:
+    void respond() {
+      grpc::Status status = handler_(request_msg_, response_);
+      finishing_ = true;
+      responder_->Finish(response_, status, this);
+    }
+
+    call_pool<unary_call>* pool_;
+    request_fn request_;
+    handler_fn handler_;
+    ThreadPool* executor_;
+    bool finishing_;
+    std::unique_ptr<grpc::ServerContext> ctx_;
+    std::unique_ptr<grpc::ServerAsyncResponseWriter<Response>> responder_;
+    Request request_msg_;
+    Response response_;
+};
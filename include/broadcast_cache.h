@@ -0,0 +1,49 @@
+#pragma once
+
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include <grpcpp/support/slice.h>
+#include "parameter_server.h"
+
+// Parameter pulls serialized once per snapshot version, delta base and element type. Every worker pulling that version
+// is answered with the same ref-counted slices behind its own small envelope; an entry is dropped once
+// every worker has taken it, or as soon as a newer version is asked for.
+class BroadcastCache {
+  public:
+    // encoded tensor fields of one message, see assemble_message()
+    using body = std::vector<grpc::Slice>;
+
+    explicit BroadcastCache(int total_workers);
+
+    // ParameterUpdate.parameters of the snapshot when base_version is 0,
+    // otherwise ParameterUpdate.blocks changed since base_version; elements are sent as dtype
+    std::shared_ptr<const body> parameters(const std::shared_ptr<const parameter_snapshot>& snapshot, int64_t base_version,
+                                           int32_t dtype);
+    // ParameterChunk.pieces of every chunk sequence, cut to chunk_bytes; always at least one, possibly empty, chunk
+    std::shared_ptr<const std::vector<body>> chunks(const std::shared_ptr<const parameter_snapshot>& snapshot,
+                                                    int64_t base_version, size_t chunk_bytes, int32_t dtype);
+    // number of pulls an entry serves before it is dropped, follows membership changes
+    void set_total_workers(int total_workers);
+
+  private:
+    struct entry {
+      // ready once the pull that created the entry has encoded it
+      std::shared_future<std::shared_ptr<const void>> encoded;
+      int served = 0;
+    };
+    // (version, base_version, chunk_bytes, dtype), chunk_bytes 0 is the unary ParameterUpdate body
+    using key = std::tuple<int64_t, int64_t, size_t, int32_t>;
+
+    // counts one pull against the entry, encoding it on a miss, and evicts it when every worker has been served
+    std::shared_ptr<const void> take(const key& k, const std::function<std::shared_ptr<const void>()>& encode);
+
+    int total_workers_;
+    std::mutex mutex_;
+    std::map<key, entry> entries_;
+    int64_t newest_version_;
+};
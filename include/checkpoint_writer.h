@@ -0,0 +1,31 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "parameter_server.h"
+
+// Writes periodic checkpoints on a thread of its own, so neither the trigger nor training waits for the disk.
+// An image submitted while the previous one is still being written waits for it; a newer submission replaces
+// a waiting one, a slow disk skips checkpoints rather than queueing them up.
+class CheckpointWriter {
+  public:
+    explicit CheckpointWriter(ParameterServerCore& ps);
+    // writes a checkpoint still waiting before returning
+    ~CheckpointWriter();
+
+    void submit(checkpoint_image image, const std::string& path);
+
+  private:
+    void run();
+
+    ParameterServerCore& ps_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    bool stopping_ = false;
+    bool waiting_ = false;
+    checkpoint_image next_;
+    std::string next_path_;
+    std::thread thread_;
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/generic/generic_stub.h>
+#include "parameter_server.grpc.pb.h"
+#include "coordinator.grpc.pb.h"
+
+class SharedMemoryChannel;
+
+struct ConnectionOptions {
+  int channels_per_shard = 1;        // independent TCP connections per parameter server shard
+  int keepalive_time_ms = 10000;
+  int keepalive_timeout_ms = 5000;
+  int rpc_timeout_ms = 30000;        // deadline for calls that wait for a broken channel to come back
+  // room each way in the shared memory lane a channel to a shard on this machine is paired with, 0 keeps every
+  // call on TCP
+  size_t shared_memory_bytes = 16 << 20;
+  std::string hostname;              // addresses naming it count as this machine, besides localhost
+};
+
+// Long-lived channels and stubs shared by every RPC a worker makes.
+// Stubs are handed out as shared_ptr so reconnect() can swap a channel while other threads are mid-call.
+class ConnectionManager {
+  public:
+    ConnectionManager(const std::string& coordinator_address, const ConnectionOptions& options = ConnectionOptions());
+
+    // keeps channels to addresses that are still present, opens channels to new ones
+    void set_parameter_servers(const std::vector<std::string>& addresses);
+
+    std::shared_ptr<coordinator::Coordinator::Stub> coordinator();
+
+    // round-robins over the shard's channels
+    std::shared_ptr<parameter_server::ParameterServer::Stub> parameter_server(size_t shard);
+    std::shared_ptr<parameter_server::ParameterServer::Stub> parameter_server(size_t shard, size_t channel);
+
+    // blocking call on a raw (ByteBuffer) method of a shard, used for packed tensor payloads; goes through
+    // shared memory when the shard is on this machine and accepts a region, over gRPC otherwise
+    grpc::Status call_raw(size_t shard, const std::string& method, grpc::ClientContext* ctx,
+                          const grpc::ByteBuffer& request, grpc::ByteBuffer* response);
+
+    size_t channels_per_shard() const { return static_cast<size_t>(options_.channels_per_shard); }
+    // largest message the shard's shared memory lane takes, 0 until one is attached
+    size_t shared_memory_capacity(size_t shard);
+
+    // wait for a reconnecting channel instead of failing fast, bounded by rpc_timeout_ms
+    void prepare_context(grpc::ClientContext& ctx) const;
+
+    // rebuilds only channels that are shut down or in transient failure, returns how many were rebuilt
+    int reconnect();
+
+  private:
+    struct ps_connection {
+      std::string address;
+      std::shared_ptr<grpc::Channel> channel;
+      std::shared_ptr<parameter_server::ParameterServer::Stub> stub;
+      std::shared_ptr<grpc::GenericStub> generic;
+      std::shared_ptr<SharedMemoryChannel> shared_memory;
+      bool shared_memory_tried = false;  // attach is asked once per connection, or again after a lane is lost
+    };
+
+    std::shared_ptr<grpc::Channel> create_channel(const std::string& address) const;
+    static ps_connection open_ps_connection(const std::string& address, std::shared_ptr<grpc::Channel> channel);
+    static bool is_broken(const std::shared_ptr<grpc::Channel>& channel);
+    std::shared_ptr<SharedMemoryChannel> attach_shared_memory(parameter_server::ParameterServer::Stub& stub) const;
+
+    ConnectionOptions options_;
+    std::string coordinator_address_;
+    std::shared_ptr<grpc::Channel> coordinator_channel_;
+    std::shared_ptr<coordinator::Coordinator::Stub> coordinator_stub_;
+    // ps_connections_[shard][channel]
+    std::vector<std::vector<ps_connection>> ps_connections_;
+    std::atomic<size_t> next_channel_;
+    std::mutex mutex_;
+};
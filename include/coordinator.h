@@ -12,14 +12,22 @@ struct WorkerRegistryEntry {
   std::string address;
   int32_t port;
   std::string hostname;
+  bool local_aggregation = false;
   int32_t status;
   std::chrono::steady_clock::time_point last_heartbeat;
 };
 
+struct ParameterServerShard {
+  int32_t shard_id;
+  std::string address;
+  int32_t port;
+};
+
 class CoordinatorCore {
     public:
-        CoordinatorCore(const std::string& ps_address, int32_t ps_port);
+        CoordinatorCore(const std::vector<ParameterServerShard>& ps_shards, int64_t split_threshold_bytes);
         
+        // false when the worker's local_aggregation differs from the workers already registered
         bool register_worker(const WorkerRegistryEntry& worker_info, std::string& ps_address, int32_t& total_workers);
         
         bool update_heartbeat(int32_t worker_id, int32_t status);
@@ -28,12 +36,38 @@ class CoordinatorCore {
         
         bool get_parameter_server_address(std::string& address, int32_t& port);
         
+        // every parameter server shard, ordered by shard id
+        std::vector<ParameterServerShard> get_shard_map(int64_t& split_threshold_bytes);
+        
         void remove_stale_workers(int64_t timeout_seconds = 30);
+        
+        // ids the servers see pushes from, sorted, and the epoch they belong to: every registered worker's,
+        // with host groups counted once under their group id. The epoch grows whenever a worker joins or is timed out,
+        // and keeps growing across coordinator restarts
+        int64_t membership(std::vector<int32_t>& worker_ids);
+        
+        // the aggregating workers on worker_id's host, its leader first, and the id the leader pushes under;
+        // false when worker_id does not aggregate. groups and total_workers count hosts and workers over the whole job
+        bool host_group(int32_t worker_id, std::vector<WorkerRegistryEntry>& members, int32_t& group_id, int32_t& groups,
+                        int32_t& total_workers);
+        
+        // workers that serve a peer port in all-reduce ring order, and the membership epoch they belong to
+        int64_t ring(std::vector<WorkerRegistryEntry>& members);
 
     private:
-        std::string ps_address_;
-        int32_t ps_port_;
+        // whether an aggregating worker leads its host, workers_mutex_ held
+        bool leads_host(const WorkerRegistryEntry& worker) const;
+        // the group id of a host leader, workers_mutex_ held
+        int32_t host_group_id(const WorkerRegistryEntry& leader) const;
+        // frees the group ids of hosts no aggregating worker is left on, workers_mutex_ held
+        void release_empty_host_groups();
+
+        std::vector<ParameterServerShard> ps_shards_;
+        int64_t split_threshold_bytes_;
         std::unordered_map<int32_t, WorkerRegistryEntry> workers_;
+        // a host keeps the lowest id free when its first worker registered until its last one is gone
+        std::unordered_map<std::string, int32_t> host_groups_;
         std::mutex workers_mutex_;
+        int64_t membership_epoch_;
 };
 
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include "coordinator.h"
 
-void run_coordinator_server(const std::string& server_address, const std::string& ps_address, int32_t ps_port);
+void run_coordinator_server(const std::string& server_address, const std::vector<ParameterServerShard>& ps_shards, int64_t split_threshold_bytes);
 
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Which gradient entries a worker pushes. Entries left out stay in the worker's residual and are added to
+// the next iteration's gradient (error feedback), so their mass is delayed rather than lost.
+struct SparsifyOptions {
+  std::string mode = "none";  // none, topk or threshold
+  double ratio = 0.01;        // topk: fraction of each tensor slice's entries pushed per iteration
+  float threshold = 0.0f;     // threshold: entries at least this large in magnitude are pushed
+};
+
+bool valid_sparsify_mode(const std::string& mode);
+
+// entries of a tensor slice picked for pushing, ascending by index
+struct sparse_gradient {
+  std::vector<uint32_t> indices;
+  std::vector<float> values;
+};
+
+// adds grad into residual, then moves the entries options picks out of residual and into out
+void sparsify(const float* grad, float* residual, size_t n, const SparsifyOptions& options, sparse_gradient& out);
+
+// Block quantization of pushed gradients: each block of elements travels as int8 codes or sign bits plus one
+// float32 scale. The rounding error stays in the residual like sparsify's left-out entries.
+struct QuantizeOptions {
+  std::string mode = "none";        // none, int8 or sign
+  size_t block = 256;               // elements per scale, a multiple of 8
+  size_t min_elements = 4096;       // smaller tensors go as float32, their scales would cost more than they save
+  std::vector<std::string> keep;    // tensors always pushed as float32
+};
+
+bool valid_quantize_mode(const std::string& mode);
+
+// a tensor slice's quantized codes; dtype is the wire DataType
+struct quantized_gradient {
+  int32_t dtype = 0;
+  size_t block = 0;
+  std::vector<unsigned char> codes;
+  std::vector<float> scales;
+};
+
+// whether a tensor of elements values called name is quantized under options
+bool quantizes(const QuantizeOptions& options, const std::string& name, size_t elements);
+
+// adds grad into residual, encodes residual into out and leaves the encoding error in residual
+void quantize(const float* grad, float* residual, size_t n, const QuantizeOptions& options, quantized_gradient& out);
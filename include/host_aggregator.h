@@ -0,0 +1,78 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <grpcpp/grpcpp.h>
+#include "peer.grpc.pb.h"
+#include "worker.h"
+
+struct HostAggregatorOptions {
+  size_t chunk_bytes = 1 << 20;  // payload per message between the leader and its members
+  int timeout_ms = 30000;        // how long the leader waits for members, and members for the leader's parameters
+};
+
+// Reduction among the workers sharing a host. The group's leader alone pulls from and pushes to the parameter
+// servers: it hands the parameters it pulled to the members and adds their gradients into its own push,
+// so the servers see one push and one pull per host instead of one per worker.
+// Every aggregating worker serves HostAggregator, as any of them may end up leading.
+class HostAggregator {
+  public:
+    explicit HostAggregator(const HostAggregatorOptions& options = HostAggregatorOptions());
+    ~HostAggregator();
+
+    // serves on address, "host:port" with port 0 picking a free one; the port served on, 0 on failure
+    int32_t start(const std::string& address);
+
+    // leader side
+
+    // parameters pulled for iteration, served to members asking for it or an earlier one; pushes of
+    // earlier iterations are turned away from here on
+    void publish(int iteration, std::shared_ptr<const std::vector<TensorLite>> params);
+    // adds the gradients of up to members members for iteration into sum, waiting for ones still on their way;
+    // how many were added. Calling it again for the same iteration adds the same gradients
+    size_t collect(int iteration, size_t members, std::vector<float>& sum);
+
+    // member side
+
+    void set_leader(const std::string& address);
+    // the parameters the leader pulled for iteration; served is the iteration they were pulled for, later
+    // than asked when the leader has moved on
+    bool pull(int worker_id, int iteration, std::vector<TensorLite>& params, int32_t& served);
+    // false, with skip_to set to where the leader is, when it has moved past iteration
+    bool push(int worker_id, int iteration, const std::vector<float>& grads, int32_t& skip_to);
+
+  private:
+    class service;
+    // members' gradients for one iteration, summed as they arrive
+    struct iteration_sum {
+      std::vector<float> sum;
+      std::map<int32_t, size_t> received;  // elements in so far, by member
+      size_t complete = 0;  // members whose gradients are all in
+    };
+
+    // called on the server's threads
+    bool deliver(const peer::LocalGradients& piece, int32_t& skip_to);
+    bool serve(const peer::LocalPullRequest& request, grpc::ServerWriter<peer::LocalParameters>* writer);
+
+    HostAggregatorOptions options_;
+    std::unique_ptr<service> service_;
+    std::unique_ptr<grpc::Server> server_;
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    bool stopping_ = false;
+    int published_iteration_ = -1;
+    std::shared_ptr<const std::vector<TensorLite>> published_;
+    std::map<int, iteration_sum> sums_;
+    // what the last collect took, for a retried push of the same iteration
+    int collected_iteration_ = -1;
+    iteration_sum collected_;
+
+    std::string leader_address_;
+    std::unique_ptr<peer::HostAggregator::Stub> leader_;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Vector loops of the aggregation path. The variant is picked at startup for the CPU we run on
+// (AVX-512, AVX2, NEON), with a portable scalar version that every variant must agree with.
+
+// acc[i] += inputs[0][i] + ... + inputs[count - 1][i], inputs are float32 payloads in host order,
+// possibly unaligned, read once each
+void sum_into(float* acc, const unsigned char* const* inputs, size_t count, size_t n);
+
+// Block-quantized gradients: each run of block elements shares one float32 scale. Codes are int8, value
+// code * scale, or one bit per element, least significant first, value scale when set and -scale when not.
+
+// acc[i] += value of element first + i for i < n; codes and scales start at element 0 and may be unaligned
+void sum_int8_into(float* acc, const unsigned char* codes, const unsigned char* scales, size_t block, size_t first, size_t n);
+void sum_sign_into(float* acc, const unsigned char* bits, const unsigned char* scales, size_t block, size_t first, size_t n);
+
+// encode n values with scale max |x| / 127, or mean |x| for signs, leaving the quantization error in values;
+// block must be a multiple of 8
+void quantize_int8(float* values, unsigned char* codes, float* scales, size_t n, size_t block);
+void quantize_sign(float* values, unsigned char* bits, float* scales, size_t n, size_t block);
+
+// 16-bit floats, bfloat16 when bf16 and IEEE binary16 otherwise, narrowed with round to nearest even.
+// 16-bit sides are host-order payloads and may be unaligned
+void widen_half(float* out, const unsigned char* in, bool bf16, size_t n);
+void narrow_half(unsigned char* out, const float* in, bool bf16, size_t n);
+// acc[i] += in[i] widened
+void sum_half_into(float* acc, const unsigned char* in, bool bf16, size_t n);
+
+// One fused optimizer step over g = scale * grad, for every optimizer the server runs:
+//   m = decay1 * m + gain1 * g          when m is given
+//   v = decay2 * v + gain2 * (g * g)    when v is given
+//   out = param - rate * (m, or g without it) / (sqrt(v) + epsilon, or 1 without v)
+struct step_params {
+  float scale = 1.0f;
+  float rate = 1.0f;
+  float decay1 = 0.0f;
+  float gain1 = 0.0f;
+  float decay2 = 0.0f;
+  float gain2 = 0.0f;
+  float epsilon = 0.0f;
+};
+
+// m and v hold n floats, or n bfloat16 (the high half of a float, rounded to nearest even) when bf16;
+// either may be null. Returns true if any element of out moved away from param.
+// nontemporal writes out around the cache, for tensors too large to be read back soon
+bool optimizer_step(float* out, const float* param, const float* grad, void* m, void* v, bool bf16,
+                    const step_params& p, size_t n, bool nontemporal);
+
+// tensors at least this large are written with non-temporal stores
+constexpr size_t kNontemporalBytes = 4 << 20;
+
+// "auto" or one of the variant names; false, and nothing changes, when this CPU cannot run it
+bool select_kernels(const std::string& name);
+const char* kernel_name();
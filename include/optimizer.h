@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+#include "kernels.h"
+
+// server-side optimizer, the defaults keep the plain param -= mean gradient update
+struct OptimizerOptions {
+  std::string name = "sgd";  // sgd, momentum, adam or adagrad
+  float learning_rate = 1.0f;
+  float momentum = 0.9f;     // momentum
+  float beta1 = 0.9f;        // adam
+  float beta2 = 0.999f;      // adam
+  float epsilon = 1e-8f;     // adam and adagrad
+  bool bf16_state = false;   // keep moments as bfloat16, half the memory for ~3 significant digits
+};
+
+bool valid_optimizer(const std::string& name);
+
+// Optimizer state of every parameter tensor, by the tensor's index in the snapshot. A tensor's moments
+// are one flat buffer, m then v, each in the tensor's element order, so a version block streams its
+// parameters, gradient sum and moments side by side through one fused kernel pass.
+// prepare() runs one tensor at a time; step() may run concurrently on disjoint ranges.
+// Copies share every tensor's moments: an update that finds its tensor's buffer still held by a copy steps
+// into a fresh one, taking each range over from the held buffer as it goes, so a copy keeps the moments of the
+// moment it was made for as long as it lives. It is cheap enough to take between two updates.
+class Optimizer {
+  public:
+    explicit Optimizer(const OptimizerOptions& options = OptimizerOptions());
+
+    const OptimizerOptions& options() const { return options_; }
+    // bytes of state kept per parameter element
+    size_t state_bytes() const;
+
+    // readies tensor index for this update: sizes its state to elements and advances its step count
+    void prepare(size_t index, size_t elements);
+    // out = param stepped by scale times the gradient sum, over [begin, end) of the tensor.
+    // Between two prepare() calls the ranges stepped cover the whole tensor. true if any element moved
+    bool step(size_t index, float* out, const float* param, const float* grad, float scale, size_t begin, size_t end,
+              bool nontemporal);
+    // after the last step() of this update, lets go of the moments a copy still holds
+    void finish(size_t index);
+    // forgets all state, when the tensor set is replaced
+    void reset();
+
+    // state goes after the tensors of a checkpoint
+    void save(std::ostream& out) const;
+    // false, with the state reset, when the checkpoint has no state for this optimizer and layout
+    bool load(std::istream& in, size_t num_tensors);
+
+  private:
+    struct tensor_state {
+      std::shared_ptr<uint16_t[]> words;  // m then v, two words per float moment and one per bf16 moment
+      std::shared_ptr<const uint16_t[]> held;  // the words a copy kept, read by this update's steps
+      size_t elements = 0;
+      int64_t steps = 0;
+    };
+
+    // hyperparameters of a tensor's steps-th update, scale left to the caller
+    step_params params_for(int64_t steps) const;
+    size_t moments() const { return (first_moment_ ? 1 : 0) + (second_moment_ ? 1 : 0); }
+    size_t words_per_element() const { return options_.bf16_state ? 1 : 2; }
+    size_t words_of(const tensor_state& state) const { return state.elements * moments() * words_per_element(); }
+
+    OptimizerOptions options_;
+    bool first_moment_;
+    bool second_moment_;
+    std::vector<tensor_state> state_;
+};
@@ -5,51 +5,291 @@
 #include <unordered_map>
 #include <mutex>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include "tensor_view.h"
+#include "optimizer.h"
+#include "work_stealing_pool.h"
+
+// elements per version block, pulls ship only the blocks that changed since the worker's version
+constexpr size_t kVersionBlockElements = 16384;
+// elements per reduction stripe, sized to stay in a core's cache while a push is added in
+constexpr size_t kReduceStripeElements = 32768;
+// iterations tracked at once; iteration i lives in slot i % kIterationSlots until a later lap reuses it
+constexpr int32_t kIterationSlots = 64;
+// worker ids an elastic server can admit; a fixed membership tracks ids below its worker count only
+constexpr int32_t kMaxWorkers = 1024;
+
+// How pushes from different workers are combined.
+//   bsp:   every worker's push of an iteration is averaged into one update, workers wait for the slowest
+//   async: each push is applied on its own as soon as it is in, nobody waits
+//   ssp:   applied like async, but a worker waits once it is more than staleness iterations ahead of
+//          the slowest worker's newest push
+// Under bsp a quorum below the worker count closes an iteration once that many pushes are in; each push
+// is then reduced on its own until it counts, and pushes arriving after the close are late.
+// An elastic server takes its workers from the coordinator's membership epochs instead of a fixed count:
+// an iteration waits for the workers that were members when it opened, minus any that left since.
+struct ConsistencyOptions {
+  std::string mode = "bsp";
+  int32_t staleness = 0;
+  int32_t quorum = 0;                // bsp: pushes an iteration waits for, 0 for every worker
+  std::string late_pushes = "drop";  // late pushes are dropped, or "next": folded into the next update
+  bool elastic = false;              // membership follows update_membership, worker ids below kMaxWorkers
+};
+
+bool valid_consistency_mode(const std::string& mode);
+bool valid_late_policy(const std::string& policy);
+
+// distribution of staleness samples in iterations, the last bucket collects everything at or beyond it
+class StalenessHistogram {
+  public:
+    static constexpr int kBuckets = 17;
+
+    void record(int32_t staleness);
+    uint64_t count() const { return total_.load(std::memory_order_relaxed); }
+    // "n=.. mean=.. p50=.. p90=.. p99=.. max=..", percentiles by bucket
+    std::string summary() const;
+
+  private:
+    std::atomic<uint64_t> counts_[kBuckets] = {};
+    std::atomic<uint64_t> total_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<int32_t> max_{0};
+};
 
 struct tensor {
   std::string name;
   std::vector<int32_t> shape;
   std::vector<float> data;
   int32_t dtype;
+  int64_t version = 0;                  // snapshot version that last changed any element
+  std::vector<int64_t> block_versions;  // the same per kVersionBlockElements elements
+};
+
+// elements [begin, end) of a snapshot's tensor at index tensor
+struct tensor_range {
+  size_t tensor;
+  size_t begin;
+  size_t end;
+};
+
+// Immutable published parameters. Readers hold the pointer as long as they need it, updates build the
+// next version and swap it in; tensors an update did not touch are shared between versions.
+struct parameter_snapshot {
+  int64_t version = 0;
+  int32_t iteration = -1;  // newest iteration folded in, -1 before the first update
+  int32_t synced_iteration = -1;  // newest iteration whose pushes from every worker are all folded in
+  int64_t layout_version = 0;  // newest version that replaced the tensor set, deltas cannot reach across it
+  std::vector<std::shared_ptr<const tensor>> tensors;
+
+  // merged runs of blocks changed after known_version, known_version 0 gives every tensor whole
+  std::vector<tensor_range> changed_since(int64_t known_version) const;
+};
+
+// Everything a checkpoint holds, taken at one point between two updates: the published parameters, the optimizer
+// state that produced them and the iteration training resumes from.
+struct checkpoint_image {
+  int32_t epoch = 0;
+  int32_t iteration = 0;
+  std::shared_ptr<const parameter_snapshot> snapshot;
+  std::shared_ptr<const Optimizer> optimizer;
 };
 
 // Central parameter server that coordinates distributed training.
 class ParameterServerCore {
   public:
   
-    ParameterServerCore(int total_workers);
+    // aggregation_threads == 0 means one per core
+    explicit ParameterServerCore(int total_workers, size_t aggregation_threads = 0,
+                                 const OptimizerOptions& optimizer = OptimizerOptions(),
+                                 const ConsistencyOptions& consistency = ConsistencyOptions());
     ~ParameterServerCore();
 
     void initialize_parameters(const std::vector<tensor>& initial_params);
     
-    // receive gradients from a worker and aggregate when all workers have sent theirs
-    bool receive_gradients(int32_t worker_id, int32_t iteration, const std::vector<tensor>& gradients);
+    // fold a worker's gradients into the iteration's running sum, in parallel and outside the slot lock.
+    // The last push queues the update on the aggregation pool and returns without waiting for it,
+    // check_sync_status reports the iteration once the update is published. Sparse views are added entry by entry
+    bool receive_gradients(int32_t worker_id, int32_t iteration, const std::vector<tensor_view>& gradients, int32_t& workers_received);
+    
+    // chunked push: reduces the pieces of chunk `sequence` as they arrive, the push counts once the last chunk is in.
+    // chunks out of sequence are ignored, the worker resumes from next_gradient_chunk()
+    bool receive_gradient_chunk(int32_t worker_id, int32_t iteration, int64_t sequence,
+                                const std::vector<tensor_piece>& pieces, bool last, int32_t& workers_received);
+    // first chunk not yet reduced for the worker, -1 once its whole push is in; wait-free
+    int64_t next_gradient_chunk(int32_t worker_id, int32_t iteration) const;
+    // true when the worker's push of iteration came in after a quorum had closed the iteration, or, when
+    // elastic, after the iteration was applied: a worker that joined mid-job catches up with the others
+    bool late_push(int32_t worker_id, int32_t iteration) const;
+    uint64_t late_pushes() const { return late_pushes_.load(std::memory_order_relaxed); }
     
-    //send the current model parameters to workers
-    std::vector<tensor> serve_parameters(int32_t iteration);
+    // current published parameters, never blocks on an update or a checkpoint
+    std::shared_ptr<const parameter_snapshot> serve_parameters() const;
     
-    bool check_sync_status(int32_t iteration, int32_t& workers_received);
+    // true once the iteration's update is published; wait-free, pollers never contend with pushes.
+    // Under async and ssp: true once a worker that pushed iteration may go on to the next one
+    bool check_sync_status(int32_t iteration, int32_t& workers_received) const;
     
+    // iterations the snapshot lags behind what a pull for iteration should see, recorded in pull_staleness()
+    int32_t staleness_of(const parameter_snapshot& snapshot, int32_t iteration);
+    const StalenessHistogram& pull_staleness() const { return pull_staleness_; }
+    // per applied push under async and ssp: iterations the fastest worker was ahead of it
+    const StalenessHistogram& gradient_staleness() const { return gradient_staleness_; }
+    
+    // elastic: the workers taking part in iterations opened from now on. Open iterations stop waiting for
+    // workers that left, newcomers count from the next one. false for a fixed membership or a stale epoch
+    bool update_membership(int64_t epoch, const std::vector<int32_t>& worker_ids);
+    int64_t membership_epoch() const { return membership_epoch_.load(std::memory_order_acquire); }
+    
+    // capture and write in one go, on the caller's thread
     bool save_checkpoint(int32_t epoch, const std::string& path);
+    // holds off updates only while the optimizer state is copied, the parameters are shared with the snapshot
+    checkpoint_image capture_checkpoint(int32_t epoch);
+    // written to a temporary file, synced and renamed over path, so path holds a whole checkpoint or the last one
+    bool write_checkpoint(const checkpoint_image& image, const std::string& path);
     bool load_checkpoint(const std::string& path, int32_t& epoch);
+    // the published snapshot once its version is past after_version, or whatever is published when timeout ends
+    std::shared_ptr<const parameter_snapshot> wait_for_update(int64_t after_version, std::chrono::milliseconds timeout) const;
     
-    int get_total_workers() const { return total_workers_; }
-    int32_t get_current_iteration() const { return current_iteration_; }
+    int get_total_workers() const { return total_workers_.load(std::memory_order_acquire); }
+    // random per process, snapshot versions only compare within one incarnation
+    uint64_t incarnation() const { return incarnation_; }
+    int32_t get_current_iteration() const { return current_iteration_.load(std::memory_order_relaxed); }
+    size_t aggregation_threads() const { return aggregation_pool_.size(); }
+    const OptimizerOptions& optimizer() const { return optimizer_.options(); }
+    const ConsistencyOptions& consistency() const { return consistency_; }
 
   private:
-    void aggregate_gradients(const std::vector<tensor>& gradients);
+    struct accumulator_slot;
+    struct iteration_sums;
+    struct iteration_slot;
+    struct worker_push;
+    
+    // steps the optimizer with the gradient sums times scale and publishes the result as the next snapshot,
+    // callers serialize through update_mutex_
+    void aggregate_gradients(std::vector<tensor>&& gradients, int32_t iteration, int32_t synced_iteration, float scale);
+    void publish(std::shared_ptr<const parameter_snapshot> snapshot);
+    iteration_slot& slot_for(int32_t iteration) const;
+    // claims the slot for iteration when its previous iteration is done; false when workers_received and
+    // complete already hold the answer. Caller holds slot.mutex
+    bool open_push(iteration_slot& slot, int32_t iteration, int32_t worker_id, int32_t& workers_received, bool& complete);
+    // accumulator of every piece's tensor, created on first sight; under the slot's mutex
+    std::vector<accumulator_slot*> slots_for(iteration_sums& sums, const std::vector<tensor_piece>& pieces);
+    // adds the pieces into their accumulators across the aggregation pool, without any slot lock
+    void reduce(const std::vector<accumulator_slot*>& slots, const std::vector<tensor_piece>& pieces);
+    // true when worker_id belongs to the membership the slot's iteration opened with
+    bool member_of(const iteration_slot& slot, int32_t worker_id) const;
+    // pushes that close the slot's iteration; under its mutex
+    int32_t needed(const iteration_slot& slot) const;
+    // queues the update of the slot's iteration; under its mutex
+    void close_iteration(iteration_slot& slot);
+    // elastic: lowers what an open iteration waits for once workers left, closing it if that was all
+    void release_departed(iteration_slot& slot);
+    // counts a reduced push, the last one queues the update
+    void finish_push(iteration_slot& slot, int32_t iteration, uint64_t generation, bool counted, int32_t& workers_received);
+    // applies the summed pushes of an iteration, plus whatever late pushes were carried over to it
+    void apply_iteration(iteration_slot& slot, int32_t iteration, int32_t pushes, uint64_t generation,
+                         const std::vector<std::shared_ptr<iteration_sums>>& sums);
+    // async and ssp: a worker's push, or one chunk of it, reduced into its own sums; the last piece queues
+    // apply_push. Stands in for the ring in those modes
+    bool receive_own_push(int32_t worker_id, int32_t iteration, int64_t sequence, const std::vector<tensor_piece>& pieces,
+                          bool last, int32_t& workers_received);
+    // reduces a push, or one chunk of it, into the worker's own sums; true, with sums and generation set,
+    // for the call that brought its last piece in
+    bool reduce_own_push(int32_t worker_id, int32_t iteration, int64_t sequence, const std::vector<tensor_piece>& pieces,
+                         bool last, std::shared_ptr<iteration_sums>& sums, uint64_t& generation);
+    // bsp with a quorum: counts a worker's whole push towards its iteration, the quorum-th one queues the
+    // update. A push for a closed iteration is late, true tells the worker to move on
+    bool count_quorum_push(int32_t worker_id, int32_t iteration, uint64_t generation,
+                           const std::shared_ptr<iteration_sums>& sums, int32_t& workers_received);
+    void apply_push(int32_t worker_id, int32_t iteration, uint64_t generation, const std::shared_ptr<iteration_sums>& sums);
+    // ssp and async readiness of a worker that pushed iteration, and how many workers have pushed it
+    bool may_proceed(int32_t iteration, int32_t& workers_received) const;
+    static std::vector<tensor> take_sums(iteration_sums& sums);
+    // adds more into gradients tensor by tensor, tensors gradients lacks are appended
+    static void add_sums(std::vector<tensor>& gradients, std::vector<tensor>&& more);
     
-    int total_workers_;
-    std::vector<tensor> parameters_;
-    std::mutex params_mutex_;
+    int32_t capacity_;  // worker ids below this have per-worker state
+    std::atomic<int32_t> total_workers_;
+    ConsistencyOptions consistency_;
+    bool independent_pushes_;  // async or ssp
+    bool quorum_pushes_;       // bsp with a quorum, pushes are reduced per worker
+    uint64_t incarnation_;
+    // read and swapped with std::atomic_load/atomic_store only
+    std::shared_ptr<const parameter_snapshot> snapshot_;
+    std::mutex update_mutex_;      // one writer of snapshot_ at a time
+    Optimizer optimizer_;          // moments by snapshot tensor index, under update_mutex_
+    std::mutex checkpoint_mutex_;  // one checkpoint file write at a time, never held by pulls or updates
+    // wait_for_update sleeps on published_ until publish moves snapshot_ on
+    mutable std::mutex published_mutex_;
+    mutable std::condition_variable published_;
     
-    struct iteration_state {
-      std::unordered_map<int32_t, std::vector<tensor>> worker_gradients;
-      bool aggregated;
+    // running sum of one tensor, pushes add into different stripes of it at the same time
+    struct accumulator_slot {
+      tensor sum;
+      size_t total_elements = 0;
+      std::once_flag allocated;  // the first reducer allocates sum.data, outside any slot lock
+      std::vector<std::mutex> stripes;  // one per kReduceStripeElements
     };
     
-    std::unordered_map<int32_t, iteration_state> iteration_states_;
-    std::mutex state_mutex_;
-    int32_t current_iteration_;
+    // accumulators of one iteration, pushes still reducing keep theirs alive across a checkpoint load
+    struct iteration_sums {
+      std::vector<std::unique_ptr<accumulator_slot>> slots;  // in order of first arrival
+      std::unordered_map<std::string, size_t> index;         // tensor name -> slots index
+    };
+    
+    // One ring entry. Readers load iteration, the status fields, then iteration again, and fall back to
+    // last_aggregated_iteration_ when the slot moved on meanwhile; they never lock. mutex only orders
+    // the claims and counts of this one iteration's pushes.
+    struct iteration_slot {
+      std::atomic<int32_t> iteration{-1};
+      std::atomic<int32_t> workers_received{0};
+      std::atomic<bool> aggregated{false};
+      std::atomic<int64_t> epoch{0};  // membership the iteration opened with
+      int32_t expected = 0;  // pushes the iteration waits for, less a quorum
+      bool closed = false;  // quorum: the update is queued, later pushes are late
+      std::vector<std::shared_ptr<iteration_sums>> pushed;  // quorum: the counted pushes' own sums
+      std::unique_ptr<std::atomic<int64_t>[]> next_chunk;  // per worker id, -1 once the worker's whole push is in
+      std::mutex mutex;
+      std::shared_ptr<iteration_sums> sums;
+      uint64_t generation = 0;
+    };
+    
+    // async, ssp and quorum: the push each worker is sending, one at a time per worker
+    struct worker_push {
+      std::mutex mutex;
+      std::atomic<int32_t> iteration{-1};
+      std::atomic<int64_t> next_chunk{0};  // as iteration_slot::next_chunk, for iteration
+      std::atomic<bool> late{false};       // quorum: iteration closed before this push was in
+      std::shared_ptr<iteration_sums> sums;
+      uint64_t generation = 0;
+    };
+    
+    std::unique_ptr<iteration_slot[]> ring_;
+    // per worker id: membership epoch it joined in, -1 while not a member. Written under membership_mutex_
+    std::unique_ptr<std::atomic<int64_t>[]> joined_epoch_;
+    std::atomic<int64_t> membership_epoch_{0};
+    std::mutex membership_mutex_;
+    std::unique_ptr<worker_push[]> pushes_;
+    // per worker: newest iteration whose push is all in (async, ssp and quorum), and newest one applied
+    // (async and ssp, under update_mutex_)
+    std::unique_ptr<std::atomic<int32_t>[]> pushed_clock_;
+    std::vector<int32_t> applied_clock_;
+    // quorum, late pushes waiting for the next update; under carried_mutex_
+    std::mutex carried_mutex_;
+    std::vector<tensor> carried_;
+    int32_t carried_pushes_ = 0;
+    std::atomic<uint64_t> late_pushes_{0};
+    StalenessHistogram pull_staleness_;
+    StalenessHistogram gradient_staleness_;
+    std::atomic<int32_t> current_iteration_;
+    // newest applied iteration, anything at or below it that left the ring counts as complete
+    std::atomic<int32_t> last_aggregated_iteration_;
+    // bumped by load_checkpoint, updates and counts from before it are dropped
+    std::atomic<uint64_t> generation_;
+    
+    // declared last so it drains its queued updates while the rest of the core is still alive
+    WorkStealingPool aggregation_pool_;
 };
 
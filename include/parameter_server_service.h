@@ -1,6 +1,21 @@
 #pragma once
 
 #include <string>
+#include "optimizer.h"
+#include "parameter_server.h"
 
-void run_server(const std::string& server_address, int total_workers, int checkpoint_interval = 10);
+struct ServerOptions {
+  int completion_queues = 2;
+  int polling_threads = 1;    // per completion queue, they only dispatch completions
+  int executor_threads = 0;   // rpc handlers: decoding, bookkeeping and checkpoint work, 0 means one per core
+  int aggregation_threads = 0;  // work-stealing pool reducing pushes and applying updates, 0 means one per core
+  int preposted_calls = 8;    // requests kept armed per method and queue, absorbs bursts of new calls
+  bool pin_threads = true;    // pin polling threads to cores
+  OptimizerOptions optimizer;  // applied on the server, fused with gradient averaging
+  ConsistencyOptions consistency;  // when a worker may move on to its next iteration
+  bool shared_memory = true;  // serve workers on this machine through shared memory regions they hand over
+};
 
+// shard_id < 0 means this is the only parameter server of the job
+void run_server(const std::string& server_address, int total_workers, int checkpoint_interval = 10, int shard_id = -1,
+                const ServerOptions& options = ServerOptions());
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <grpcpp/grpcpp.h>
+#include "peer.grpc.pb.h"
+
+struct RingOptions {
+  size_t segment_bytes = 1 << 20;  // payload per message a ring step is cut into
+  int step_timeout_ms = 30000;     // how long a step waits for the left neighbour before the ring counts as broken
+};
+
+// One worker's part in a ring all-reduce: a reduce-scatter then an all-gather of n - 1 steps each, so every
+// worker sends and receives 2 (n - 1) / n of the buffer however many workers there are. The worker serves
+// PeerWorker for its left neighbour's segments and sends its own to the right neighbour.
+class RingAllreduce {
+  public:
+    explicit RingAllreduce(const RingOptions& options = RingOptions());
+    ~RingAllreduce();
+
+    // serves on address, "host:port" with port 0 picking a free one; the port served on, 0 on failure
+    int32_t start(const std::string& address);
+
+    // this worker is at position rank of addresses, listed in ring order; members of one epoch agree on them
+    void set_ring(int64_t epoch, size_t rank, const std::vector<std::string>& addresses);
+    size_t size() const { return size_; }
+
+    // sums data elementwise over every member of the ring, in place. False when a neighbour did not
+    // answer in time, data is then partly reduced and has to be rebuilt
+    bool allreduce(int iteration, std::vector<float>& data);
+
+  private:
+    class service;
+    // (epoch, iteration, step)
+    using step_key = std::tuple<int64_t, int32_t, int32_t>;
+    struct inbox {
+      std::vector<peer::RingSegment> pieces;
+      size_t elements = 0;
+    };
+
+    // called on the server's threads with a piece sent by the left neighbour
+    bool deliver(peer::RingSegment&& piece);
+    bool send(int iteration, int step, const float* segment, size_t elements);
+    // waits for the whole segment of step and adds it into segment, or copies it over when add is false
+    bool receive(int iteration, int step, float* segment, size_t elements, bool add);
+
+    RingOptions options_;
+    std::unique_ptr<service> service_;
+    std::unique_ptr<grpc::Server> server_;
+
+    // ring state, only touched by the thread running allreduce
+    int64_t epoch_ = -1;
+    size_t rank_ = 0;
+    size_t size_ = 0;
+    std::string right_address_;
+    std::unique_ptr<peer::PeerWorker::Stub> right_;
+
+    std::mutex inbox_mutex_;
+    std::condition_variable arrived_;
+    std::map<step_key, inbox> inboxes_;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Client side view of how tensors are partitioned across parameter server shards.
+// Small tensors live whole on the shard picked by a stable hash of their name,
+// tensors of at least split_threshold_bytes are cut into one contiguous range per shard.
+class ShardMap {
+  public:
+    ShardMap();
+    ShardMap(const std::vector<std::string>& addresses, int64_t split_threshold_bytes);
+
+    size_t num_shards() const { return addresses_.size(); }
+    bool empty() const { return addresses_.empty(); }
+    const std::string& address(size_t shard) const { return addresses_[shard]; }
+    const std::vector<std::string>& addresses() const { return addresses_; }
+
+    // true if a tensor of this many float elements is split across every shard
+    bool is_split(size_t num_elements) const;
+
+    // shard that owns an unsplit tensor
+    size_t shard_for_name(const std::string& name) const;
+
+    // element range [begin, end) of a split tensor that lives on the given shard
+    void split_range(size_t num_elements, size_t shard, size_t& begin, size_t& end) const;
+
+    // per-shard checkpoint file derived from a job-wide checkpoint path
+    std::string shard_checkpoint_path(const std::string& path, size_t shard) const;
+
+  private:
+    std::vector<std::string> addresses_;
+    int64_t split_threshold_bytes_;
+};
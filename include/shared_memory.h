@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <grpcpp/grpcpp.h>
+
+// Raw methods a shared-memory lane carries; everything else stays on gRPC.
+enum class shm_op : uint32_t {
+  none = 0,
+  receive_gradients = 1,
+  serve_parameters = 2,
+  check_sync_status = 3,
+};
+
+// the op for a full method name such as "/parameter_server.ParameterServer/ServeParameters"
+shm_op shm_op_for(const std::string& method);
+
+// "localhost", loopback addresses and hostname, the peers a region can be shared with
+bool is_local_address(const std::string& address, const std::string& hostname);
+
+struct shm_region;
+
+// Worker side of one shared-memory lane to a parameter server on the same machine. Requests and replies are the
+// same bytes the raw gRPC methods carry, copied once into the region instead of through the loopback TCP stack;
+// a lock-free ring of descriptors each way says what is there, with a futex wakeup when the other side sleeps.
+// One call is in flight at a time; a lane that times out or loses its server is given up for good.
+class SharedMemoryChannel {
+  public:
+    ~SharedMemoryChannel();
+
+    // a region with capacity bytes each way, nullptr when it cannot be created. It is unlinked once attached
+    // (or when the channel goes), so the name only has to live until the server has mapped it
+    static std::unique_ptr<SharedMemoryChannel> create(size_t capacity);
+
+    const std::string& name() const { return name_; }
+    uint64_t token() const;
+    void unlink();
+
+    // largest request or reply the region holds
+    size_t capacity() const;
+    bool usable() const { return !failed_; }
+
+    // waits for the reply until deadline or the server process exits; broken() is asked too while waiting, for
+    // servers whose pid is not visible from here
+    grpc::Status call(shm_op op, const grpc::ByteBuffer& request, grpc::ByteBuffer* response,
+                      std::chrono::system_clock::time_point deadline, const std::function<bool()>& broken);
+
+  private:
+    SharedMemoryChannel() = default;
+
+    std::string name_;
+    shm_region* region_ = nullptr;
+    size_t mapped_bytes_ = 0;
+    size_t capacity_ = 0;
+    uint64_t sequence_ = 0;
+    bool watch_server_ = false;
+    std::atomic<bool> failed_{false};
+    std::mutex mutex_;
+};
+
+// Parameter server side: one thread per attached region, answering requests with handler.
+class SharedMemoryServer {
+  public:
+    using handler = std::function<grpc::Status(shm_op op, const grpc::ByteBuffer& request, grpc::ByteBuffer& response)>;
+
+    explicit SharedMemoryServer(handler handle);
+    ~SharedMemoryServer();
+
+    // maps the region a worker created under name; false when it is not on this machine or token does not match
+    bool attach(const std::string& name, uint64_t token);
+
+  private:
+    struct lane;
+
+    void serve(lane* l);
+
+    handler handle_;
+    std::atomic<bool> stopping_{false};
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<lane>> lanes_;
+};
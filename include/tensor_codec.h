@@ -0,0 +1,117 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <grpcpp/support/byte_buffer.h>
+#include <grpcpp/support/slice.h>
+#include <google/protobuf/message_lite.h>
+#include "parameter_server.pb.h"
+#include "tensor_view.h"
+
+// Wire helpers for the packed Tensor encoding (raw_data + byte_order in parameter_server.proto).
+// The writer hands tensor memory to gRPC as slices instead of copying it into a protobuf, and the
+// reader walks the received slices and points tensor_views straight into them.
+
+class TensorPayloadWriter {
+  public:
+    // without an envelope the writer only produces tensor fields, see finish_slices()
+    TensorPayloadWriter();
+    // envelope carries every non-tensor field of the message
+    explicit TensorPayloadWriter(const google::protobuf::MessageLite& envelope);
+
+    // appends a float32 Tensor to repeated field field_number; the payload is referenced, not copied,
+    // and owner keeps it alive until gRPC lets go of the slice. A null owner copies the payload.
+    // With dtype DT_FLOAT16 or DT_BFLOAT16 the values are narrowed into a buffer of the writer's instead
+    void add_tensor(int field_number, const std::string& name, const std::vector<int32_t>& shape,
+                    const float* data, size_t size, std::shared_ptr<const void> owner,
+                    int32_t dtype = parameter_server::DT_FLOAT32);
+
+    // appends a sparse float32 Tensor of nnz entries at ascending indices into a dense_size tensor,
+    // indices and values are referenced through owner like add_tensor's payload
+    void add_sparse_tensor(int field_number, const std::string& name, const std::vector<int32_t>& shape,
+                           const uint32_t* indices, const float* values, size_t nnz, size_t dense_size,
+                           std::shared_ptr<const void> owner);
+
+    // appends a block-quantized Tensor of elements values, dtype DT_INT8_BLOCK or DT_SIGN_BLOCK, with one
+    // scale per block elements; codes and scales are referenced through owner
+    void add_quantized_tensor(int field_number, const std::string& name, const std::vector<int32_t>& shape, int32_t dtype,
+                              const unsigned char* codes, size_t code_bytes, const float* scales, size_t block,
+                              size_t elements, std::shared_ptr<const void> owner);
+
+    // appends a TensorChunk holding elements [begin, end) of a float32 tensor of total elements, sent as dtype
+    void add_tensor_chunk(int field_number, const std::string& name, const std::vector<int32_t>& shape,
+                          const float* data, size_t begin, size_t end, size_t total, std::shared_ptr<const void> owner,
+                          int32_t dtype = parameter_server::DT_FLOAT32);
+
+    grpc::ByteBuffer finish();
+    // the encoded fields as slices, to be reused behind different envelopes with assemble_message()
+    std::vector<grpc::Slice> finish_slices();
+
+  private:
+    static std::string tensor_header(const std::string& name, const std::vector<int32_t>& shape,
+                                     int32_t dtype = parameter_server::DT_FLOAT32);
+    static size_t payload_field_size(int field, size_t payload_bytes);
+    // n values as dtype elements; float32 stays in place, 16-bit floats go to a new buffer that replaces owner
+    static const void* encode_elements(const float* data, size_t n, int32_t dtype, std::shared_ptr<const void>& owner);
+    void append_payload(int field, const void* data, size_t payload_bytes, std::shared_ptr<const void> owner);
+    void flush_pending();
+
+    std::string pending_;  // framing and small payloads not yet turned into a slice
+    std::vector<grpc::Slice> slices_;
+};
+
+class TensorPayloadReader {
+  public:
+    // parses every field except tensor_field into envelope; tensors become views into buffer,
+    // which stays referenced for the lifetime of the reader
+    bool parse(const grpc::ByteBuffer& buffer, int tensor_field, google::protobuf::MessageLite* envelope);
+
+    const std::vector<tensor_view>& tensors() const { return tensors_; }
+
+  private:
+    std::vector<grpc::Slice> slices_;
+    // payloads that straddled two slices or needed a byte order or dtype conversion
+    std::deque<std::vector<unsigned char>> owned_;
+    std::vector<tensor_view> tensors_;
+};
+
+// ByteOrder value describing this machine
+int32_t host_byte_order();
+
+// dense element types a float32 tensor can travel as, by flag name: fp32, fp16 or bf16
+bool parse_float_dtype(const std::string& name, int32_t& dtype);
+bool is_float_dtype(int32_t dtype);
+// bytes per element of a dense dtype
+size_t element_bytes(int32_t dtype);
+
+// plain messages for raw methods
+bool parse_message(const grpc::ByteBuffer& buffer, google::protobuf::MessageLite* message);
+grpc::ByteBuffer serialize_message(const google::protobuf::MessageLite& message);
+// envelope fields followed by pre-encoded fields, the body slices are shared rather than copied
+grpc::ByteBuffer assemble_message(const google::protobuf::MessageLite& envelope, const std::vector<grpc::Slice>& body);
+
+// element range [begin, end) of the tensor at index tensor, one entry of a chunk
+struct chunk_piece {
+  size_t tensor;
+  size_t begin;
+  size_t end;
+};
+
+// payload bytes per chunk when the caller does not ask for a size, well below the 4 MiB message limit
+const size_t kDefaultChunkBytes = 1 << 20;
+
+// cuts tensors with the given element counts into chunks of at most chunk_bytes payload;
+// small tensors share a chunk, large ones span several. Both sides derive the same plan.
+std::vector<std::vector<chunk_piece>> plan_chunks(const std::vector<size_t>& sizes, size_t chunk_bytes,
+                                                  size_t element_bytes = sizeof(float));
+
+// fills piece with elements [begin, end) of a float32 tensor of total elements, sent as dtype
+void set_tensor_chunk(parameter_server::TensorChunk* piece, const std::string& name, const std::vector<int32_t>& shape,
+                      const float* data, size_t begin, size_t end, size_t total,
+                      int32_t dtype = parameter_server::DT_FLOAT32);
+
+// views a typed Tensor's payload, converting into owned storage when it is not host-order float32 or 16-bit;
+// false for sparse and block-quantized tensors, which only travel through TensorPayloadReader
+bool view_tensor(const parameter_server::Tensor& t, tensor_view& view, std::deque<std::vector<unsigned char>>& owned);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include "kernels.h"
+
+// DataType values of the wire format the server core handles, mirrored here so the core needs no protobuf
+constexpr int32_t kDtypeFloat32 = 0;
+constexpr int32_t kDtypeInt8Block = 2;
+constexpr int32_t kDtypeSignBlock = 3;
+constexpr int32_t kDtypeFloat16 = 4;
+constexpr int32_t kDtypeBfloat16 = 5;
+
+// Read-only tensor whose payload is owned elsewhere, usually the received gRPC buffer. Dense payloads
+// are float32, or 16-bit floats (kDtypeFloat16, kDtypeBfloat16) widened as they are read.
+// The payload is in host byte order but may be unaligned, so read it through load()/copy_to().
+struct tensor_view {
+  std::string name;
+  std::vector<int32_t> shape;
+  int32_t dtype;
+  const unsigned char* data;
+  size_t size;  // number of elements
+  // sparse views: data holds nnz values, one per ascending element index here; size stays the dense
+  // element count, so load() and copy_to() address values by entry rather than by element
+  const unsigned char* indices = nullptr;
+  size_t nnz = 0;
+  // block-quantized views (dtype DT_INT8_BLOCK or DT_SIGN_BLOCK): data holds the codes of size elements,
+  // scales one host-order float32 per block of them
+  const unsigned char* scales = nullptr;
+  size_t block = 0;
+
+  uint32_t index(size_t j) const {
+    uint32_t v;
+    std::memcpy(&v, indices + j * sizeof(uint32_t), sizeof(uint32_t));
+    return v;
+  }
+
+  bool half() const { return dtype == kDtypeFloat16 || dtype == kDtypeBfloat16; }
+  size_t element_bytes() const { return half() ? sizeof(uint16_t) : sizeof(float); }
+
+  // float32 payloads only, which sparse values always are
+  float load(size_t i) const {
+    float v;
+    std::memcpy(&v, data + i * sizeof(float), sizeof(float));
+    return v;
+  }
+
+  void copy_to(float* out, size_t begin, size_t count) const {
+    if (half()) {
+      widen_half(out, data + begin * sizeof(uint16_t), dtype == kDtypeBfloat16, count);
+      return;
+    }
+    std::memcpy(out, data + begin * sizeof(float), count * sizeof(float));
+  }
+};
+
+// part of a larger tensor, as carried by the chunked streaming rpcs
+struct tensor_piece {
+  tensor_view view;       // shape is the whole tensor's shape, size is the piece's length
+  size_t offset;          // element offset of the piece in the whole tensor
+  size_t total_elements;
+};
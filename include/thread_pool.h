@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Fixed set of threads draining one task queue.
+class ThreadPool {
+  public:
+    // threads == 0 means one per core
+    explicit ThreadPool(size_t threads);
+    // runs whatever is still queued, then joins
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+    size_t size() const { return threads_.size(); }
+
+  private:
+    void run();
+
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_;
+};
+
+// best effort, a no-op where affinity is not supported
+void pin_thread_to_core(std::thread& thread, unsigned core);
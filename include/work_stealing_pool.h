@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Thread pool for the aggregation path. Every thread owns a deque and runs its newest task first,
+// an idle thread steals the oldest task of another, so tasks spawned by a task stay on its core.
+class WorkStealingPool {
+  public:
+    // threads == 0 means one per core
+    explicit WorkStealingPool(size_t threads);
+    // runs whatever is still queued, then joins
+    ~WorkStealingPool();
+
+    void submit(std::function<void()> task);
+    // runs fn(0) .. fn(count - 1) on the pool and the calling thread, returns once all of them have run
+    void parallel_for(size_t count, const std::function<void(size_t)>& fn);
+    size_t size() const { return threads_.size(); }
+
+  private:
+    struct task_queue {
+      std::mutex mutex;
+      std::deque<std::function<void()>> tasks;
+    };
+
+    // own queue from the back, then the others from the front
+    bool take(size_t self, std::function<void()>& task);
+    void run(size_t self);
+
+    std::vector<std::unique_ptr<task_queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex sleep_mutex_;
+    std::condition_variable cv_;
+    size_t queued_;  // guarded by sleep_mutex_
+    bool stopping_;
+    std::atomic<size_t> next_queue_;
+};
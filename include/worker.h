@@ -5,59 +5,193 @@
 #include <memory>
 #include <atomic>
 #include <thread>
+#include <functional>
+#include <unordered_map>
+
+#include "shard_map.h"
+#include "gradient_compression.h"
+#include "optimizer.h"
 
 #ifdef HAVE_NCCL
 #include "nccl_manager.h"
 #include <cuda_runtime.h>
 #endif
 
+class ConnectionManager;
+class RingAllreduce;
+class HostAggregator;
+
+struct WorkerOptions {
+  int ps_channels = 1;  // TCP connections kept open to each parameter server shard
+  size_t chunk_bytes = 1 << 20;  // payload per message on the chunked streaming rpcs
+  size_t stream_threshold_bytes = 3 << 20;  // shard payloads larger than this are streamed in chunks
+  // room each way in the shared memory lane paired with each channel to a parameter server on this machine;
+  // pushes, pulls and status polls then skip the loopback TCP stack, 0 keeps them on gRPC
+  size_t shared_memory_bytes = 16 << 20;
+  SparsifyOptions sparsify;  // push only the largest gradient entries, carrying the rest forward
+  QuantizeOptions quantize;  // push gradients as int8 or sign codes, carrying the rounding error forward
+  // DataType parameters are pulled and dense gradients pushed as: float32, or float16/bfloat16 for half the bytes
+  int32_t pull_dtype = 0;
+  int32_t push_dtype = 0;
+  // push in the background and prefetch the next iteration's parameters shard by shard as each applies the push
+  bool pipeline = false;
+  // gradients are pushed in buckets of this many bytes as backward produces them, 0 pushes them all at once;
+  // not combined with compression, which needs every gradient of a shard
+  size_t bucket_bytes = 0;
+  // "ps" pushes gradients to the parameter servers; "ring" sums them with a ring all-reduce among the workers
+  // instead, each worker applying optimizer to its own replica of the model pulled once at the start
+  std::string allreduce = "ps";
+  size_t ring_size = 1;  // under ring, members the ring waits for before its first iteration
+  OptimizerOptions optimizer;
+  // reduce with the other workers registered under the same hostname first; their leader alone pulls and pushes,
+  // so the parameter servers count one worker per host
+  bool local_aggregation = false;
+  std::string hostname;  // registered with the coordinator, the machine's own name when empty
+  size_t host_workers = 1;  // under local_aggregation, workers the host waits for before its first iteration
+};
+
 struct TensorLite {
   std::string name;
   std::vector<int32_t> shape;
   std::vector<float> data;
-  int32_t dtype;  // 0=float32, 1=float64
+  int32_t dtype;  // always 0 (float32): pulled 16-bit parameters are widened, pushed gradients narrowed on the wire
+};
+
+// one shard's slice of a tensor as a compressed push carries it: picked entries when sparsifying,
+// otherwise quantized codes, or the float32 values of a tensor left out of quantization
+struct CompressedSlice {
+  std::string name;
+  std::vector<int32_t> shape;
+  size_t dense_size;  // elements of the slice
+  bool sparse = false;
+  sparse_gradient entries;
+  quantized_gradient codes;
+  std::vector<float> values;
+
+  size_t wire_bytes() const;
+  // the slice as dense float32 values, for pushes too large for one message
+  std::vector<float> densify() const;
 };
 
 class Worker {
  public:
-  Worker(int worker_id, const std::string& coordinator_address, const std::string& worker_address = "", int32_t worker_port = 0);
+  Worker(int worker_id, const std::string& coordinator_address, const std::string& worker_address = "", int32_t worker_port = 0,
+         const WorkerOptions& options = WorkerOptions());
   
   bool initialize();
   bool reconnect();
 
   // run a single sync iteration: pull -> compute -> push -> check
+  // pipelined, it returns once the push is under way, false when the previous iteration's push did not go through
   bool run_iteration(int iteration);
+  // waits for a pipelined push still in flight; false when it did not go through
+  bool flush();
   
   // Load checkpoint from parameter server
   // Returns true if successful, and sets epoch to the loaded checkpoint epoch
   bool load_checkpoint_from_server(const std::string& checkpoint_path, int32_t& epoch);
   
+  // iterations of other workers' pushes the last pulled model was missing, the worst shard's
+  int32_t last_pull_staleness() const { return last_pull_staleness_; }
+  // set when the last push came after a quorum closed its iteration: where the other workers are, else -1
+  int32_t skip_to() const { return skip_to_; }
+  
   ~Worker();
 
  private:
   bool discover_parameter_server();
   bool register_with_coordinator();
-  std::vector<std::string> discover_peer_workers();
+  // asks the coordinator for the ring this worker belongs to, waiting until it has min_members
+  bool discover_ring(size_t min_members);
+  // asks the coordinator for this worker's host group and whether it leads it, waiting until it has min_members
+  bool discover_host_group(size_t min_members);
   bool query_with_retry(const std::function<bool()>& query_func, int max_retries = 5);
   void send_heartbeat();
   void heartbeat_loop();
   
+  struct shard_replies;
+  // called on a shard's thread once its push is in: whether the shard applied the iteration already, and
+  // where a late push has to skip to, -1 if it was not late
+  using shard_pushed = std::function<void(size_t shard, bool aggregated, int32_t skip_to)>;
+  
+  // sizes the per-shard pull state to the shard map
+  void prepare_pull();
+  bool fetch_shard(size_t shard, shard_replies& replies);
+  // shard payloads above this are streamed: stream_threshold_bytes, or more when a shared memory lane is attached
+  size_t unary_limit(size_t shard);
+  std::vector<TensorLite> assemble_pull(shard_replies& replies);
   std::vector<TensorLite> pull_parameters(int iteration);
+  // hands each gradient to ready as soon as it is final, in backward order: last tensor first
+  void compute_gradients(const std::vector<TensorLite>& params, const std::function<void(TensorLite&&)>& ready);
   std::vector<TensorLite> compute_gradients(const std::vector<TensorLite>& params);
-  bool push_gradients(int iteration, const std::vector<TensorLite>& grads, int& workers_received, int& total_workers);
+  // computes and pushes the gradients of params, bucket by bucket while backward runs when bucket_bytes is set
+  bool compute_and_push(int iteration, const std::vector<TensorLite>& params, int& workers_received, int& total_workers,
+                        int32_t& skip_to_iteration, const shard_pushed& pushed = nullptr);
+  bool push_gradients(int iteration, std::shared_ptr<const std::vector<TensorLite>> grads, int& workers_received,
+                      int& total_workers, int32_t& skip_to_iteration, const shard_pushed& pushed = nullptr);
+  bool run_pipelined_iteration(int iteration);
+  // compute -> ring all-reduce -> local update, the parameter servers only seed the replica
+  bool run_ring_iteration(int iteration);
+  // a host group member's iteration: pull from the leader -> compute -> push to the leader
+  bool run_member_iteration(int iteration);
+  // the pipelined push, run on inflight_
+  void push_and_prefetch(int iteration, std::vector<TensorLite> params);
+  bool wait_for_shard(size_t shard, int iteration);
   bool check_sync_ready(int iteration, int& workers_received, int& total_workers);
+  bool compresses() const { return options_.sparsify.mode != "none" || options_.quantize.mode != "none"; }
+  // compresses every shard's slices for pushing, folding what is left out into residuals_
+  std::vector<std::shared_ptr<const std::vector<CompressedSlice>>> compress_gradients(const std::vector<TensorLite>& grads);
+  
+  // run fn(shard) for every parameter server shard in parallel and wait for all of them
+  void for_each_shard(const std::function<void(size_t)>& fn);
   
 #ifdef HAVE_NCCL
   std::vector<TensorLite> aggregate_gradients_multi_gpu(const std::vector<TensorLite>& grads);
 #endif
 
   int worker_id_;
+  // id the parameter servers know this worker by: its own, or its host group's while it leads one
+  int server_id_;
   std::string coordinator_address_;
-  std::string ps_address_;
+  ShardMap shard_map_;
   std::string worker_address_;
   int32_t worker_port_;
+  WorkerOptions options_;
   bool initialized_;
   
+  std::unique_ptr<ConnectionManager> connections_;
+  // per shard, set once its parameters no longer fit a single response
+  std::vector<char> stream_pulls_;
+  // last assembled model and, per shard, the snapshot it holds; pulls only ask for what changed since
+  std::vector<TensorLite> model_;
+  std::vector<int64_t> known_versions_;
+  std::vector<uint64_t> known_incarnations_;
+  int32_t last_pull_staleness_ = 0;
+  int32_t skip_to_ = -1;
+  // error feedback: gradient mass not pushed yet, by tensor name
+  std::unordered_map<std::string, std::vector<float>> residuals_;
+  // slices compressed for compressed_iteration_, per shard; a retried push resends them rather than
+  // compressing again, which would count the residual twice
+  int compressed_iteration_ = -1;
+  std::vector<std::shared_ptr<const std::vector<CompressedSlice>>> compressed_push_;
+  // pipelined push in flight; what it sets is read only after it is joined
+  std::thread inflight_;
+  bool inflight_ok_ = true;
+  int32_t inflight_skip_to_ = -1;
+  std::unique_ptr<shard_replies> prefetched_;
+  // ring all-reduce mode: the peer service, this worker's replica and the update rule applied to it
+  std::unique_ptr<RingAllreduce> ring_;
+  bool ring_formed_ = false;
+  std::vector<TensorLite> replica_;
+  Optimizer replica_optimizer_;
+  // local aggregation: the group service and, as of the last look at the group, this worker's role in it
+  std::unique_ptr<HostAggregator> host_;
+  bool host_formed_ = false;
+  bool host_leader_ = false;
+  int32_t host_members_ = 1;
+  int32_t host_groups_ = 1;
+  int32_t host_total_workers_ = 1;
+  
   std::thread heartbeat_thread_;
   std::atomic<bool> running_;
   std::atomic<int32_t> current_status_;
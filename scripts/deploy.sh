@@ -128,7 +128,7 @@ start_service() {
   
   if [ "$role" = "coordinator" ]; then
     ssh -i "$KEY_FILE" -o StrictHostKeyChecking=no "$SSH_USER@$ip" \
-      "sudo COORDINATOR_PORT=50052 BINARY_PATH=/opt/parameter-server/coordinator LOG_FILE=/var/log/coordinator.log /opt/parameter-server/start_coordinator.sh"
+      "sudo COORDINATOR_PORT=50052 PS_ADDRESSES=$PS_ADDR BINARY_PATH=/opt/parameter-server/coordinator LOG_FILE=/var/log/coordinator.log /opt/parameter-server/start_coordinator.sh"
   elif [ "$role" = "parameter_server" ]; then
     ssh -i "$KEY_FILE" -o StrictHostKeyChecking=no "$SSH_USER@$ip" \
       "sudo PS_PORT=50051 TOTAL_WORKERS=$WORKER_COUNT CHECKPOINT_INTERVAL=$CHECKPOINT_INTERVAL BINARY_PATH=/opt/parameter-server/parameter_server LOG_FILE=/var/log/parameter_server.log /opt/parameter-server/start_parameter_server.sh"
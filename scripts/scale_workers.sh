@@ -7,6 +7,8 @@ TERRAFORM_DIR="$PROJECT_ROOT/terraform"
 BUILD_DIR="$PROJECT_ROOT/build"
 KEY_FILE="${KEY_FILE:-}"
 SSH_USER="${SSH_USER:-ubuntu}"
+# an elastic parameter server follows the coordinator's membership and is left running
+ELASTIC="${ELASTIC:-0}"
 ACTION="${1:-}"
 NEW_COUNT="${2:-}"
 
@@ -134,14 +136,17 @@ if [ "$ACTION" = "up" ]; then
     sleep 2
   done
   
-  echo "=== updating parameter server worker count ==="
-  ssh -i "$KEY_FILE" -o StrictHostKeyChecking=no "$SSH_USER@$PS_IP" \
-    "sudo pkill -f parameter_server"
-  sleep 2
-  
-  COORDINATOR_PRIVATE_IP=$(terraform output -raw coordinator_private_ip)
-  ssh -i "$KEY_FILE" -o StrictHostKeyChecking=no "$SSH_USER@$PS_IP" \
-    "sudo PS_PORT=50051 TOTAL_WORKERS=$NEW_COUNT CHECKPOINT_INTERVAL=10 BINARY_PATH=/opt/parameter-server/parameter_server LOG_FILE=/var/log/parameter_server.log /opt/parameter-server/start_parameter_server.sh"
+  if [ "$ELASTIC" = "1" ]; then
+    echo "=== new workers join the parameter server through the coordinator ==="
+  else
+    echo "=== updating parameter server worker count ==="
+    ssh -i "$KEY_FILE" -o StrictHostKeyChecking=no "$SSH_USER@$PS_IP" \
+      "sudo pkill -f parameter_server"
+    sleep 2
+    
+    ssh -i "$KEY_FILE" -o StrictHostKeyChecking=no "$SSH_USER@$PS_IP" \
+      "sudo PS_PORT=50051 TOTAL_WORKERS=$NEW_COUNT CHECKPOINT_INTERVAL=10 BINARY_PATH=/opt/parameter-server/parameter_server LOG_FILE=/var/log/parameter_server.log /opt/parameter-server/start_parameter_server.sh"
+  fi
   
   echo ""
   echo "=== scale up complete ==="
@@ -177,13 +182,17 @@ elif [ "$ACTION" = "down" ]; then
   echo "=== updating terraform state ==="
   terraform apply -var="worker_count=$NEW_COUNT" -auto-approve
   
-  echo "=== updating parameter server worker count ==="
-  ssh -i "$KEY_FILE" -o StrictHostKeyChecking=no "$SSH_USER@$PS_IP" \
-    "sudo pkill -f parameter_server"
-  sleep 2
-  
-  ssh -i "$KEY_FILE" -o StrictHostKeyChecking=no "$SSH_USER@$PS_IP" \
-    "sudo PS_PORT=50051 TOTAL_WORKERS=$NEW_COUNT CHECKPOINT_INTERVAL=10 BINARY_PATH=/opt/parameter-server/parameter_server LOG_FILE=/var/log/parameter_server.log /opt/parameter-server/start_parameter_server.sh"
+  if [ "$ELASTIC" = "1" ]; then
+    echo "=== removed workers leave the parameter server once the coordinator times them out ==="
+  else
+    echo "=== updating parameter server worker count ==="
+    ssh -i "$KEY_FILE" -o StrictHostKeyChecking=no "$SSH_USER@$PS_IP" \
+      "sudo pkill -f parameter_server"
+    sleep 2
+    
+    ssh -i "$KEY_FILE" -o StrictHostKeyChecking=no "$SSH_USER@$PS_IP" \
+      "sudo PS_PORT=50051 TOTAL_WORKERS=$NEW_COUNT CHECKPOINT_INTERVAL=10 BINARY_PATH=/opt/parameter-server/parameter_server LOG_FILE=/var/log/parameter_server.log /opt/parameter-server/start_parameter_server.sh"
+  fi
   
   echo ""
   echo "=== scale down complete ==="
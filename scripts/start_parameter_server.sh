@@ -4,13 +4,30 @@ set -e
 PS_PORT=${PS_PORT:-50051}
 TOTAL_WORKERS=${TOTAL_WORKERS:-3}
 CHECKPOINT_INTERVAL=${CHECKPOINT_INTERVAL:-10}
+SHARD_ID=${SHARD_ID:--1}
+COMPLETION_QUEUES=${COMPLETION_QUEUES:-2}
+POLLING_THREADS=${POLLING_THREADS:-1}
+EXECUTOR_THREADS=${EXECUTOR_THREADS:-0}
+AGGREGATION_THREADS=${AGGREGATION_THREADS:-0}
+KERNELS=${KERNELS:-auto}
+OPTIMIZER=${OPTIMIZER:-sgd}
+LEARNING_RATE=${LEARNING_RATE:-1.0}
+OPTIMIZER_STATE=${OPTIMIZER_STATE:-fp32}
+CONSISTENCY=${CONSISTENCY:-bsp}
+STALENESS=${STALENESS:-0}
+QUORUM=${QUORUM:-0}
+LATE_PUSHES=${LATE_PUSHES:-drop}
+ELASTIC=${ELASTIC:-0}
+SHARED_MEMORY=${SHARED_MEMORY:-1}
 BINARY_PATH=${BINARY_PATH:-/opt/parameter-server/parameter_server}
 LOG_FILE=${LOG_FILE:-/var/log/parameter_server.log}
 
 export LD_LIBRARY_PATH=/usr/local/cuda-12.3/lib64:/usr/local/nccl/lib:$LD_LIBRARY_PATH
 
+PS_FLAGS="--completion-queues=$COMPLETION_QUEUES --polling-threads=$POLLING_THREADS --executor-threads=$EXECUTOR_THREADS --aggregation-threads=$AGGREGATION_THREADS --kernels=$KERNELS --optimizer=$OPTIMIZER --learning-rate=$LEARNING_RATE --optimizer-state=$OPTIMIZER_STATE --consistency=$CONSISTENCY --staleness=$STALENESS --quorum=$QUORUM --late-pushes=$LATE_PUSHES --elastic=$ELASTIC --shared-memory=$SHARED_MEMORY"
+
 echo "starting parameter server on port $PS_PORT with $TOTAL_WORKERS workers" | tee -a "$LOG_FILE"
-nohup "$BINARY_PATH" "0.0.0.0:$PS_PORT" "$TOTAL_WORKERS" "$CHECKPOINT_INTERVAL" > "$LOG_FILE" 2>&1 &
+nohup "$BINARY_PATH" "0.0.0.0:$PS_PORT" "$TOTAL_WORKERS" "$CHECKPOINT_INTERVAL" "$SHARD_ID" $PS_FLAGS > "$LOG_FILE" 2>&1 &
 echo $! > /var/run/parameter_server.pid
 echo "parameter server started with PID $(cat /var/run/parameter_server.pid)"
 
@@ -7,6 +7,27 @@ ITERATIONS=${ITERATIONS:-100}
 WORKER_ADDR=${WORKER_ADDR:-""}
 WORKER_PORT=${WORKER_PORT:-0}
 CHECKPOINT_PATH=${CHECKPOINT_PATH:-""}
+PS_CHANNELS=${PS_CHANNELS:-1}
+CHUNK_BYTES=${CHUNK_BYTES:-1048576}
+STREAM_THRESHOLD_BYTES=${STREAM_THRESHOLD_BYTES:-3145728}
+SHARED_MEMORY_BYTES=${SHARED_MEMORY_BYTES:-16777216}
+SPARSIFY=${SPARSIFY:-none}
+SPARSIFY_RATIO=${SPARSIFY_RATIO:-0.01}
+SPARSIFY_THRESHOLD=${SPARSIFY_THRESHOLD:-0}
+PULL_DTYPE=${PULL_DTYPE:-fp32}
+PUSH_DTYPE=${PUSH_DTYPE:-fp32}
+QUANTIZE=${QUANTIZE:-none}
+QUANTIZE_BLOCK=${QUANTIZE_BLOCK:-256}
+QUANTIZE_MIN_ELEMENTS=${QUANTIZE_MIN_ELEMENTS:-4096}
+QUANTIZE_EXCLUDE=${QUANTIZE_EXCLUDE:-""}
+PIPELINE=${PIPELINE:-0}
+BUCKET_BYTES=${BUCKET_BYTES:-0}
+ALLREDUCE=${ALLREDUCE:-ps}
+RING_SIZE=${RING_SIZE:-1}
+OPTIMIZER=${OPTIMIZER:-sgd}
+LEARNING_RATE=${LEARNING_RATE:-1.0}
+LOCAL_AGGREGATION=${LOCAL_AGGREGATION:-0}
+HOST_WORKERS=${HOST_WORKERS:-1}
 BINARY_PATH=${BINARY_PATH:-/opt/parameter-server/worker_main}
 LOG_FILE=${LOG_FILE:-/var/log/worker_${WORKER_ID}.log}
 
@@ -17,12 +38,14 @@ fi
 
 export LD_LIBRARY_PATH=/usr/local/cuda-12.3/lib64:/usr/local/nccl/lib:$LD_LIBRARY_PATH
 
+WORKER_FLAGS="--ps-channels=$PS_CHANNELS --chunk-bytes=$CHUNK_BYTES --stream-threshold-bytes=$STREAM_THRESHOLD_BYTES --shared-memory-bytes=$SHARED_MEMORY_BYTES --pull-dtype=$PULL_DTYPE --push-dtype=$PUSH_DTYPE --sparsify=$SPARSIFY --sparsify-ratio=$SPARSIFY_RATIO --sparsify-threshold=$SPARSIFY_THRESHOLD --quantize=$QUANTIZE --quantize-block=$QUANTIZE_BLOCK --quantize-min-elements=$QUANTIZE_MIN_ELEMENTS --quantize-exclude=$QUANTIZE_EXCLUDE --pipeline=$PIPELINE --bucket-bytes=$BUCKET_BYTES --allreduce=$ALLREDUCE --ring-size=$RING_SIZE --optimizer=$OPTIMIZER --learning-rate=$LEARNING_RATE --local-aggregation=$LOCAL_AGGREGATION --host-workers=$HOST_WORKERS"
+
 echo "starting worker $WORKER_ID connecting to coordinator $COORDINATOR_ADDR" | tee -a "$LOG_FILE"
 
 if [ -n "$CHECKPOINT_PATH" ]; then
-  nohup "$BINARY_PATH" "$COORDINATOR_ADDR" "$WORKER_ID" "$ITERATIONS" "$WORKER_ADDR" "$WORKER_PORT" "$CHECKPOINT_PATH" > "$LOG_FILE" 2>&1 &
+  nohup "$BINARY_PATH" "$COORDINATOR_ADDR" "$WORKER_ID" "$ITERATIONS" "$WORKER_ADDR" "$WORKER_PORT" "$CHECKPOINT_PATH" $WORKER_FLAGS > "$LOG_FILE" 2>&1 &
 else
-  nohup "$BINARY_PATH" "$COORDINATOR_ADDR" "$WORKER_ID" "$ITERATIONS" "$WORKER_ADDR" "$WORKER_PORT" > "$LOG_FILE" 2>&1 &
+  nohup "$BINARY_PATH" "$COORDINATOR_ADDR" "$WORKER_ID" "$ITERATIONS" "$WORKER_ADDR" "$WORKER_PORT" $WORKER_FLAGS > "$LOG_FILE" 2>&1 &
 fi
 
 echo $! > /var/run/worker_${WORKER_ID}.pid
@@ -9,6 +9,7 @@ BIN_DIR="${BUILD_DIR}/bin"
 
 PS_ADDRESS="localhost:50051"
 COORDINATOR_ADDRESS="localhost:50052"
+NUM_PS_SHARDS=${NUM_PS_SHARDS:-1}
 TOTAL_WORKERS=2
 ITERATIONS=5
 
@@ -30,15 +31,30 @@ fi
 
 cd "$PROJECT_ROOT"
 
+# shard 0 keeps the default port, extra shards listen on 50061, 50071, ...
+PS_ADDRESSES="$PS_ADDRESS"
+for shard in $(seq 1 $((NUM_PS_SHARDS - 1))); do
+  PS_ADDRESSES="$PS_ADDRESSES,localhost:$((50051 + shard * 10))"
+done
+
 echo "starting coordinator on $COORDINATOR_ADDRESS..."
-"$BIN_DIR/coordinator" "$COORDINATOR_ADDRESS" "$PS_ADDRESS" > /tmp/coordinator.log 2>&1 &
+"$BIN_DIR/coordinator" "$COORDINATOR_ADDRESS" "$PS_ADDRESSES" > /tmp/coordinator.log 2>&1 &
 COORDINATOR_PID=$!
 
 sleep 1
 
-echo "starting parameter server on $PS_ADDRESS with $TOTAL_WORKERS workers..."
-"$BIN_DIR/parameter_server" "$PS_ADDRESS" "$TOTAL_WORKERS" > /tmp/ps.log 2>&1 &
-PS_PID=$!
+PS_PIDS=""
+shard=0
+for addr in ${PS_ADDRESSES//,/ }; do
+  echo "starting parameter server shard $shard on $addr with $TOTAL_WORKERS workers..."
+  if [ "$NUM_PS_SHARDS" -gt 1 ]; then
+    "$BIN_DIR/parameter_server" "$addr" "$TOTAL_WORKERS" 10 "$shard" > /tmp/ps$shard.log 2>&1 &
+  else
+    "$BIN_DIR/parameter_server" "$addr" "$TOTAL_WORKERS" > /tmp/ps$shard.log 2>&1 &
+  fi
+  PS_PIDS="$PS_PIDS $!"
+  shard=$((shard + 1))
+done
 
 sleep 2
 
@@ -53,9 +69,9 @@ echo "waiting for workers to complete..."
 wait $WORKER0_PID $WORKER1_PID
 
 echo "workers completed, stopping services..."
-kill $PS_PID 2>/dev/null || true
+kill $PS_PIDS 2>/dev/null || true
 kill $COORDINATOR_PID 2>/dev/null || true
-wait $PS_PID 2>/dev/null || true
+wait $PS_PIDS 2>/dev/null || true
 wait $COORDINATOR_PID 2>/dev/null || true
 
 echo ""
@@ -63,9 +79,12 @@ echo "coordinator log:"
 echo "---"
 cat /tmp/coordinator.log
 echo ""
-echo "parameter server log:"
-echo "---"
-cat /tmp/ps.log
+for shard in $(seq 0 $((NUM_PS_SHARDS - 1))); do
+  echo "parameter server shard $shard log:"
+  echo "---"
+  cat /tmp/ps$shard.log
+  echo ""
+done
 echo ""
 echo "worker 0 log:"
 echo "---"
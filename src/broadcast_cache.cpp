@@ -0,0 +1,122 @@
+#include "broadcast_cache.h"
+#include "tensor_codec.h"
+#include "parameter_server.pb.h"
+
+#include <algorithm>
+
+namespace {
+
+// 16-bit dtypes are narrowed here, once per version, from the float32 master parameters
+std::shared_ptr<BroadcastCache::body> encode_parameters(const std::shared_ptr<const parameter_snapshot>& snapshot,
+                                                        int64_t base_version, int32_t dtype) {
+  TensorPayloadWriter writer;
+  if (base_version == 0) {
+    for (const auto& t : snapshot->tensors) {
+      writer.add_tensor(parameter_server::ParameterUpdate::kParametersFieldNumber,
+                        t->name, t->shape, t->data.data(), t->data.size(), snapshot, dtype);
+    }
+  } else {
+    for (const auto& r : snapshot->changed_since(base_version)) {
+      const auto& t = *snapshot->tensors[r.tensor];
+      writer.add_tensor_chunk(parameter_server::ParameterUpdate::kBlocksFieldNumber, t.name, t.shape,
+                              t.data.data(), r.begin, r.end, t.data.size(), snapshot, dtype);
+    }
+  }
+  return std::make_shared<BroadcastCache::body>(writer.finish_slices());
+}
+
+std::shared_ptr<std::vector<BroadcastCache::body>> encode_chunks(const std::shared_ptr<const parameter_snapshot>& snapshot,
+                                                                 int64_t base_version, size_t chunk_bytes, int32_t dtype) {
+  // chunks are planned over the changed ranges, with base_version 0 those are the whole tensors
+  auto ranges = snapshot->changed_since(base_version);
+  std::vector<size_t> sizes;
+  sizes.reserve(ranges.size());
+  for (const auto& r : ranges) {
+    sizes.push_back(r.end - r.begin);
+  }
+
+  auto chunks = std::make_shared<std::vector<BroadcastCache::body>>();
+  for (const auto& plan : plan_chunks(sizes, chunk_bytes, element_bytes(dtype))) {
+    TensorPayloadWriter writer;
+    for (const auto& p : plan) {
+      const auto& r = ranges[p.tensor];
+      const auto& t = *snapshot->tensors[r.tensor];
+      writer.add_tensor_chunk(parameter_server::ParameterChunk::kPiecesFieldNumber, t.name, t.shape,
+                              t.data.data(), r.begin + p.begin, r.begin + p.end, t.data.size(), snapshot, dtype);
+    }
+    chunks->push_back(writer.finish_slices());
+  }
+  if (chunks->empty()) {
+    // the envelope alone still tells the worker its version
+    chunks->emplace_back();
+  }
+  return chunks;
+}
+
+}  // namespace
+
+BroadcastCache::BroadcastCache(int total_workers)
+  : total_workers_(total_workers), newest_version_(-1) {}
+
+void BroadcastCache::set_total_workers(int total_workers) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  total_workers_ = std::max(1, total_workers);
+}
+
+std::shared_ptr<const BroadcastCache::body> BroadcastCache::parameters(const std::shared_ptr<const parameter_snapshot>& snapshot,
+                                                                       int64_t base_version, int32_t dtype) {
+  key k(snapshot->version, base_version, 0, dtype);
+  return std::static_pointer_cast<const body>(take(k, [&]() -> std::shared_ptr<const void> {
+    return encode_parameters(snapshot, base_version, dtype);
+  }));
+}
+
+std::shared_ptr<const std::vector<BroadcastCache::body>> BroadcastCache::chunks(const std::shared_ptr<const parameter_snapshot>& snapshot,
+                                                                                int64_t base_version, size_t chunk_bytes,
+                                                                                int32_t dtype) {
+  key k(snapshot->version, base_version, chunk_bytes, dtype);
+  return std::static_pointer_cast<const std::vector<body>>(take(k, [&]() -> std::shared_ptr<const void> {
+    return encode_chunks(snapshot, base_version, chunk_bytes, dtype);
+  }));
+}
+
+std::shared_ptr<const void> BroadcastCache::take(const key& k, const std::function<std::shared_ptr<const void>()>& encode) {
+  std::promise<std::shared_ptr<const void>> built;
+  std::shared_future<std::shared_ptr<const void>> encoded;
+  bool encoder = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // a newer snapshot has been published, nobody can be handed the older ones any more
+    int64_t version = std::get<0>(k);
+    if (version > newest_version_) {
+      newest_version_ = version;
+      entries_.erase(entries_.begin(), entries_.lower_bound(key(version, 0, 0, 0)));
+    }
+    // a straggler that read an old snapshot is served without caching it again
+    if (version < newest_version_) {
+      encoder = true;
+      encoded = built.get_future().share();
+    } else {
+      // the first pull of a version encodes it outside the lock, the ones racing it wait on the same entry
+      auto& e = entries_[k];
+      if (!e.encoded.valid()) {
+        encoder = true;
+        e.encoded = built.get_future().share();
+      }
+      encoded = e.encoded;
+      if (++e.served >= total_workers_) {
+        entries_.erase(k);
+      }
+    }
+  }
+
+  if (encoder) {
+    try {
+      built.set_value(encode());
+    } catch (...) {
+      built.set_exception(std::current_exception());
+    }
+  }
+  return encoded.get();
+}
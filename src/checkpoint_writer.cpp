@@ -0,0 +1,50 @@
+#include "checkpoint_writer.h"
+
+#include <iostream>
+
+CheckpointWriter::CheckpointWriter(ParameterServerCore& ps) : ps_(ps), thread_(&CheckpointWriter::run, this) {}
+
+CheckpointWriter::~CheckpointWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  changed_.notify_all();
+  thread_.join();
+}
+
+void CheckpointWriter::submit(checkpoint_image image, const std::string& path) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (waiting_) {
+      std::cout << "checkpoint epoch " << next_.epoch << " skipped, the previous one is still being written" << std::endl;
+    }
+    next_ = std::move(image);
+    next_path_ = path;
+    waiting_ = true;
+  }
+  changed_.notify_all();
+}
+
+void CheckpointWriter::run() {
+  while (true) {
+    checkpoint_image image;
+    std::string path;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [&]() { return waiting_ || stopping_; });
+      if (!waiting_) {
+        return;
+      }
+      image = std::move(next_);
+      path = std::move(next_path_);
+      next_ = checkpoint_image();
+      waiting_ = false;
+    }
+    if (ps_.write_checkpoint(image, path)) {
+      std::cout << "saved checkpoint: " << path << " (epoch " << image.epoch << ")" << std::endl;
+    } else {
+      std::cout << "failed to save checkpoint: " << path << std::endl;
+    }
+  }
+}
@@ -0,0 +1,193 @@
+#include "connection_manager.h"
+#include "shared_memory.h"
+
+#include <chrono>
+#include <future>
+
+ConnectionManager::ConnectionManager(const std::string& coordinator_address, const ConnectionOptions& options)
+  : options_(options), coordinator_address_(coordinator_address), next_channel_(0) {
+  if (options_.channels_per_shard < 1) {
+    options_.channels_per_shard = 1;
+  }
+  coordinator_channel_ = create_channel(coordinator_address_);
+  coordinator_stub_ = coordinator::Coordinator::NewStub(coordinator_channel_);
+}
+
+std::shared_ptr<grpc::Channel> ConnectionManager::create_channel(const std::string& address) const {
+  grpc::ChannelArguments args;
+  args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, options_.keepalive_time_ms);
+  args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, options_.keepalive_timeout_ms);
+  args.SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+  args.SetInt(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+  args.SetInt(GRPC_ARG_INITIAL_RECONNECT_BACKOFF_MS, 100);
+  args.SetInt(GRPC_ARG_MAX_RECONNECT_BACKOFF_MS, 2000);
+  // without a local pool, channels to the same address would share one subchannel and one TCP connection
+  args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+  return grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args);
+}
+
+ConnectionManager::ps_connection ConnectionManager::open_ps_connection(const std::string& address, std::shared_ptr<grpc::Channel> channel) {
+  ps_connection conn;
+  conn.address = address;
+  conn.channel = std::move(channel);
+  conn.stub = parameter_server::ParameterServer::NewStub(conn.channel);
+  conn.generic = std::make_shared<grpc::GenericStub>(conn.channel);
+  return conn;
+}
+
+bool ConnectionManager::is_broken(const std::shared_ptr<grpc::Channel>& channel) {
+  grpc_connectivity_state state = channel->GetState(false);
+  return state == GRPC_CHANNEL_SHUTDOWN || state == GRPC_CHANNEL_TRANSIENT_FAILURE;
+}
+
+void ConnectionManager::set_parameter_servers(const std::vector<std::string>& addresses) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  std::vector<std::vector<ps_connection>> connections(addresses.size());
+  for (size_t shard = 0; shard < addresses.size(); ++shard) {
+    if (shard < ps_connections_.size() && !ps_connections_[shard].empty() &&
+        ps_connections_[shard][0].address == addresses[shard]) {
+      connections[shard] = std::move(ps_connections_[shard]);
+      continue;
+    }
+
+    for (int c = 0; c < options_.channels_per_shard; ++c) {
+      connections[shard].push_back(open_ps_connection(addresses[shard], create_channel(addresses[shard])));
+    }
+  }
+  ps_connections_ = std::move(connections);
+}
+
+std::shared_ptr<coordinator::Coordinator::Stub> ConnectionManager::coordinator() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return coordinator_stub_;
+}
+
+std::shared_ptr<parameter_server::ParameterServer::Stub> ConnectionManager::parameter_server(size_t shard) {
+  return parameter_server(shard, next_channel_++);
+}
+
+std::shared_ptr<parameter_server::ParameterServer::Stub> ConnectionManager::parameter_server(size_t shard, size_t channel) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (shard >= ps_connections_.size() || ps_connections_[shard].empty()) {
+    return nullptr;
+  }
+  auto& lanes = ps_connections_[shard];
+  return lanes[channel % lanes.size()].stub;
+}
+
+grpc::Status ConnectionManager::call_raw(size_t shard, const std::string& method, grpc::ClientContext* ctx,
+                                        const grpc::ByteBuffer& request, grpc::ByteBuffer* response) {
+  std::shared_ptr<grpc::Channel> channel;
+  std::shared_ptr<grpc::GenericStub> stub;
+  std::shared_ptr<parameter_server::ParameterServer::Stub> typed;
+  std::shared_ptr<SharedMemoryChannel> lane;
+  size_t index = 0;
+  bool attach = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (shard >= ps_connections_.size() || ps_connections_[shard].empty()) {
+      return grpc::Status(grpc::StatusCode::UNAVAILABLE, "unknown parameter server shard");
+    }
+    auto& lanes = ps_connections_[shard];
+    index = next_channel_++ % lanes.size();
+    ps_connection& conn = lanes[index];
+    if (conn.shared_memory && !conn.shared_memory->usable()) {
+      // the server went away under the lane, a restarted one may take a new region
+      conn.shared_memory.reset();
+      conn.shared_memory_tried = false;
+    }
+    attach = !conn.shared_memory_tried && options_.shared_memory_bytes > 0 &&
+             is_local_address(conn.address, options_.hostname);
+    conn.shared_memory_tried = true;
+    channel = conn.channel;
+    stub = conn.generic;
+    typed = conn.stub;
+    lane = conn.shared_memory;
+  }
+
+  if (attach) {
+    lane = attach_shared_memory(*typed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (shard < ps_connections_.size() && index < ps_connections_[shard].size() &&
+        ps_connections_[shard][index].channel == channel) {
+      ps_connections_[shard][index].shared_memory = lane;
+    }
+  }
+
+  shm_op op = shm_op_for(method);
+  if (lane && op != shm_op::none && request.Length() <= lane->capacity()) {
+    grpc::Status s = lane->call(op, request, response, ctx->deadline(), [&channel]() {
+      // an idle channel only notices a dead server when asked to connect
+      grpc_connectivity_state state = channel->GetState(true);
+      return state == GRPC_CHANNEL_SHUTDOWN || state == GRPC_CHANNEL_TRANSIENT_FAILURE;
+    });
+    if (lane->usable()) {
+      return s;
+    }
+    // lost mid-call, retried over gRPC; the server drops a push it already counted
+  }
+
+  std::promise<grpc::Status> done;
+  stub->UnaryCall(ctx, method, grpc::StubOptions(), &request, response,
+                  [&done](grpc::Status status) { done.set_value(std::move(status)); });
+  return done.get_future().get();
+}
+
+size_t ConnectionManager::shared_memory_capacity(size_t shard) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (shard >= ps_connections_.size() || ps_connections_[shard].empty()) {
+    return 0;
+  }
+  // every lane of the shard is made the same size, any attached one tells
+  for (const auto& conn : ps_connections_[shard]) {
+    if (conn.shared_memory && conn.shared_memory->usable()) {
+      return conn.shared_memory->capacity();
+    }
+  }
+  return 0;
+}
+
+std::shared_ptr<SharedMemoryChannel> ConnectionManager::attach_shared_memory(parameter_server::ParameterServer::Stub& stub) const {
+  std::shared_ptr<SharedMemoryChannel> lane = SharedMemoryChannel::create(options_.shared_memory_bytes);
+  if (!lane) {
+    return nullptr;
+  }
+  grpc::ClientContext ctx;
+  prepare_context(ctx);
+  parameter_server::SharedMemoryRequest req;
+  req.set_name(lane->name());
+  req.set_token(lane->token());
+  parameter_server::SharedMemoryResponse resp;
+  // older servers answer UNIMPLEMENTED, remote ones cannot open the name; both keep the lane on gRPC
+  bool attached = stub.AttachSharedMemory(&ctx, req, &resp).ok() && resp.attached();
+  // both sides have it mapped or never will, the name is not needed any more
+  lane->unlink();
+  return attached ? lane : nullptr;
+}
+
+void ConnectionManager::prepare_context(grpc::ClientContext& ctx) const {
+  ctx.set_wait_for_ready(true);
+  ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(options_.rpc_timeout_ms));
+}
+
+int ConnectionManager::reconnect() {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  int rebuilt = 0;
+  if (is_broken(coordinator_channel_)) {
+    coordinator_channel_ = create_channel(coordinator_address_);
+    coordinator_stub_ = coordinator::Coordinator::NewStub(coordinator_channel_);
+    rebuilt++;
+  }
+
+  for (auto& lanes : ps_connections_) {
+    for (auto& conn : lanes) {
+      if (is_broken(conn.channel)) {
+        conn = open_ps_connection(conn.address, create_channel(conn.address));
+        rebuilt++;
+      }
+    }
+  }
+  return rebuilt;
+}
@@ -1,16 +1,47 @@
 #include "coordinator.h"
 #include <algorithm>
 
-CoordinatorCore::CoordinatorCore(const std::string& ps_address, int32_t ps_port): ps_address_(ps_address), ps_port_(ps_port) {
+namespace {
+
+// epochs start from the wall clock so a restarted coordinator still supersedes what it pushed before
+int64_t initial_membership_epoch() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace
+
+CoordinatorCore::CoordinatorCore(const std::vector<ParameterServerShard>& ps_shards, int64_t split_threshold_bytes)
+  : ps_shards_(ps_shards), split_threshold_bytes_(split_threshold_bytes), membership_epoch_(initial_membership_epoch()) {
+  std::sort(ps_shards_.begin(), ps_shards_.end(), [](const ParameterServerShard& a, const ParameterServerShard& b) {
+    return a.shard_id < b.shard_id;
+  });
 }
 
 bool CoordinatorCore::register_worker(const WorkerRegistryEntry& worker_info, std::string& ps_address, int32_t& total_workers) {
   std::lock_guard<std::mutex> lock(workers_mutex_);
   
+  // group ids share the servers' id space with plain worker ids, so a job is all one or all the other
+  for (const auto& [id, info] : workers_) {
+    if (id != worker_info.worker_id && info.local_aggregation != worker_info.local_aggregation) {
+      return false;
+    }
+  }
+  
+  if (workers_.find(worker_info.worker_id) == workers_.end()) {
+    ++membership_epoch_;
+  }
   workers_[worker_info.worker_id] = worker_info;
   workers_[worker_info.worker_id].last_heartbeat = std::chrono::steady_clock::now();
+  if (worker_info.local_aggregation && host_groups_.find(worker_info.hostname) == host_groups_.end()) {
+    int32_t group_id = 0;
+    while (std::any_of(host_groups_.begin(), host_groups_.end(), [&](const auto& entry) { return entry.second == group_id; })) {
+      group_id++;
+    }
+    host_groups_[worker_info.hostname] = group_id;
+  }
+  release_empty_host_groups();
   
-  ps_address = ps_address_;
+  ps_address = ps_shards_.empty() ? "" : ps_shards_[0].address + ":" + std::to_string(ps_shards_[0].port);
   total_workers = static_cast<int32_t>(workers_.size());
   
   return true;
@@ -44,11 +75,19 @@ std::vector<WorkerRegistryEntry> CoordinatorCore::list_workers() {
 }
 
 bool CoordinatorCore::get_parameter_server_address(std::string& address, int32_t& port) {
-  address = ps_address_;
-  port = ps_port_;
+  if (ps_shards_.empty()) {
+    return false;
+  }
+  address = ps_shards_[0].address;
+  port = ps_shards_[0].port;
   return true;
 }
 
+std::vector<ParameterServerShard> CoordinatorCore::get_shard_map(int64_t& split_threshold_bytes) {
+  split_threshold_bytes = split_threshold_bytes_;
+  return ps_shards_;
+}
+
 void CoordinatorCore::remove_stale_workers(int64_t timeout_seconds) {
   std::lock_guard<std::mutex> lock(workers_mutex_);
   
@@ -60,9 +99,102 @@ void CoordinatorCore::remove_stale_workers(int64_t timeout_seconds) {
     auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - it->second.last_heartbeat);
     if (elapsed > timeout) {
       it = workers_.erase(it);
+      ++membership_epoch_;
     } else {
       ++it;
     }
   }
+  release_empty_host_groups();
+}
+
+int64_t CoordinatorCore::membership(std::vector<int32_t>& worker_ids) {
+  std::lock_guard<std::mutex> lock(workers_mutex_);
+  
+  worker_ids.clear();
+  worker_ids.reserve(workers_.size());
+  for (const auto& [id, info] : workers_) {
+    if (!info.local_aggregation) {
+      worker_ids.push_back(id);
+    } else if (leads_host(info)) {
+      worker_ids.push_back(host_group_id(info));
+    }
+  }
+  std::sort(worker_ids.begin(), worker_ids.end());
+  
+  return membership_epoch_;
+}
+
+
+int64_t CoordinatorCore::ring(std::vector<WorkerRegistryEntry>& members) {
+  std::lock_guard<std::mutex> lock(workers_mutex_);
+  
+  members.clear();
+  for (const auto& [id, info] : workers_) {
+    if (info.port > 0) {
+      members.push_back(info);
+    }
+  }
+  // neighbours on one host pass segments locally, only the ends of each host's run cross the network
+  std::sort(members.begin(), members.end(), [](const WorkerRegistryEntry& a, const WorkerRegistryEntry& b) {
+    return a.address != b.address ? a.address < b.address : a.worker_id < b.worker_id;
+  });
+  
+  return membership_epoch_;
+}
+
+bool CoordinatorCore::leads_host(const WorkerRegistryEntry& worker) const {
+  for (const auto& [id, info] : workers_) {
+    if (info.local_aggregation && info.hostname == worker.hostname && id < worker.worker_id) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int32_t CoordinatorCore::host_group_id(const WorkerRegistryEntry& leader) const {
+  auto it = host_groups_.find(leader.hostname);
+  return it == host_groups_.end() ? 0 : it->second;
+}
+
+void CoordinatorCore::release_empty_host_groups() {
+  auto it = host_groups_.begin();
+  while (it != host_groups_.end()) {
+    bool occupied = std::any_of(workers_.begin(), workers_.end(), [&](const auto& entry) {
+      return entry.second.local_aggregation && entry.second.hostname == it->first;
+    });
+    it = occupied ? std::next(it) : host_groups_.erase(it);
+  }
 }
 
+bool CoordinatorCore::host_group(int32_t worker_id, std::vector<WorkerRegistryEntry>& members, int32_t& group_id,
+                                 int32_t& groups, int32_t& total_workers) {
+  std::lock_guard<std::mutex> lock(workers_mutex_);
+  
+  members.clear();
+  group_id = 0;
+  groups = 0;
+  total_workers = 0;
+  auto self = workers_.find(worker_id);
+  if (self == workers_.end() || !self->second.local_aggregation) {
+    return false;
+  }
+  
+  for (const auto& [id, info] : workers_) {
+    if (!info.local_aggregation) {
+      continue;
+    }
+    total_workers++;
+    if (leads_host(info)) {
+      groups++;
+    }
+    if (info.hostname == self->second.hostname) {
+      members.push_back(info);
+    }
+  }
+  std::sort(members.begin(), members.end(), [](const WorkerRegistryEntry& a, const WorkerRegistryEntry& b) {
+    return a.worker_id < b.worker_id;
+  });
+  group_id = host_group_id(members.front());
+  
+  return true;
+}
@@ -1,25 +1,48 @@
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <vector>
 #include "coordinator_service.h"
 
 int main(int argc, char** argv) {
   std::string server_address = "0.0.0.0:50052";
-  std::string ps_address = "localhost:50051";
-  int32_t ps_port = 50051;
-  
+  std::string ps_addresses = "localhost:50051";
+  int64_t split_threshold_bytes = 4 << 20;
+
   if (argc > 1) {
     server_address = argv[1];
   }
   if (argc > 2) {
-    ps_address = argv[2];
-    size_t colon_pos = ps_address.find(':');
+    // comma separated list of shards, shard id is the position in the list
+    ps_addresses = argv[2];
+  }
+  if (argc > 3) {
+    split_threshold_bytes = std::stoll(argv[3]);
+  }
+
+  std::vector<ParameterServerShard> ps_shards;
+  std::stringstream ss(ps_addresses);
+  std::string entry;
+  while (std::getline(ss, entry, ',')) {
+    if (entry.empty()) continue;
+
+    ParameterServerShard shard;
+    shard.shard_id = static_cast<int32_t>(ps_shards.size());
+    shard.address = entry;
+    shard.port = 50051;
+    size_t colon_pos = entry.find(':');
     if (colon_pos != std::string::npos) {
-      ps_port = std::stoi(ps_address.substr(colon_pos + 1));
-      ps_address = ps_address.substr(0, colon_pos);
+      shard.port = std::stoi(entry.substr(colon_pos + 1));
+      shard.address = entry.substr(0, colon_pos);
     }
+    ps_shards.push_back(shard);
   }
-  
-  run_coordinator_server(server_address, ps_address, ps_port);
+
+  if (ps_shards.empty()) {
+    std::cerr << "no parameter server address given" << std::endl;
+    return 1;
+  }
+
+  run_coordinator_server(server_address, ps_shards, split_threshold_bytes);
   return 0;
 }
-
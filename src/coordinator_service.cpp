@@ -2,10 +2,14 @@
 #include "coordinator_service.h"
 #include <grpcpp/grpcpp.h>
 #include "coordinator.grpc.pb.h"
+#include "parameter_server.grpc.pb.h"
 #include <iostream>
 #include <thread>
 #include <chrono>
 #include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 using grpc::Server;
@@ -21,19 +25,35 @@ using coordinator::ListWorkersRequest;
 using coordinator::ListWorkersResponse;
 using coordinator::GetPSAddressRequest;
 using coordinator::GetPSAddressResponse;
+using coordinator::GetShardMapRequest;
+using coordinator::ShardMap;
+using coordinator::GetRingRequest;
+using coordinator::RingAssignment;
+using coordinator::GetHostGroupRequest;
+using coordinator::HostGroup;
 using coordinator::WorkerStatus;
 
 class coordinator_service_impl final : public Coordinator::Service {
   public:
-    coordinator_service_impl(const std::string& ps_address, int32_t ps_port): coordinator_(ps_address, ps_port), running_(true) {
+    coordinator_service_impl(const std::vector<ParameterServerShard>& ps_shards, int64_t split_threshold_bytes)
+      : coordinator_(ps_shards, split_threshold_bytes), running_(true) {
+      for (const auto& shard : ps_shards) {
+        auto channel = grpc::CreateChannel(shard.address + ":" + std::to_string(shard.port), grpc::InsecureChannelCredentials());
+        shard_stubs_.push_back(parameter_server::ParameterServer::NewStub(channel));
+      }
       cleanup_thread_ = std::thread(&coordinator_service_impl::cleanup_loop, this);
+      membership_thread_ = std::thread(&coordinator_service_impl::membership_loop, this);
     }
     
     ~coordinator_service_impl() {
       running_ = false;
+      membership_changed_.notify_all();
       if (cleanup_thread_.joinable()) {
         cleanup_thread_.join();
       }
+      if (membership_thread_.joinable()) {
+        membership_thread_.join();
+      }
     }
 
     Status RegisterWorker(ServerContext* context, const coordinator::WorkerInfo* request, RegisterResponse* response) override {
@@ -42,11 +62,13 @@ class coordinator_service_impl final : public Coordinator::Service {
       info.address = request->address();
       info.port = request->port();
       info.hostname = request->hostname();
+      info.local_aggregation = request->local_aggregation();
       info.status = 0;
       
       std::string ps_addr;
       int32_t total_workers = 0;
       bool success = coordinator_.register_worker(info, ps_addr, total_workers);
+      membership_changed_.notify_all();
       
       response->set_success(success);
       if (success) {
@@ -54,7 +76,7 @@ class coordinator_service_impl final : public Coordinator::Service {
         response->set_parameter_server_address(ps_addr);
         response->set_total_workers(total_workers);
       } else {
-        response->set_message("registration failed");
+        response->set_message("registration failed: --local-aggregation must match the workers already registered");
       }
       
       return Status::OK;
@@ -90,7 +112,9 @@ class coordinator_service_impl final : public Coordinator::Service {
     Status GetParameterServerAddress(ServerContext* context, const GetPSAddressRequest* request, GetPSAddressResponse* response) override {
       std::string address;
       int32_t port;
-      coordinator_.get_parameter_server_address(address, port);
+      if (!coordinator_.get_parameter_server_address(address, port)) {
+        return Status(grpc::StatusCode::UNAVAILABLE, "no parameter server configured");
+      }
       
       response->set_address(address);
       response->set_port(port);
@@ -98,6 +122,58 @@ class coordinator_service_impl final : public Coordinator::Service {
       return Status::OK;
     }
 
+    Status GetShardMap(ServerContext* context, const GetShardMapRequest* request, ShardMap* response) override {
+      int64_t split_threshold_bytes = 0;
+      auto shards = coordinator_.get_shard_map(split_threshold_bytes);
+      
+      for (const auto& shard : shards) {
+        coordinator::ShardInfo* shard_info = response->add_shards();
+        shard_info->set_shard_id(shard.shard_id);
+        shard_info->set_address(shard.address);
+        shard_info->set_port(shard.port);
+      }
+      response->set_split_threshold_bytes(split_threshold_bytes);
+      
+      return Status::OK;
+    }
+
+    Status GetRing(ServerContext* context, const GetRingRequest* request, RingAssignment* response) override {
+      std::vector<WorkerRegistryEntry> members;
+      response->set_epoch(coordinator_.ring(members));
+      
+      for (const auto& w : members) {
+        coordinator::WorkerInfo* worker_info = response->add_members();
+        worker_info->set_worker_id(w.worker_id);
+        worker_info->set_address(w.address);
+        worker_info->set_port(w.port);
+        worker_info->set_hostname(w.hostname);
+      }
+      
+      return Status::OK;
+    }
+
+    Status GetHostGroup(ServerContext* context, const GetHostGroupRequest* request, HostGroup* response) override {
+      std::vector<WorkerRegistryEntry> members;
+      int32_t group_id = 0, groups = 0, total_workers = 0;
+      if (!coordinator_.host_group(request->worker_id(), members, group_id, groups, total_workers)) {
+        response->set_found(false);
+        return Status::OK;
+      }
+      
+      const WorkerRegistryEntry& leader = members.front();
+      response->set_found(true);
+      response->mutable_leader()->set_worker_id(leader.worker_id);
+      response->mutable_leader()->set_address(leader.address);
+      response->mutable_leader()->set_port(leader.port);
+      response->mutable_leader()->set_hostname(leader.hostname);
+      response->set_members(static_cast<int32_t>(members.size()));
+      response->set_groups(groups);
+      response->set_total_workers(total_workers);
+      response->set_group_id(group_id);
+      
+      return Status::OK;
+    }
+
   private:
     void cleanup_loop() {
       while (running_) {
@@ -105,22 +181,65 @@ class coordinator_service_impl final : public Coordinator::Service {
         coordinator_.remove_stale_workers(30);
       }
     }
+    
+    // pushes every new membership epoch to the parameter server shards; a shard that is down is retried
+    // on the next round, one that refuses (not elastic, or already further) is not asked again for that epoch
+    void membership_loop() {
+      std::vector<int64_t> delivered(shard_stubs_.size(), -1);
+      while (running_) {
+        {
+          std::unique_lock<std::mutex> lock(membership_mutex_);
+          membership_changed_.wait_for(lock, std::chrono::seconds(1));
+        }
+        std::vector<int32_t> worker_ids;
+        int64_t epoch = coordinator_.membership(worker_ids);
+        if (worker_ids.empty()) {
+          continue;
+        }
+        
+        parameter_server::MembershipUpdate update;
+        update.set_epoch(epoch);
+        for (int32_t id : worker_ids) {
+          update.add_worker_ids(id);
+        }
+        for (size_t i = 0; i < shard_stubs_.size() && running_; ++i) {
+          if (delivered[i] >= epoch) {
+            continue;
+          }
+          grpc::ClientContext ctx;
+          ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(2));
+          parameter_server::MembershipResponse response;
+          if (shard_stubs_[i]->UpdateMembership(&ctx, update, &response).ok()) {
+            delivered[i] = epoch;
+          }
+        }
+      }
+    }
 
     CoordinatorCore coordinator_;
+    std::vector<std::unique_ptr<parameter_server::ParameterServer::Stub>> shard_stubs_;
     std::thread cleanup_thread_;
+    std::thread membership_thread_;
+    std::mutex membership_mutex_;
+    std::condition_variable membership_changed_;
     std::atomic<bool> running_;
 };
 
-void run_coordinator_server(const std::string& server_address, const std::string& ps_address, int32_t ps_port) {
-  coordinator_service_impl service(ps_address, ps_port);
+void run_coordinator_server(const std::string& server_address, const std::vector<ParameterServerShard>& ps_shards, int64_t split_threshold_bytes) {
+  coordinator_service_impl service(ps_shards, split_threshold_bytes);
   
   ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  // workers keep idle channels alive with pings, accept them instead of answering with too_many_pings
+  builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+  builder.AddChannelArgument(GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS, 5000);
   builder.RegisterService(&service);
   
   std::unique_ptr<Server> server(builder.BuildAndStart());
   std::cout << "coordinator listening on " << server_address << std::endl;
-  std::cout << "parameter server: " << ps_address << ":" << ps_port << std::endl;
+  for (const auto& shard : ps_shards) {
+    std::cout << "parameter server shard " << shard.shard_id << ": " << shard.address << ":" << shard.port << std::endl;
+  }
   
   server->Wait();
 }
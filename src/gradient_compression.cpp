@@ -0,0 +1,81 @@
+#include "gradient_compression.h"
+#include "kernels.h"
+#include "tensor_view.h"
+
+#include <algorithm>
+#include <cmath>
+
+bool valid_sparsify_mode(const std::string& mode) {
+  return mode == "none" || mode == "topk" || mode == "threshold";
+}
+
+void sparsify(const float* grad, float* residual, size_t n, const SparsifyOptions& options, sparse_gradient& out) {
+  out.indices.clear();
+  out.values.clear();
+  for (size_t i = 0; i < n; ++i) {
+    residual[i] += grad[i];
+  }
+
+  // entries above cut go out, plus up to ties entries equal to it
+  float cut = options.threshold;
+  size_t ties = 0;
+  if (options.mode == "topk") {
+    size_t k = std::min(n, static_cast<size_t>(std::ceil(options.ratio * static_cast<double>(n))));
+    if (k == 0) {
+      return;
+    }
+    // magnitude of the k-th largest entry; the selection scratch is reused across calls on this thread
+    thread_local std::vector<float> magnitudes;
+    magnitudes.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      magnitudes[i] = std::fabs(residual[i]);
+    }
+    std::nth_element(magnitudes.begin(), magnitudes.begin() + (n - k), magnitudes.end());
+    cut = magnitudes[n - k];
+    size_t above = static_cast<size_t>(std::count_if(magnitudes.begin() + (n - k), magnitudes.end(),
+                                                     [cut](float m) { return m > cut; }));
+    // zeros carry nothing worth sending
+    ties = cut > 0.0f ? k - above : 0;
+  } else if (cut > 0.0f) {
+    // a threshold keeps every entry at it
+    ties = n;
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    float m = std::fabs(residual[i]);
+    if (m > cut || (m == cut && ties > 0 && m > 0.0f)) {
+      if (m == cut) {
+        ties--;
+      }
+      out.indices.push_back(static_cast<uint32_t>(i));
+      out.values.push_back(residual[i]);
+      residual[i] = 0.0f;
+    }
+  }
+}
+
+bool valid_quantize_mode(const std::string& mode) {
+  return mode == "none" || mode == "int8" || mode == "sign";
+}
+
+bool quantizes(const QuantizeOptions& options, const std::string& name, size_t elements) {
+  return options.mode != "none" && elements > 0 && elements >= options.min_elements &&
+         std::find(options.keep.begin(), options.keep.end(), name) == options.keep.end();
+}
+
+void quantize(const float* grad, float* residual, size_t n, const QuantizeOptions& options, quantized_gradient& out) {
+  for (size_t i = 0; i < n; ++i) {
+    residual[i] += grad[i];
+  }
+  out.block = options.block;
+  out.scales.resize((n + options.block - 1) / options.block);
+  if (options.mode == "sign") {
+    out.dtype = kDtypeSignBlock;
+    out.codes.resize((n + 7) / 8);
+    quantize_sign(residual, out.codes.data(), out.scales.data(), n, options.block);
+  } else {
+    out.dtype = kDtypeInt8Block;
+    out.codes.resize(n);
+    quantize_int8(residual, out.codes.data(), out.scales.data(), n, options.block);
+  }
+}
@@ -0,0 +1,248 @@
+#include "host_aggregator.h"
+#include "kernels.h"
+#include "tensor_codec.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+
+class HostAggregator::service final : public peer::HostAggregator::Service {
+  public:
+    explicit service(HostAggregator& aggregator) : aggregator_(aggregator) {}
+
+    grpc::Status PushLocal(grpc::ServerContext* context, const peer::LocalGradients* request,
+                           peer::LocalPushResponse* response) override {
+      int32_t skip_to = -1;
+      response->set_success(aggregator_.deliver(*request, skip_to));
+      response->set_skip_to(skip_to);
+      return grpc::Status::OK;
+    }
+
+    grpc::Status PullLocal(grpc::ServerContext* context, const peer::LocalPullRequest* request,
+                           grpc::ServerWriter<peer::LocalParameters>* writer) override {
+      if (!aggregator_.serve(*request, writer)) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "no parameters pulled for the iteration yet");
+      }
+      return grpc::Status::OK;
+    }
+
+  private:
+    HostAggregator& aggregator_;
+};
+
+HostAggregator::HostAggregator(const HostAggregatorOptions& options)
+  : options_(options), service_(std::make_unique<service>(*this)) {
+  if (options_.chunk_bytes < sizeof(float)) {
+    options_.chunk_bytes = sizeof(float);
+  }
+}
+
+HostAggregator::~HostAggregator() {
+  {
+    // members waiting on a pull give up rather than hold the shutdown
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  changed_.notify_all();
+  if (server_) {
+    server_->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(1));
+  }
+}
+
+int32_t HostAggregator::start(const std::string& address) {
+  int selected_port = 0;
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort(address, grpc::InsecureServerCredentials(), &selected_port);
+  builder.RegisterService(service_.get());
+  server_ = builder.BuildAndStart();
+  if (!server_) {
+    return 0;
+  }
+  return selected_port;
+}
+
+void HostAggregator::publish(int iteration, std::shared_ptr<const std::vector<TensorLite>> params) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    published_iteration_ = iteration;
+    published_ = std::move(params);
+    // pushes of iterations before this one are never collected
+    sums_.erase(sums_.begin(), sums_.lower_bound(iteration));
+  }
+  changed_.notify_all();
+}
+
+size_t HostAggregator::collect(int iteration, size_t members, std::vector<float>& sum) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (collected_iteration_ != iteration) {
+    // a member that does not make it in time is left out of this iteration's push
+    changed_.wait_for(lock, std::chrono::milliseconds(options_.timeout_ms), [&]() {
+      auto it = sums_.find(iteration);
+      return stopping_ || members == 0 || (it != sums_.end() && it->second.complete >= members);
+    });
+    auto it = sums_.find(iteration);
+    collected_ = it != sums_.end() ? std::move(it->second) : iteration_sum();
+    collected_iteration_ = iteration;
+    sums_.erase(sums_.begin(), sums_.upper_bound(iteration));
+  }
+  if (!collected_.sum.empty() && collected_.sum.size() == sum.size()) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(collected_.sum.data());
+    sum_into(sum.data(), &in, 1, sum.size());
+  }
+  return collected_.complete;
+}
+
+bool HostAggregator::deliver(const peer::LocalGradients& piece, int32_t& skip_to) {
+  size_t count = piece.data().size() / sizeof(float);
+  if (piece.offset() < 0 || piece.total_elements() < 0 || piece.data().size() % sizeof(float) != 0 ||
+      piece.offset() + static_cast<int64_t>(count) > piece.total_elements()) {
+    return false;
+  }
+  size_t total = static_cast<size_t>(piece.total_elements());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (piece.iteration() < published_iteration_ || piece.iteration() <= collected_iteration_) {
+      // the leader's push for that iteration is gone already
+      skip_to = std::max(published_iteration_, collected_iteration_ + 1);
+      return false;
+    }
+    iteration_sum& entry = sums_[piece.iteration()];
+    if (entry.received.empty()) {
+      entry.sum.assign(total, 0.0f);
+    }
+    if (entry.sum.size() != total) {
+      return false;
+    }
+    auto received = entry.received.emplace(piece.worker_id(), 0).first;
+    if (received->second == total && total > 0) {
+      // already complete, a duplicate
+      return true;
+    }
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(piece.data().data());
+    sum_into(entry.sum.data() + piece.offset(), &in, 1, count);
+    received->second += count;
+    if (received->second < total) {
+      return true;
+    }
+    entry.complete++;
+  }
+  changed_.notify_all();
+  return true;
+}
+
+bool HostAggregator::serve(const peer::LocalPullRequest& request, grpc::ServerWriter<peer::LocalParameters>* writer) {
+  std::shared_ptr<const std::vector<TensorLite>> params;
+  int served = -1;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    bool ready = changed_.wait_for(lock, std::chrono::milliseconds(options_.timeout_ms), [&]() {
+      return stopping_ || published_iteration_ >= request.iteration();
+    });
+    if (!ready || stopping_) {
+      return false;
+    }
+    params = published_;
+    served = published_iteration_;
+  }
+
+  std::vector<size_t> sizes;
+  for (const auto& t : *params) {
+    sizes.push_back(t.data.size());
+  }
+  auto chunks = plan_chunks(sizes, options_.chunk_bytes);
+  if (chunks.empty()) {
+    // still tell the member which iteration it got
+    chunks.emplace_back();
+  }
+  for (const auto& chunk : chunks) {
+    peer::LocalParameters message;
+    message.set_iteration(served);
+    for (const auto& p : chunk) {
+      const TensorLite& t = (*params)[p.tensor];
+      set_tensor_chunk(message.add_pieces(), t.name, t.shape, t.data.data(), p.begin, p.end, t.data.size());
+    }
+    if (!writer->Write(message)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void HostAggregator::set_leader(const std::string& address) {
+  if (address != leader_address_) {
+    leader_address_ = address;
+    leader_ = peer::HostAggregator::NewStub(grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+  }
+}
+
+bool HostAggregator::pull(int worker_id, int iteration, std::vector<TensorLite>& params, int32_t& served) {
+  grpc::ClientContext ctx;
+  ctx.set_wait_for_ready(true);
+  // the leader holds the call until its own pull is in
+  ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(options_.timeout_ms) +
+                   std::chrono::seconds(5));
+  peer::LocalPullRequest request;
+  request.set_worker_id(worker_id);
+  request.set_iteration(iteration);
+  auto reader = leader_->PullLocal(&ctx, request);
+
+  params.clear();
+  served = -1;
+  std::unordered_map<std::string, size_t> index;
+  std::deque<std::vector<unsigned char>> owned;
+  peer::LocalParameters message;
+  while (reader->Read(&message)) {
+    served = message.iteration();
+    for (const auto& piece : message.pieces()) {
+      tensor_view view;
+      if (!view_tensor(piece.tensor(), view, owned)) {
+        continue;
+      }
+      auto it = index.find(view.name);
+      if (it == index.end()) {
+        TensorLite t;
+        t.name = view.name;
+        t.shape = view.shape;
+        t.dtype = 0;
+        t.data.resize(static_cast<size_t>(piece.total_elements()), 0.0f);
+        it = index.emplace(view.name, params.size()).first;
+        params.push_back(std::move(t));
+      }
+      auto& data = params[it->second].data;
+      size_t offset = static_cast<size_t>(piece.offset());
+      if (offset < data.size()) {
+        view.copy_to(data.data() + offset, 0, std::min(view.size, data.size() - offset));
+      }
+    }
+    owned.clear();
+  }
+  return reader->Finish().ok() && served >= 0;
+}
+
+bool HostAggregator::push(int worker_id, int iteration, const std::vector<float>& grads, int32_t& skip_to) {
+  skip_to = -1;
+  size_t per_message = options_.chunk_bytes / sizeof(float);
+  // one message even for no gradients, so the leader counts this member in
+  for (size_t offset = 0; offset == 0 || offset < grads.size(); offset += per_message) {
+    size_t count = std::min(per_message, grads.size() - offset);
+    peer::LocalGradients piece;
+    piece.set_worker_id(worker_id);
+    piece.set_iteration(iteration);
+    piece.set_offset(static_cast<int64_t>(offset));
+    piece.set_total_elements(static_cast<int64_t>(grads.size()));
+    piece.set_data(grads.data() + offset, count * sizeof(float));
+
+    grpc::ClientContext ctx;
+    ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(options_.timeout_ms));
+    peer::LocalPushResponse response;
+    if (!leader_->PushLocal(&ctx, piece, &response).ok()) {
+      return false;
+    }
+    if (!response.success()) {
+      skip_to = response.skip_to();
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,870 @@
+#include "kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PS_KERNELS_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define PS_KERNELS_NEON 1
+#endif
+
+namespace {
+
+struct kernel_table {
+  const char* name;
+  void (*sum_into)(float*, const unsigned char* const*, size_t, size_t);
+  void (*sum_int8_into)(float*, const unsigned char*, const unsigned char*, size_t, size_t, size_t);
+  void (*sum_sign_into)(float*, const unsigned char*, const unsigned char*, size_t, size_t, size_t);
+  void (*quantize_int8)(float*, unsigned char*, float*, size_t, size_t);
+  void (*quantize_sign)(float*, unsigned char*, float*, size_t, size_t);
+  void (*widen_half)(float*, const unsigned char*, bool, size_t);
+  void (*narrow_half)(unsigned char*, const float*, bool, size_t);
+  void (*sum_half_into)(float*, const unsigned char*, bool, size_t);
+  bool (*optimizer_step)(float*, const float*, const float*, void*, void*, bool, const step_params&, size_t, bool);
+};
+
+float load_float(const unsigned char* p) {
+  float v;
+  std::memcpy(&v, p, sizeof(float));
+  return v;
+}
+
+// scalar versions, also the tails of the vector ones
+
+void sum_into_scalar(float* acc, const unsigned char* const* inputs, size_t count, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    float v = acc[i];
+    for (size_t k = 0; k < count; ++k) {
+      v += load_float(inputs[k] + i * sizeof(float));
+    }
+    acc[i] = v;
+  }
+}
+
+// quantized values of elements [first, first + n), one run per scale block at a time
+
+void sum_int8_scalar(float* acc, const unsigned char* codes, const unsigned char* scales, size_t block, size_t first, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    size_t e = first + i;
+    acc[i] += static_cast<float>(static_cast<int8_t>(codes[e])) * load_float(scales + e / block * sizeof(float));
+  }
+}
+
+void sum_sign_scalar(float* acc, const unsigned char* bits, const unsigned char* scales, size_t block, size_t first, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    size_t e = first + i;
+    float scale = load_float(scales + e / block * sizeof(float));
+    acc[i] += (bits[e / 8] >> (e % 8)) & 1 ? scale : -scale;
+  }
+}
+
+// sum of |x| added into eight lanes by element index mod 8, then folded pairwise; every variant sums
+// in this order so they agree on the sign scale to the bit
+void add_abs_lanes(const float* x, size_t from, size_t n, float* lanes) {
+  for (size_t i = from; i < n; ++i) {
+    lanes[i % 8] += std::fabs(x[i]);
+  }
+}
+
+float fold_lanes(float* lanes) {
+  for (int j = 0; j < 4; ++j) lanes[j] += lanes[j + 4];
+  for (int j = 0; j < 2; ++j) lanes[j] += lanes[j + 2];
+  return lanes[0] + lanes[1];
+}
+
+float int8_code(float x, float inv) {
+  return std::min(127.0f, std::max(-127.0f, std::nearbyint(x * inv)));
+}
+
+// elements [from, m) of one block
+void quantize_int8_run(float* x, unsigned char* codes, float scale, float inv, size_t from, size_t m) {
+  for (size_t i = from; i < m; ++i) {
+    float q = int8_code(x[i], inv);
+    codes[i] = static_cast<unsigned char>(static_cast<int8_t>(q));
+    x[i] -= q * scale;
+  }
+}
+
+void quantize_sign_run(float* x, unsigned char* bits, float scale, size_t from, size_t m) {
+  for (size_t i = from; i < m; i += 8) {
+    unsigned char byte = 0;
+    for (size_t k = i; k < std::min(m, i + 8); ++k) {
+      bool positive = !std::signbit(x[k]);
+      byte |= static_cast<unsigned char>(positive) << (k - i);
+      x[k] -= positive ? scale : -scale;
+    }
+    bits[i / 8] = byte;
+  }
+}
+
+void quantize_int8_scalar(float* values, unsigned char* codes, float* scales, size_t n, size_t block) {
+  for (size_t b = 0; b < n; b += block) {
+    size_t m = std::min(block, n - b);
+    float peak = 0.0f;
+    for (size_t i = 0; i < m; ++i) {
+      peak = std::max(peak, std::fabs(values[b + i]));
+    }
+    float scale = peak / 127.0f;
+    quantize_int8_run(values + b, codes + b, scale, peak > 0.0f ? 127.0f / peak : 0.0f, 0, m);
+    scales[b / block] = scale;
+  }
+}
+
+void quantize_sign_scalar(float* values, unsigned char* bits, float* scales, size_t n, size_t block) {
+  for (size_t b = 0; b < n; b += block) {
+    size_t m = std::min(block, n - b);
+    float lanes[8] = {};
+    add_abs_lanes(values + b, 0, m, lanes);
+    float scale = fold_lanes(lanes) / static_cast<float>(m);
+    quantize_sign_run(values + b, bits + b / 8, scale, 0, m);
+    scales[b / block] = scale;
+  }
+}
+
+// bfloat16 keeps the top 16 bits of a float, rounded to nearest even on the way down
+float from_bf16(uint16_t h) {
+  uint32_t u = static_cast<uint32_t>(h) << 16;
+  float v;
+  std::memcpy(&v, &u, sizeof(float));
+  return v;
+}
+
+uint16_t to_bf16(float v) {
+  uint32_t u;
+  std::memcpy(&u, &v, sizeof(float));
+  u += 0x7fff + ((u >> 16) & 1);
+  return static_cast<uint16_t>(u >> 16);
+}
+
+// binary16 the way F16C converts it: round to nearest even, overflow to infinity, NaNs quieted
+float from_fp16(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t u;
+  if (exponent == 0x1f) {
+    u = sign | 0x7f800000 | (mantissa << 13) | (mantissa ? 0x400000 : 0);
+  } else if (exponent == 0) {
+    // zero or subnormal, mantissa * 2^-24 is exact in float
+    float v = static_cast<float>(mantissa) * (1.0f / 16777216.0f);
+    std::memcpy(&u, &v, sizeof(float));
+    u |= sign;
+  } else {
+    u = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+  float v;
+  std::memcpy(&v, &u, sizeof(float));
+  return v;
+}
+
+uint16_t to_fp16(float v) {
+  uint32_t u;
+  std::memcpy(&u, &v, sizeof(float));
+  uint16_t sign = static_cast<uint16_t>((u >> 16) & 0x8000);
+  uint32_t magnitude = u & 0x7fffffff;
+  if (magnitude > 0x7f800000) {
+    return sign | 0x7e00 | static_cast<uint16_t>((magnitude >> 13) & 0x3ff);
+  }
+  if (magnitude >= 0x477ff000) {
+    // 65520 and up round past the largest finite half
+    return sign | 0x7c00;
+  }
+  if (magnitude < 0x38800000) {
+    // subnormal half: adding 0.5 leaves |v| rounded to the 2^-24 ulp in the low mantissa bits
+    float f;
+    std::memcpy(&f, &magnitude, sizeof(float));
+    f += 0.5f;
+    std::memcpy(&u, &f, sizeof(float));
+    return sign | static_cast<uint16_t>(u - 0x3f000000);
+  }
+  magnitude += 0xc8000fff + ((magnitude >> 13) & 1);
+  return sign | static_cast<uint16_t>(magnitude >> 13);
+}
+
+float load_half(const unsigned char* p, bool bf16) {
+  uint16_t h;
+  std::memcpy(&h, p, sizeof(uint16_t));
+  return bf16 ? from_bf16(h) : from_fp16(h);
+}
+
+void widen_half_scalar(float* out, const unsigned char* in, bool bf16, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = load_half(in + i * sizeof(uint16_t), bf16);
+  }
+}
+
+void narrow_half_scalar(unsigned char* out, const float* in, bool bf16, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    uint16_t h = bf16 ? to_bf16(in[i]) : to_fp16(in[i]);
+    std::memcpy(out + i * sizeof(uint16_t), &h, sizeof(uint16_t));
+  }
+}
+
+void sum_half_scalar(float* acc, const unsigned char* in, bool bf16, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    acc[i] += load_half(in + i * sizeof(uint16_t), bf16);
+  }
+}
+
+template <bool BF16>
+float load_state(const void* s, size_t i) {
+  if constexpr (BF16) {
+    uint16_t h;
+    std::memcpy(&h, static_cast<const unsigned char*>(s) + i * sizeof(uint16_t), sizeof(uint16_t));
+    return from_bf16(h);
+  }
+  float v;
+  std::memcpy(&v, static_cast<const unsigned char*>(s) + i * sizeof(float), sizeof(float));
+  return v;
+}
+
+template <bool BF16>
+void store_state(void* s, size_t i, float v) {
+  if constexpr (BF16) {
+    uint16_t h = to_bf16(v);
+    std::memcpy(static_cast<unsigned char*>(s) + i * sizeof(uint16_t), &h, sizeof(uint16_t));
+    return;
+  }
+  std::memcpy(static_cast<unsigned char*>(s) + i * sizeof(float), &v, sizeof(float));
+}
+
+// state of element i, null stays null
+template <bool BF16>
+void* state_at(void* s, size_t i) {
+  return s ? static_cast<unsigned char*>(s) + i * (BF16 ? sizeof(uint16_t) : sizeof(float)) : nullptr;
+}
+
+// M and V say whether the step keeps m and v, BF16 how they are stored
+template <bool M, bool V, bool BF16>
+struct step_scalar {
+  static bool run(float* out, const float* param, const float* grad, void* m, void* v, const step_params& p,
+                  size_t n, bool) {
+    bool changed = false;
+    for (size_t i = 0; i < n; ++i) {
+      float g = p.scale * grad[i];
+      float num = g;
+      if constexpr (M) {
+        num = p.decay1 * load_state<BF16>(m, i) + p.gain1 * g;
+        store_state<BF16>(m, i, num);
+      }
+      float delta = p.rate * num;
+      if constexpr (V) {
+        float second = p.decay2 * load_state<BF16>(v, i) + p.gain2 * (g * g);
+        store_state<BF16>(v, i, second);
+        delta = delta / (std::sqrt(second) + p.epsilon);
+      }
+      out[i] = param[i] - delta;
+      changed |= delta != 0.0f;
+    }
+    return changed;
+  }
+};
+
+// picks K's instantiation for the moments the step keeps
+template <template <bool, bool, bool> class K>
+bool dispatch_step(float* out, const float* param, const float* grad, void* m, void* v, bool bf16,
+                   const step_params& p, size_t n, bool nontemporal) {
+  if (m && v) {
+    return bf16 ? K<true, true, true>::run(out, param, grad, m, v, p, n, nontemporal)
+                : K<true, true, false>::run(out, param, grad, m, v, p, n, nontemporal);
+  }
+  if (m) {
+    return bf16 ? K<true, false, true>::run(out, param, grad, m, v, p, n, nontemporal)
+                : K<true, false, false>::run(out, param, grad, m, v, p, n, nontemporal);
+  }
+  if (v) {
+    return bf16 ? K<false, true, true>::run(out, param, grad, m, v, p, n, nontemporal)
+                : K<false, true, false>::run(out, param, grad, m, v, p, n, nontemporal);
+  }
+  return K<false, false, false>::run(out, param, grad, m, v, p, n, nontemporal);
+}
+
+bool optimizer_step_scalar(float* out, const float* param, const float* grad, void* m, void* v, bool bf16,
+                           const step_params& p, size_t n, bool nontemporal) {
+  return dispatch_step<step_scalar>(out, param, grad, m, v, bf16, p, n, nontemporal);
+}
+
+const kernel_table kScalar = {"scalar", sum_into_scalar, sum_int8_scalar, sum_sign_scalar, quantize_int8_scalar,
+                               quantize_sign_scalar, widen_half_scalar, narrow_half_scalar, sum_half_scalar,
+                               optimizer_step_scalar};
+
+// elements [i, n) after a vector loop, adding the inputs in the same order the scalar version does
+void sum_tail(float* acc, const unsigned char* const* inputs, size_t count, size_t i, size_t n) {
+  for (size_t k = 0; k < count && i < n; ++k) {
+    const unsigned char* in = inputs[k] + i * sizeof(float);
+    sum_into_scalar(acc + i, &in, 1, n - i);
+  }
+}
+
+// elements before out reaches the alignment a streaming store needs
+size_t head_until_aligned(const float* out, size_t alignment, size_t n) {
+  size_t misaligned = reinterpret_cast<uintptr_t>(out) % alignment;
+  if (misaligned == 0) return 0;
+  if (misaligned % sizeof(float) != 0) return n;  // never aligns, stay scalar
+  size_t head = (alignment - misaligned) / sizeof(float);
+  return head < n ? head : n;
+}
+
+#if PS_KERNELS_X86
+
+__attribute__((target("avx2")))
+void sum_into_avx2(float* acc, const unsigned char* const* inputs, size_t count, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256 a0 = _mm256_loadu_ps(acc + i);
+    __m256 a1 = _mm256_loadu_ps(acc + i + 8);
+    for (size_t k = 0; k < count; ++k) {
+      const float* in = reinterpret_cast<const float*>(inputs[k] + i * sizeof(float));
+      a0 = _mm256_add_ps(a0, _mm256_loadu_ps(in));
+      a1 = _mm256_add_ps(a1, _mm256_loadu_ps(in + 8));
+    }
+    _mm256_storeu_ps(acc + i, a0);
+    _mm256_storeu_ps(acc + i + 8, a1);
+  }
+  sum_tail(acc, inputs, count, i, n);
+}
+
+__attribute__((target("avx2")))
+void sum_int8_avx2(float* acc, const unsigned char* codes, const unsigned char* scales, size_t block, size_t first, size_t n) {
+  for (size_t i = 0; i < n;) {
+    size_t e = first + i;
+    size_t run = std::min(n - i, block - e % block);
+    const __m256 s = _mm256_set1_ps(load_float(scales + e / block * sizeof(float)));
+    size_t j = 0;
+    for (; j + 8 <= run; j += 8) {
+      __m128i c = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(codes + e + j));
+      __m256 v = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(c)), s);
+      _mm256_storeu_ps(acc + i + j, _mm256_add_ps(_mm256_loadu_ps(acc + i + j), v));
+    }
+    sum_int8_scalar(acc + i + j, codes, scales, block, e + j, run - j);
+    i += run;
+  }
+}
+
+__attribute__((target("avx2")))
+void sum_sign_avx2(float* acc, const unsigned char* bits, const unsigned char* scales, size_t block, size_t first, size_t n) {
+  const __m256i lane_bit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  for (size_t i = 0; i < n;) {
+    size_t e = first + i;
+    size_t run = std::min(n - i, block - e % block);
+    const __m256 s = _mm256_set1_ps(load_float(scales + e / block * sizeof(float)));
+    // scalar up to the next whole byte of bits
+    size_t j = std::min(run, (8 - e % 8) % 8);
+    sum_sign_scalar(acc + i, bits, scales, block, e, j);
+    for (; j + 8 <= run; j += 8) {
+      __m256i byte = _mm256_set1_epi32(bits[(e + j) / 8]);
+      __m256 set = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(byte, lane_bit), lane_bit));
+      __m256 v = _mm256_xor_ps(s, _mm256_andnot_ps(set, sign));
+      _mm256_storeu_ps(acc + i + j, _mm256_add_ps(_mm256_loadu_ps(acc + i + j), v));
+    }
+    sum_sign_scalar(acc + i + j, bits, scales, block, e + j, run - j);
+    i += run;
+  }
+}
+
+__attribute__((target("avx2")))
+void quantize_int8_avx2(float* values, unsigned char* codes, float* scales, size_t n, size_t block) {
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 lo = _mm256_set1_ps(-127.0f);
+  const __m256 hi = _mm256_set1_ps(127.0f);
+  for (size_t b = 0; b < n; b += block) {
+    float* x = values + b;
+    size_t m = std::min(block, n - b);
+    __m256 peaks = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= m; i += 8) {
+      peaks = _mm256_max_ps(_mm256_and_ps(abs_mask, _mm256_loadu_ps(x + i)), peaks);
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, peaks);
+    float peak = 0.0f;
+    for (float l : lanes) peak = std::max(peak, l);
+    for (; i < m; ++i) peak = std::max(peak, std::fabs(x[i]));
+
+    float scale = peak / 127.0f;
+    float inv = peak > 0.0f ? 127.0f / peak : 0.0f;
+    const __m256 s = _mm256_set1_ps(scale);
+    const __m256 r = _mm256_set1_ps(inv);
+    for (i = 0; i + 8 <= m; i += 8) {
+      __m256 v = _mm256_loadu_ps(x + i);
+      __m256 q = _mm256_round_ps(_mm256_mul_ps(v, r), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+      q = _mm256_min_ps(_mm256_max_ps(q, lo), hi);
+      // int32 -> int16 -> int8, packs works per 128-bit lane so the halves are regathered in between
+      __m256i q32 = _mm256_cvtps_epi32(q);
+      __m128i q16 = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packs_epi32(q32, q32), 0x08));
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(codes + b + i), _mm_packs_epi16(q16, q16));
+      _mm256_storeu_ps(x + i, _mm256_sub_ps(v, _mm256_mul_ps(q, s)));
+    }
+    quantize_int8_run(x, codes + b, scale, inv, i, m);
+    scales[b / block] = scale;
+  }
+}
+
+__attribute__((target("avx2")))
+void quantize_sign_avx2(float* values, unsigned char* bits, float* scales, size_t n, size_t block) {
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  for (size_t b = 0; b < n; b += block) {
+    float* x = values + b;
+    size_t m = std::min(block, n - b);
+    __m256 sums = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= m; i += 8) {
+      sums = _mm256_add_ps(sums, _mm256_and_ps(abs_mask, _mm256_loadu_ps(x + i)));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, sums);
+    add_abs_lanes(x, i, m, lanes);
+    float scale = fold_lanes(lanes) / static_cast<float>(m);
+
+    const __m256 s = _mm256_set1_ps(scale);
+    for (i = 0; i + 8 <= m; i += 8) {
+      __m256 v = _mm256_loadu_ps(x + i);
+      bits[(b + i) / 8] = static_cast<unsigned char>(~_mm256_movemask_ps(v));
+      // scale carrying the element's sign
+      _mm256_storeu_ps(x + i, _mm256_sub_ps(v, _mm256_or_ps(_mm256_and_ps(v, sign), s)));
+    }
+    quantize_sign_run(x, bits + b / 8, scale, i, m);
+    scales[b / block] = scale;
+  }
+}
+
+template <bool BF16>
+__attribute__((target("avx2")))
+__m256 load_state_avx2(const void* s, size_t i) {
+  if constexpr (BF16) {
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(static_cast<const uint16_t*>(s) + i));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+  }
+  return _mm256_loadu_ps(static_cast<const float*>(s) + i);
+}
+
+template <bool BF16>
+__attribute__((target("avx2")))
+void store_state_avx2(void* s, size_t i, __m256 v) {
+  if constexpr (BF16) {
+    __m256i u = _mm256_castps_si256(v);
+    __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(u, 16), _mm256_set1_epi32(1));
+    u = _mm256_srli_epi32(_mm256_add_epi32(u, _mm256_add_epi32(_mm256_set1_epi32(0x7fff), lsb)), 16);
+    // packus narrows within each 128-bit lane, the permute brings both lanes' halves together
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(u, u), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(static_cast<uint16_t*>(s) + i), _mm256_castsi256_si128(packed));
+    return;
+  }
+  _mm256_storeu_ps(static_cast<float*>(s) + i, v);
+}
+
+// the fp16 conversions are F16C, which every AVX2 CPU we select this table for has
+__attribute__((target("avx2,f16c")))
+__m256 load_half_avx2(const unsigned char* p, bool bf16) {
+  if (bf16) return load_state_avx2<true>(p, 0);
+  return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+__attribute__((target("avx2,f16c")))
+void widen_half_avx2(float* out, const unsigned char* in, bool bf16, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, load_half_avx2(in + i * sizeof(uint16_t), bf16));
+  }
+  widen_half_scalar(out + i, in + i * sizeof(uint16_t), bf16, n - i);
+}
+
+__attribute__((target("avx2,f16c")))
+void narrow_half_avx2(unsigned char* out, const float* in, bool bf16, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_loadu_ps(in + i);
+    if (bf16) {
+      store_state_avx2<true>(out, i, v);
+    } else {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * sizeof(uint16_t)), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+    }
+  }
+  narrow_half_scalar(out + i * sizeof(uint16_t), in + i, bf16, n - i);
+}
+
+__attribute__((target("avx2,f16c")))
+void sum_half_avx2(float* acc, const unsigned char* in, bool bf16, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), load_half_avx2(in + i * sizeof(uint16_t), bf16)));
+  }
+  sum_half_scalar(acc + i, in + i * sizeof(uint16_t), bf16, n - i);
+}
+
+template <bool M, bool V, bool BF16>
+struct step_avx2 {
+  __attribute__((target("avx2")))
+  static bool run(float* out, const float* param, const float* grad, void* m, void* v, const step_params& p,
+                  size_t n, bool nontemporal) {
+    size_t i = nontemporal ? head_until_aligned(out, 32, n) : 0;
+    bool changed = step_scalar<M, V, BF16>::run(out, param, grad, m, v, p, i, false);
+    nontemporal = nontemporal && reinterpret_cast<uintptr_t>(out + i) % 32 == 0;
+
+    const __m256 scale = _mm256_set1_ps(p.scale);
+    const __m256 rate = _mm256_set1_ps(p.rate);
+    const __m256 decay1 = _mm256_set1_ps(p.decay1);
+    const __m256 gain1 = _mm256_set1_ps(p.gain1);
+    const __m256 decay2 = _mm256_set1_ps(p.decay2);
+    const __m256 gain2 = _mm256_set1_ps(p.gain2);
+    const __m256 epsilon = _mm256_set1_ps(p.epsilon);
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 nonzero = zero;
+    for (; i + 8 <= n; i += 8) {
+      __m256 g = _mm256_mul_ps(scale, _mm256_loadu_ps(grad + i));
+      __m256 num = g;
+      if constexpr (M) {
+        num = _mm256_add_ps(_mm256_mul_ps(decay1, load_state_avx2<BF16>(m, i)), _mm256_mul_ps(gain1, g));
+        store_state_avx2<BF16>(m, i, num);
+      }
+      __m256 delta = _mm256_mul_ps(rate, num);
+      if constexpr (V) {
+        __m256 second = _mm256_add_ps(_mm256_mul_ps(decay2, load_state_avx2<BF16>(v, i)),
+                                      _mm256_mul_ps(gain2, _mm256_mul_ps(g, g)));
+        store_state_avx2<BF16>(v, i, second);
+        delta = _mm256_div_ps(delta, _mm256_add_ps(_mm256_sqrt_ps(second), epsilon));
+      }
+      nonzero = _mm256_or_ps(nonzero, _mm256_cmp_ps(delta, zero, _CMP_NEQ_UQ));
+      __m256 updated = _mm256_sub_ps(_mm256_loadu_ps(param + i), delta);
+      if (nontemporal) {
+        _mm256_stream_ps(out + i, updated);
+      } else {
+        _mm256_storeu_ps(out + i, updated);
+      }
+    }
+    if (nontemporal) {
+      _mm_sfence();
+    }
+    changed |= _mm256_movemask_ps(nonzero) != 0;
+    return step_scalar<M, V, BF16>::run(out + i, param + i, grad + i, state_at<BF16>(m, i), state_at<BF16>(v, i), p,
+                                        n - i, false) || changed;
+  }
+};
+
+bool optimizer_step_avx2(float* out, const float* param, const float* grad, void* m, void* v, bool bf16,
+                         const step_params& p, size_t n, bool nontemporal) {
+  return dispatch_step<step_avx2>(out, param, grad, m, v, bf16, p, n, nontemporal);
+}
+
+__attribute__((target("avx512f")))
+void sum_into_avx512(float* acc, const unsigned char* const* inputs, size_t count, size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m512 a0 = _mm512_loadu_ps(acc + i);
+    __m512 a1 = _mm512_loadu_ps(acc + i + 16);
+    for (size_t k = 0; k < count; ++k) {
+      const float* in = reinterpret_cast<const float*>(inputs[k] + i * sizeof(float));
+      a0 = _mm512_add_ps(a0, _mm512_loadu_ps(in));
+      a1 = _mm512_add_ps(a1, _mm512_loadu_ps(in + 16));
+    }
+    _mm512_storeu_ps(acc + i, a0);
+    _mm512_storeu_ps(acc + i + 16, a1);
+  }
+  sum_tail(acc, inputs, count, i, n);
+}
+
+__attribute__((target("avx512f")))
+void sum_int8_avx512(float* acc, const unsigned char* codes, const unsigned char* scales, size_t block, size_t first, size_t n) {
+  for (size_t i = 0; i < n;) {
+    size_t e = first + i;
+    size_t run = std::min(n - i, block - e % block);
+    const __m512 s = _mm512_set1_ps(load_float(scales + e / block * sizeof(float)));
+    size_t j = 0;
+    for (; j + 16 <= run; j += 16) {
+      __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes + e + j));
+      __m512 v = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(c)), s);
+      _mm512_storeu_ps(acc + i + j, _mm512_add_ps(_mm512_loadu_ps(acc + i + j), v));
+    }
+    sum_int8_scalar(acc + i + j, codes, scales, block, e + j, run - j);
+    i += run;
+  }
+}
+
+__attribute__((target("avx512f")))
+void sum_sign_avx512(float* acc, const unsigned char* bits, const unsigned char* scales, size_t block, size_t first, size_t n) {
+  for (size_t i = 0; i < n;) {
+    size_t e = first + i;
+    size_t run = std::min(n - i, block - e % block);
+    float scale = load_float(scales + e / block * sizeof(float));
+    const __m512 s = _mm512_set1_ps(scale);
+    const __m512 negative = _mm512_set1_ps(-scale);
+    size_t j = std::min(run, (8 - e % 8) % 8);
+    sum_sign_scalar(acc + i, bits, scales, block, e, j);
+    for (; j + 16 <= run; j += 16) {
+      // two bytes of bits are exactly the lane mask, the first byte holding the low lanes
+      __mmask16 set = static_cast<__mmask16>(bits[(e + j) / 8] | bits[(e + j) / 8 + 1] << 8);
+      __m512 v = _mm512_mask_blend_ps(set, negative, s);
+      _mm512_storeu_ps(acc + i + j, _mm512_add_ps(_mm512_loadu_ps(acc + i + j), v));
+    }
+    sum_sign_scalar(acc + i + j, bits, scales, block, e + j, run - j);
+    i += run;
+  }
+}
+
+template <bool BF16>
+__attribute__((target("avx512f")))
+__m512 load_state_avx512(const void* s, size_t i) {
+  if constexpr (BF16) {
+    __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(static_cast<const uint16_t*>(s) + i));
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16));
+  }
+  return _mm512_loadu_ps(static_cast<const float*>(s) + i);
+}
+
+template <bool BF16>
+__attribute__((target("avx512f")))
+void store_state_avx512(void* s, size_t i, __m512 v) {
+  if constexpr (BF16) {
+    __m512i u = _mm512_castps_si512(v);
+    __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(u, 16), _mm512_set1_epi32(1));
+    u = _mm512_srli_epi32(_mm512_add_epi32(u, _mm512_add_epi32(_mm512_set1_epi32(0x7fff), lsb)), 16);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(static_cast<uint16_t*>(s) + i), _mm512_cvtepi32_epi16(u));
+    return;
+  }
+  _mm512_storeu_ps(static_cast<float*>(s) + i, v);
+}
+
+__attribute__((target("avx512f")))
+void sum_half_avx512(float* acc, const unsigned char* in, bool bf16, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const unsigned char* p = in + i * sizeof(uint16_t);
+    __m512 v = bf16 ? load_state_avx512<true>(p, 0) : _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+    _mm512_storeu_ps(acc + i, _mm512_add_ps(_mm512_loadu_ps(acc + i), v));
+  }
+  sum_half_scalar(acc + i, in + i * sizeof(uint16_t), bf16, n - i);
+}
+
+template <bool M, bool V, bool BF16>
+struct step_avx512 {
+  __attribute__((target("avx512f")))
+  static bool run(float* out, const float* param, const float* grad, void* m, void* v, const step_params& p,
+                  size_t n, bool nontemporal) {
+    size_t i = nontemporal ? head_until_aligned(out, 64, n) : 0;
+    bool changed = step_scalar<M, V, BF16>::run(out, param, grad, m, v, p, i, false);
+    nontemporal = nontemporal && reinterpret_cast<uintptr_t>(out + i) % 64 == 0;
+
+    const __m512 scale = _mm512_set1_ps(p.scale);
+    const __m512 rate = _mm512_set1_ps(p.rate);
+    const __m512 decay1 = _mm512_set1_ps(p.decay1);
+    const __m512 gain1 = _mm512_set1_ps(p.gain1);
+    const __m512 decay2 = _mm512_set1_ps(p.decay2);
+    const __m512 gain2 = _mm512_set1_ps(p.gain2);
+    const __m512 epsilon = _mm512_set1_ps(p.epsilon);
+    const __m512 zero = _mm512_setzero_ps();
+    __mmask16 nonzero = 0;
+    for (; i + 16 <= n; i += 16) {
+      __m512 g = _mm512_mul_ps(scale, _mm512_loadu_ps(grad + i));
+      __m512 num = g;
+      if constexpr (M) {
+        num = _mm512_add_ps(_mm512_mul_ps(decay1, load_state_avx512<BF16>(m, i)), _mm512_mul_ps(gain1, g));
+        store_state_avx512<BF16>(m, i, num);
+      }
+      __m512 delta = _mm512_mul_ps(rate, num);
+      if constexpr (V) {
+        __m512 second = _mm512_add_ps(_mm512_mul_ps(decay2, load_state_avx512<BF16>(v, i)),
+                                      _mm512_mul_ps(gain2, _mm512_mul_ps(g, g)));
+        store_state_avx512<BF16>(v, i, second);
+        delta = _mm512_div_ps(delta, _mm512_add_ps(_mm512_sqrt_ps(second), epsilon));
+      }
+      nonzero |= _mm512_cmp_ps_mask(delta, zero, _CMP_NEQ_UQ);
+      __m512 updated = _mm512_sub_ps(_mm512_loadu_ps(param + i), delta);
+      if (nontemporal) {
+        _mm512_stream_ps(out + i, updated);
+      } else {
+        _mm512_storeu_ps(out + i, updated);
+      }
+    }
+    if (nontemporal) {
+      _mm_sfence();
+    }
+    changed |= nonzero != 0;
+    return step_scalar<M, V, BF16>::run(out + i, param + i, grad + i, state_at<BF16>(m, i), state_at<BF16>(v, i), p,
+                                        n - i, false) || changed;
+  }
+};
+
+bool optimizer_step_avx512(float* out, const float* param, const float* grad, void* m, void* v, bool bf16,
+                           const step_params& p, size_t n, bool nontemporal) {
+  return dispatch_step<step_avx512>(out, param, grad, m, v, bf16, p, n, nontemporal);
+}
+
+const kernel_table kAvx2 = {"avx2", sum_into_avx2, sum_int8_avx2, sum_sign_avx2, quantize_int8_avx2, quantize_sign_avx2,
+                            widen_half_avx2, narrow_half_avx2, sum_half_avx2, optimizer_step_avx2};
+// encoding and 16-bit conversion run once per pull or push, the AVX2 versions are plenty there
+const kernel_table kAvx512 = {"avx512", sum_into_avx512, sum_int8_avx512, sum_sign_avx512, quantize_int8_avx2,
+                              quantize_sign_avx2, widen_half_avx2, narrow_half_avx2, sum_half_avx512,
+                              optimizer_step_avx512};
+
+#endif  // PS_KERNELS_X86
+
+#if PS_KERNELS_NEON
+
+void sum_into_neon(float* acc, const unsigned char* const* inputs, size_t count, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    float32x4_t a0 = vld1q_f32(acc + i);
+    float32x4_t a1 = vld1q_f32(acc + i + 4);
+    for (size_t k = 0; k < count; ++k) {
+      const float* in = reinterpret_cast<const float*>(inputs[k] + i * sizeof(float));
+      a0 = vaddq_f32(a0, vld1q_f32(in));
+      a1 = vaddq_f32(a1, vld1q_f32(in + 4));
+    }
+    vst1q_f32(acc + i, a0);
+    vst1q_f32(acc + i + 4, a1);
+  }
+  sum_tail(acc, inputs, count, i, n);
+}
+
+template <bool BF16>
+float32x4_t load_state_neon(const void* s, size_t i) {
+  if constexpr (BF16) {
+    return vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(static_cast<const uint16_t*>(s) + i), 16));
+  }
+  return vld1q_f32(static_cast<const float*>(s) + i);
+}
+
+template <bool BF16>
+void store_state_neon(void* s, size_t i, float32x4_t v) {
+  if constexpr (BF16) {
+    uint32x4_t u = vreinterpretq_u32_f32(v);
+    uint32x4_t lsb = vandq_u32(vshrq_n_u32(u, 16), vdupq_n_u32(1));
+    u = vaddq_u32(u, vaddq_u32(vdupq_n_u32(0x7fff), lsb));
+    vst1_u16(static_cast<uint16_t*>(s) + i, vshrn_n_u32(u, 16));
+    return;
+  }
+  vst1q_f32(static_cast<float*>(s) + i, v);
+}
+
+// no streaming store worth having here, nontemporal is ignored
+template <bool M, bool V, bool BF16>
+struct step_neon {
+  static bool run(float* out, const float* param, const float* grad, void* m, void* v, const step_params& p,
+                  size_t n, bool) {
+    const float32x4_t scale = vdupq_n_f32(p.scale);
+    const float32x4_t rate = vdupq_n_f32(p.rate);
+    const float32x4_t decay1 = vdupq_n_f32(p.decay1);
+    const float32x4_t gain1 = vdupq_n_f32(p.gain1);
+    const float32x4_t decay2 = vdupq_n_f32(p.decay2);
+    const float32x4_t gain2 = vdupq_n_f32(p.gain2);
+    const float32x4_t epsilon = vdupq_n_f32(p.epsilon);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    uint32x4_t nonzero = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      float32x4_t g = vmulq_f32(scale, vld1q_f32(grad + i));
+      float32x4_t num = g;
+      if constexpr (M) {
+        num = vaddq_f32(vmulq_f32(decay1, load_state_neon<BF16>(m, i)), vmulq_f32(gain1, g));
+        store_state_neon<BF16>(m, i, num);
+      }
+      float32x4_t delta = vmulq_f32(rate, num);
+      if constexpr (V) {
+        float32x4_t second = vaddq_f32(vmulq_f32(decay2, load_state_neon<BF16>(v, i)), vmulq_f32(gain2, vmulq_f32(g, g)));
+        store_state_neon<BF16>(v, i, second);
+        delta = vdivq_f32(delta, vaddq_f32(vsqrtq_f32(second), epsilon));
+      }
+      nonzero = vorrq_u32(nonzero, vmvnq_u32(vceqq_f32(delta, zero)));
+      vst1q_f32(out + i, vsubq_f32(vld1q_f32(param + i), delta));
+    }
+    bool changed = vmaxvq_u32(nonzero) != 0;
+    return step_scalar<M, V, BF16>::run(out + i, param + i, grad + i, state_at<BF16>(m, i), state_at<BF16>(v, i), p,
+                                        n - i, false) || changed;
+  }
+};
+
+bool optimizer_step_neon(float* out, const float* param, const float* grad, void* m, void* v, bool bf16,
+                         const step_params& p, size_t n, bool nontemporal) {
+  return dispatch_step<step_neon>(out, param, grad, m, v, bf16, p, n, nontemporal);
+}
+
+// quantized gradients and 16-bit floats go through the scalar loops here
+const kernel_table kNeon = {"neon", sum_into_neon, sum_int8_scalar, sum_sign_scalar, quantize_int8_scalar,
+                            quantize_sign_scalar, widen_half_scalar, narrow_half_scalar, sum_half_scalar,
+                            optimizer_step_neon};
+
+#endif  // PS_KERNELS_NEON
+
+// best variant this CPU runs, ordered fastest first
+const kernel_table* detect(const std::string& name) {
+#if PS_KERNELS_X86
+  __builtin_cpu_init();
+  bool f16c = __builtin_cpu_supports("f16c");
+  if ((name == "auto" || name == "avx512") && __builtin_cpu_supports("avx512f") && f16c) return &kAvx512;
+  if ((name == "auto" || name == "avx2") && __builtin_cpu_supports("avx2") && f16c) return &kAvx2;
+#endif
+#if PS_KERNELS_NEON
+  if (name == "auto" || name == "neon") return &kNeon;
+#endif
+  if (name == "auto" || name == "scalar") return &kScalar;
+  return nullptr;
+}
+
+std::atomic<const kernel_table*> active{nullptr};
+
+const kernel_table& table() {
+  const kernel_table* t = active.load(std::memory_order_acquire);
+  if (!t) {
+    t = detect("auto");
+    active.store(t, std::memory_order_release);
+  }
+  return *t;
+}
+
+}  // namespace
+
+void sum_into(float* acc, const unsigned char* const* inputs, size_t count, size_t n) {
+  table().sum_into(acc, inputs, count, n);
+}
+
+void sum_int8_into(float* acc, const unsigned char* codes, const unsigned char* scales, size_t block, size_t first, size_t n) {
+  table().sum_int8_into(acc, codes, scales, block, first, n);
+}
+
+void sum_sign_into(float* acc, const unsigned char* bits, const unsigned char* scales, size_t block, size_t first, size_t n) {
+  table().sum_sign_into(acc, bits, scales, block, first, n);
+}
+
+void quantize_int8(float* values, unsigned char* codes, float* scales, size_t n, size_t block) {
+  table().quantize_int8(values, codes, scales, n, block);
+}
+
+void quantize_sign(float* values, unsigned char* bits, float* scales, size_t n, size_t block) {
+  table().quantize_sign(values, bits, scales, n, block);
+}
+
+void widen_half(float* out, const unsigned char* in, bool bf16, size_t n) {
+  table().widen_half(out, in, bf16, n);
+}
+
+void narrow_half(unsigned char* out, const float* in, bool bf16, size_t n) {
+  table().narrow_half(out, in, bf16, n);
+}
+
+void sum_half_into(float* acc, const unsigned char* in, bool bf16, size_t n) {
+  table().sum_half_into(acc, in, bf16, n);
+}
+
+bool optimizer_step(float* out, const float* param, const float* grad, void* m, void* v, bool bf16,
+                    const step_params& p, size_t n, bool nontemporal) {
+  return table().optimizer_step(out, param, grad, m, v, bf16, p, n, nontemporal);
+}
+
+bool select_kernels(const std::string& name) {
+  const kernel_table* t = detect(name);
+  if (!t) return false;
+  active.store(t, std::memory_order_release);
+  return true;
+}
+
+const char* kernel_name() {
+  return table().name;
+}
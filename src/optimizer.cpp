@@ -0,0 +1,141 @@
+#include "optimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <istream>
+#include <ostream>
+
+bool valid_optimizer(const std::string& name) {
+  return name == "sgd" || name == "momentum" || name == "adam" || name == "adagrad";
+}
+
+Optimizer::Optimizer(const OptimizerOptions& options)
+  : options_(options),
+    first_moment_(options.name == "momentum" || options.name == "adam"),
+    second_moment_(options.name == "adam" || options.name == "adagrad") {}
+
+size_t Optimizer::state_bytes() const {
+  return moments() * words_per_element() * sizeof(uint16_t);
+}
+
+void Optimizer::prepare(size_t index, size_t elements) {
+  if (index >= state_.size()) {
+    state_.resize(index + 1);
+  }
+  tensor_state& state = state_[index];
+  state.held.reset();
+  if (state.elements != elements) {
+    // new or reshaped tensor, its moments start from zero
+    state.elements = elements;
+    state.words.reset(new uint16_t[words_of(state)]());
+    state.steps = 0;
+  } else if (state.words.use_count() > 1 && words_of(state) > 0) {
+    // a copy holds these moments, step() fills a buffer of our own range by range
+    state.held = std::move(state.words);
+    state.words.reset(new uint16_t[words_of(state)]);
+  }
+  state.steps++;
+}
+
+bool Optimizer::step(size_t index, float* out, const float* param, const float* grad, float scale, size_t begin, size_t end,
+                     bool nontemporal) {
+  tensor_state& state = state_[index];
+  step_params p = params_for(state.steps);
+  p.scale = scale;
+  size_t stride = state.elements * words_per_element();
+  uint16_t* base = state.words.get();
+  if (state.held) {
+    for (size_t moment = 0; moment < moments(); ++moment) {
+      size_t from = moment * stride + begin * words_per_element();
+      size_t to = moment * stride + end * words_per_element();
+      std::copy(state.held.get() + from, state.held.get() + to, base + from);
+    }
+  }
+  void* m = first_moment_ ? base + begin * words_per_element() : nullptr;
+  void* v = second_moment_ ? base + (first_moment_ ? stride : 0) + begin * words_per_element() : nullptr;
+  return optimizer_step(out, param, grad, m, v, options_.bf16_state, p, end - begin, nontemporal);
+}
+
+void Optimizer::finish(size_t index) {
+  state_[index].held.reset();
+}
+
+step_params Optimizer::params_for(int64_t steps) const {
+  step_params p;
+  p.rate = options_.learning_rate;
+  if (options_.name == "momentum") {
+    p.decay1 = options_.momentum;
+    p.gain1 = 1.0f;
+  } else if (options_.name == "adam") {
+    // bias correction folded into the rate, epsilon then applies to the uncorrected v
+    double t = static_cast<double>(steps);
+    p.rate = static_cast<float>(options_.learning_rate * std::sqrt(1.0 - std::pow(options_.beta2, t)) /
+                                (1.0 - std::pow(options_.beta1, t)));
+    p.decay1 = options_.beta1;
+    p.gain1 = 1.0f - options_.beta1;
+    p.decay2 = options_.beta2;
+    p.gain2 = 1.0f - options_.beta2;
+    p.epsilon = options_.epsilon;
+  } else if (options_.name == "adagrad") {
+    p.decay2 = 1.0f;
+    p.gain2 = 1.0f;
+    p.epsilon = options_.epsilon;
+  }
+  return p;
+}
+
+void Optimizer::reset() {
+  state_.clear();
+}
+
+void Optimizer::save(std::ostream& out) const {
+  size_t name_len = options_.name.size();
+  out.write(reinterpret_cast<const char*>(&name_len), sizeof(size_t));
+  out.write(options_.name.c_str(), name_len);
+  int32_t bf16 = options_.bf16_state ? 1 : 0;
+  out.write(reinterpret_cast<const char*>(&bf16), sizeof(int32_t));
+
+  size_t num_tensors = state_.size();
+  out.write(reinterpret_cast<const char*>(&num_tensors), sizeof(size_t));
+  for (const auto& state : state_) {
+    out.write(reinterpret_cast<const char*>(&state.elements), sizeof(size_t));
+    out.write(reinterpret_cast<const char*>(&state.steps), sizeof(int64_t));
+    out.write(reinterpret_cast<const char*>(state.words.get()), words_of(state) * sizeof(uint16_t));
+  }
+}
+
+bool Optimizer::load(std::istream& in, size_t num_tensors) {
+  reset();
+
+  // checkpoints from before optimizer state end right after the tensors
+  size_t name_len = 0;
+  if (!in.read(reinterpret_cast<char*>(&name_len), sizeof(size_t)) || name_len > 64) {
+    return false;
+  }
+  std::string name(name_len, '\0');
+  int32_t bf16 = 0;
+  size_t count = 0;
+  in.read(&name[0], name_len);
+  in.read(reinterpret_cast<char*>(&bf16), sizeof(int32_t));
+  in.read(reinterpret_cast<char*>(&count), sizeof(size_t));
+  // moments of another optimizer or precision do not carry over
+  if (!in || name != options_.name || (bf16 != 0) != options_.bf16_state || count > num_tensors) {
+    return false;
+  }
+
+  std::vector<tensor_state> loaded(count);
+  for (auto& state : loaded) {
+    in.read(reinterpret_cast<char*>(&state.elements), sizeof(size_t));
+    in.read(reinterpret_cast<char*>(&state.steps), sizeof(int64_t));
+    if (!in) {
+      return false;
+    }
+    state.words.reset(new uint16_t[words_of(state)]);
+    in.read(reinterpret_cast<char*>(state.words.get()), words_of(state) * sizeof(uint16_t));
+  }
+  if (!in) {
+    return false;
+  }
+  state_ = std::move(loaded);
+  return true;
+}
@@ -1,23 +1,125 @@
 #include <iostream>
 #include <string>
+#include <vector>
 #include "parameter_server_service.h"
+#include "kernels.h"
 
 int main(int argc, char** argv) {
   std::string server_address = "0.0.0.0:50051";
   int total_workers = 2;
   int checkpoint_interval = 10;
+  int shard_id = -1;
   
-  if (argc > 1) {
-    server_address = argv[1];
+  ServerOptions options;
+  
+  // --name=value flags may appear anywhere, everything else is positional
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      args.push_back(arg);
+      continue;
+    }
+    size_t eq = arg.find('=');
+    std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+    std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+    if (name == "completion-queues") {
+      options.completion_queues = std::stoi(value);
+    } else if (name == "polling-threads") {
+      options.polling_threads = std::stoi(value);
+    } else if (name == "executor-threads") {
+      options.executor_threads = std::stoi(value);
+    } else if (name == "aggregation-threads") {
+      options.aggregation_threads = std::stoi(value);
+    } else if (name == "preposted-calls") {
+      options.preposted_calls = std::stoi(value);
+    } else if (name == "pin-threads") {
+      options.pin_threads = value != "0" && value != "false";
+    } else if (name == "optimizer") {
+      if (!valid_optimizer(value)) {
+        std::cerr << "unknown optimizer " << value << ", expected sgd, momentum, adam or adagrad" << std::endl;
+        return 1;
+      }
+      options.optimizer.name = value;
+    } else if (name == "learning-rate") {
+      options.optimizer.learning_rate = std::stof(value);
+    } else if (name == "momentum") {
+      options.optimizer.momentum = std::stof(value);
+    } else if (name == "beta1") {
+      options.optimizer.beta1 = std::stof(value);
+    } else if (name == "beta2") {
+      options.optimizer.beta2 = std::stof(value);
+    } else if (name == "epsilon") {
+      options.optimizer.epsilon = std::stof(value);
+    } else if (name == "optimizer-state") {
+      if (value != "fp32" && value != "bf16") {
+        std::cerr << "optimizer state " << value << " must be fp32 or bf16" << std::endl;
+        return 1;
+      }
+      options.optimizer.bf16_state = value == "bf16";
+    } else if (name == "consistency") {
+      if (!valid_consistency_mode(value)) {
+        std::cerr << "unknown consistency " << value << ", expected bsp, async or ssp" << std::endl;
+        return 1;
+      }
+      options.consistency.mode = value;
+    } else if (name == "staleness") {
+      options.consistency.staleness = std::stoi(value);
+      if (options.consistency.staleness < 0) {
+        std::cerr << "staleness must not be negative" << std::endl;
+        return 1;
+      }
+    } else if (name == "quorum") {
+      options.consistency.quorum = std::stoi(value);
+    } else if (name == "late-pushes") {
+      if (!valid_late_policy(value)) {
+        std::cerr << "late pushes " << value << " must be drop or next" << std::endl;
+        return 1;
+      }
+      options.consistency.late_pushes = value;
+    } else if (name == "elastic") {
+      options.consistency.elastic = value != "0" && value != "false";
+    } else if (name == "shared-memory") {
+      options.shared_memory = value != "0" && value != "false";
+    } else if (name == "kernels") {
+      if (!select_kernels(value)) {
+        std::cerr << "kernels " << value << " not supported on this cpu" << std::endl;
+        return 1;
+      }
+    } else {
+      std::cerr << "unknown option " << arg << std::endl;
+      return 1;
+    }
+  }
+  
+  if (args.size() > 0) {
+    server_address = args[0];
   }
-  if (argc > 2) {
-    total_workers = std::stoi(argv[2]);
+  if (args.size() > 1) {
+    total_workers = std::stoi(args[1]);
   }
-  if (argc > 3) {
-    checkpoint_interval = std::stoi(argv[3]);
+  if (args.size() > 2) {
+    checkpoint_interval = std::stoi(args[2]);
+  }
+  if (args.size() > 3) {
+    shard_id = std::stoi(args[3]);
   }
   
-  run_server(server_address, total_workers, checkpoint_interval);
+  // an elastic server may grow past its starting size, its quorum is capped by the current membership instead
+  int max_quorum = options.consistency.elastic ? kMaxWorkers : total_workers;
+  if (options.consistency.quorum < 0 || options.consistency.quorum > max_quorum) {
+    std::cerr << "quorum must be between 1 and " << max_quorum << ", or 0 for every worker" << std::endl;
+    return 1;
+  }
+  if (options.consistency.elastic && total_workers > kMaxWorkers) {
+    std::cerr << "an elastic server takes at most " << kMaxWorkers << " workers" << std::endl;
+    return 1;
+  }
+  if (options.consistency.quorum > 0 && options.consistency.mode != "bsp") {
+    std::cerr << "a quorum only applies to bsp consistency" << std::endl;
+    return 1;
+  }
+  
+  run_server(server_address, total_workers, checkpoint_interval, shard_id, options);
   return 0;
 }
-
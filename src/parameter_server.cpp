@@ -1,129 +1,919 @@
 #include "parameter_server.h"
+#include "kernels.h"
 
 #include <algorithm>
+#include <climits>
+#include <cstdio>
 #include <numeric>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
 
-ParameterServerCore::ParameterServerCore(int total_workers) : total_workers_(total_workers), current_iteration_(0) {}
+namespace {
+
+size_t num_blocks(size_t elements) {
+  return (elements + kVersionBlockElements - 1) / kVersionBlockElements;
+}
+
+int64_t block_version(const tensor& t, size_t block) {
+  return block < t.block_versions.size() ? t.block_versions[block] : t.version;
+}
+
+// marks every element of t as changed in version
+void stamp(tensor& t, int64_t version) {
+  t.version = version;
+  t.block_versions.assign(num_blocks(t.data.size()), version);
+}
+
+// atomic max, for counters that only move forward
+void raise_to(std::atomic<int32_t>& value, int32_t to) {
+  int32_t seen = value.load(std::memory_order_relaxed);
+  while (seen < to && !value.compare_exchange_weak(seen, to, std::memory_order_acq_rel)) {
+  }
+}
+
+uint64_t random_incarnation() {
+  std::random_device rd;
+  return (static_cast<uint64_t>(rd()) << 32) | rd();
+}
+
+// flushes a written file to disk
+bool sync_file(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool synced = fsync(fd) == 0;
+  close(fd);
+  return synced;
+}
+
+void sync_directory_of(const std::string& path) {
+  size_t slash = path.rfind('/');
+  std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+  int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+}  // namespace
+
+std::vector<tensor_range> parameter_snapshot::changed_since(int64_t known_version) const {
+  std::vector<tensor_range> ranges;
+  for (size_t i = 0; i < tensors.size(); ++i) {
+    const tensor& t = *tensors[i];
+    if (t.version <= known_version) {
+      continue;
+    }
+    size_t blocks = num_blocks(t.data.size());
+    if (blocks == 0) {
+      ranges.push_back({i, 0, 0});
+      continue;
+    }
+    for (size_t b = 0; b < blocks; ++b) {
+      if (block_version(t, b) <= known_version) {
+        continue;
+      }
+      size_t begin = b * kVersionBlockElements;
+      size_t end = std::min(begin + kVersionBlockElements, t.data.size());
+      if (!ranges.empty() && ranges.back().tensor == i && ranges.back().end == begin) {
+        ranges.back().end = end;
+      } else {
+        ranges.push_back({i, begin, end});
+      }
+    }
+  }
+  return ranges;
+}
+
+bool valid_consistency_mode(const std::string& mode) {
+  return mode == "bsp" || mode == "ssp" || mode == "async";
+}
+
+bool valid_late_policy(const std::string& policy) {
+  return policy == "drop" || policy == "next";
+}
+
+void StalenessHistogram::record(int32_t staleness) {
+  staleness = std::max(staleness, 0);
+  counts_[std::min(staleness, kBuckets - 1)].fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(static_cast<uint64_t>(staleness), std::memory_order_relaxed);
+  total_.fetch_add(1, std::memory_order_relaxed);
+  raise_to(max_, staleness);
+}
+
+std::string StalenessHistogram::summary() const {
+  uint64_t counts[kBuckets];
+  uint64_t n = 0;
+  for (int b = 0; b < kBuckets; ++b) {
+    counts[b] = counts_[b].load(std::memory_order_relaxed);
+    n += counts[b];
+  }
+  std::ostringstream out;
+  out << "n=" << n;
+  if (n == 0) {
+    return out.str();
+  }
+  // smallest bucket holding at least the given share of the samples
+  auto percentile = [&](double share) {
+    uint64_t wanted = static_cast<uint64_t>(share * static_cast<double>(n) + 0.999999);
+    uint64_t seen = 0;
+    for (int b = 0; b < kBuckets; ++b) {
+      seen += counts[b];
+      if (seen >= wanted) {
+        return std::to_string(b) + (b == kBuckets - 1 ? "+" : "");
+      }
+    }
+    return std::to_string(kBuckets - 1) + "+";
+  };
+  out << " mean=" << static_cast<double>(sum_.load(std::memory_order_relaxed)) / static_cast<double>(n)
+      << " p50=" << percentile(0.5) << " p90=" << percentile(0.9) << " p99=" << percentile(0.99)
+      << " max=" << max_.load(std::memory_order_relaxed);
+  return out.str();
+}
+
+ParameterServerCore::ParameterServerCore(int total_workers, size_t aggregation_threads, const OptimizerOptions& optimizer,
+                                         const ConsistencyOptions& consistency)
+  : capacity_(std::max(consistency.elastic ? kMaxWorkers : total_workers, 1)), total_workers_(total_workers),
+    consistency_(consistency), independent_pushes_(consistency.mode != "bsp"),
+    quorum_pushes_(!independent_pushes_ && consistency.quorum > 0 && (consistency.elastic || consistency.quorum < total_workers)),
+    incarnation_(random_incarnation()), snapshot_(std::make_shared<const parameter_snapshot>()), optimizer_(optimizer),
+    ring_(new iteration_slot[kIterationSlots]), joined_epoch_(new std::atomic<int64_t>[capacity_]),
+    pushes_(new worker_push[capacity_]), pushed_clock_(new std::atomic<int32_t>[capacity_]), applied_clock_(capacity_, -1),
+    current_iteration_(0), last_aggregated_iteration_(-1), generation_(0), aggregation_pool_(aggregation_threads) {
+  for (int32_t i = 0; i < kIterationSlots; ++i) {
+    ring_[i].next_chunk.reset(new std::atomic<int64_t>[capacity_]);
+    for (int w = 0; w < capacity_; ++w) {
+      ring_[i].next_chunk[w].store(0, std::memory_order_relaxed);
+    }
+  }
+  // the command line's workers, ids 0 to total_workers - 1, are the first membership
+  for (int w = 0; w < capacity_; ++w) {
+    joined_epoch_[w].store(w < total_workers ? 0 : -1, std::memory_order_relaxed);
+    pushed_clock_[w].store(-1, std::memory_order_relaxed);
+  }
+}
 
 ParameterServerCore::~ParameterServerCore() {}
 
 void ParameterServerCore::initialize_parameters(const std::vector<tensor>& initial_params) {
-  std::lock_guard<std::mutex> lock(params_mutex_);
-  parameters_ = initial_params;
+  std::lock_guard<std::mutex> lock(update_mutex_);
+  auto next = std::make_shared<parameter_snapshot>();
+  next->version = serve_parameters()->version + 1;
+  next->layout_version = next->version;
+  for (const auto& t : initial_params) {
+    auto stamped = std::make_shared<tensor>(t);
+    stamp(*stamped, next->version);
+    next->tensors.push_back(std::move(stamped));
+  }
+  optimizer_.reset();
+  publish(std::move(next));
 }
 
-bool ParameterServerCore::receive_gradients(int32_t worker_id, int32_t iteration,const std::vector<tensor>& gradients) {
-  
-    std::lock_guard<std::mutex> lock(state_mutex_);
+void ParameterServerCore::publish(std::shared_ptr<const parameter_snapshot> snapshot) {
+  std::atomic_store(&snapshot_, std::move(snapshot));
+  // taken after the store, so a waiter either saw the new version or is already asleep
+  { std::lock_guard<std::mutex> lock(published_mutex_); }
+  published_.notify_all();
+}
+
+std::shared_ptr<const parameter_snapshot> ParameterServerCore::wait_for_update(int64_t after_version,
+                                                                               std::chrono::milliseconds timeout) const {
+  std::unique_lock<std::mutex> lock(published_mutex_);
+  published_.wait_for(lock, timeout, [&]() { return std::atomic_load(&snapshot_)->version > after_version; });
+  return std::atomic_load(&snapshot_);
+}
+
+ParameterServerCore::iteration_slot& ParameterServerCore::slot_for(int32_t iteration) const {
+  int32_t i = iteration % kIterationSlots;
+  return ring_[i < 0 ? i + kIterationSlots : i];
+}
+
+bool ParameterServerCore::open_push(iteration_slot& slot, int32_t iteration, int32_t worker_id,
+                                    int32_t& workers_received, bool& complete) {
+  raise_to(current_iteration_, iteration);
   
-  if (iteration > current_iteration_) {
-    current_iteration_ = iteration;
+  int32_t held = slot.iteration.load(std::memory_order_relaxed);
+  if (held != iteration) {
+    if (iteration <= last_aggregated_iteration_.load(std::memory_order_acquire)) {
+      // applied already and left the ring, this is a late retry
+      workers_received = total_workers_.load(std::memory_order_acquire);
+      complete = true;
+      return false;
+    }
+    if (held > iteration || (held >= 0 && !slot.aggregated.load(std::memory_order_relaxed))) {
+      // the ring is a full lap behind, this iteration waits until its slot frees up
+      workers_received = 0;
+      complete = false;
+      return false;
+    }
+    // recycle: reset every field before the new iteration is published to readers
+    slot.sums = std::make_shared<iteration_sums>();
+    for (int w = 0; w < capacity_; ++w) {
+      slot.next_chunk[w].store(0, std::memory_order_relaxed);
+    }
+    // the membership as of now; workers joining later are counted from the next iteration on
+    int64_t epoch = membership_epoch_.load(std::memory_order_acquire);
+    slot.epoch.store(epoch, std::memory_order_relaxed);
+    slot.expected = 0;
+    for (int w = 0; w < capacity_; ++w) {
+      int64_t joined = joined_epoch_[w].load(std::memory_order_acquire);
+      slot.expected += joined >= 0 && joined <= epoch ? 1 : 0;
+    }
+    slot.workers_received.store(0, std::memory_order_relaxed);
+    slot.aggregated.store(false, std::memory_order_relaxed);
+    slot.closed = false;
+    slot.pushed.clear();
+    slot.generation = generation_.load(std::memory_order_relaxed);
+    slot.iteration.store(iteration, std::memory_order_release);
   }
   
-  auto& state = iteration_states_[iteration];
-  
-  if (state.aggregated) {
-    return true;
+  workers_received = slot.workers_received.load(std::memory_order_relaxed);
+  complete = slot.aggregated.load(std::memory_order_relaxed);
+  return !complete && worker_id >= 0 && worker_id < capacity_;
+}
+
+bool ParameterServerCore::member_of(const iteration_slot& slot, int32_t worker_id) const {
+  int64_t joined = joined_epoch_[worker_id].load(std::memory_order_acquire);
+  return joined >= 0 && joined <= slot.epoch.load(std::memory_order_relaxed);
+}
+
+int32_t ParameterServerCore::needed(const iteration_slot& slot) const {
+  return quorum_pushes_ ? std::min(consistency_.quorum, slot.expected) : slot.expected;
+}
+
+void ParameterServerCore::close_iteration(iteration_slot& slot) {
+  // the update runs on the aggregation pool and the rpc that got here returns now
+  slot.closed = true;
+  int32_t iteration = slot.iteration.load(std::memory_order_relaxed);
+  int32_t received = slot.workers_received.load(std::memory_order_relaxed);
+  uint64_t generation = slot.generation;
+  std::vector<std::shared_ptr<iteration_sums>> sums;
+  if (quorum_pushes_) {
+    sums = std::move(slot.pushed);
+    slot.pushed.clear();
+  } else {
+    sums.push_back(slot.sums);
+  }
+  iteration_slot* target = &slot;
+  aggregation_pool_.submit([this, target, iteration, received, generation, sums = std::move(sums)]() {
+    apply_iteration(*target, iteration, received, generation, sums);
+  });
+}
+
+bool ParameterServerCore::receive_gradients(int32_t worker_id, int32_t iteration, const std::vector<tensor_view>& gradients, int32_t& workers_received) {
+  std::vector<tensor_piece> pieces;
+  pieces.reserve(gradients.size());
+  for (const auto& grad : gradients) {
+    pieces.push_back({grad, 0, grad.size});
+  }
+  if (independent_pushes_ || quorum_pushes_) {
+    return receive_own_push(worker_id, iteration, 0, pieces, true, workers_received);
   }
   
-  bool is_new_worker = (state.worker_gradients.find(worker_id) == state.worker_gradients.end());
-  state.worker_gradients[worker_id] = gradients;
+  iteration_slot& slot = slot_for(iteration);
+  std::shared_ptr<iteration_sums> sums;
+  std::vector<accumulator_slot*> slots;
+  uint64_t generation = 0;
+  {
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    bool complete = false;
+    if (!open_push(slot, iteration, worker_id, workers_received, complete)) {
+      return complete;
+    }
+    if (!member_of(slot, worker_id) && slot.next_chunk[worker_id].load(std::memory_order_relaxed) == 0) {
+      // joined after the iteration opened, or left: the worker waits for it without counting
+      return false;
+    }
+    if (slot.next_chunk[worker_id].load(std::memory_order_relaxed) < 0) {
+      // duplicates were already folded into the sum, only the first push counts
+      return false;
+    }
+    slot.next_chunk[worker_id].store(-1, std::memory_order_release);
+    sums = slot.sums;
+    generation = slot.generation;
+    slots = slots_for(*sums, pieces);
+  }
   
-  size_t current_count = state.worker_gradients.size();
+  reduce(slots, pieces);
+  finish_push(slot, iteration, generation, true, workers_received);
+  return false;
+}
+
+bool ParameterServerCore::receive_gradient_chunk(int32_t worker_id, int32_t iteration, int64_t sequence,
+                                                 const std::vector<tensor_piece>& pieces, bool last, int32_t& workers_received) {
+  if (independent_pushes_ || quorum_pushes_) {
+    return receive_own_push(worker_id, iteration, sequence, pieces, last, workers_received);
+  }
+  iteration_slot& slot = slot_for(iteration);
+  std::shared_ptr<iteration_sums> sums;
+  std::vector<accumulator_slot*> slots;
+  uint64_t generation = 0;
+  {
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    bool complete = false;
+    if (!open_push(slot, iteration, worker_id, workers_received, complete)) {
+      return complete;
+    }
+    if (!member_of(slot, worker_id) && slot.next_chunk[worker_id].load(std::memory_order_relaxed) == 0) {
+      return false;
+    }
+    // a resumed stream may repeat chunks that were already reduced, and a gap means the stream has to be resent from next_chunk.
+    // the chunk is claimed before it is reduced, so a repeat arriving meanwhile is ignored
+    if (sequence != slot.next_chunk[worker_id].load(std::memory_order_relaxed)) {
+      return false;
+    }
+    slot.next_chunk[worker_id].store(last ? -1 : sequence + 1, std::memory_order_release);
+    sums = slot.sums;
+    generation = slot.generation;
+    slots = slots_for(*sums, pieces);
+  }
   
-  if (current_count >= static_cast<size_t>(total_workers_)) {
-    std::vector<tensor> aggregated;
-    
-    for (size_t i = 0; i < gradients.size(); ++i) {
-      tensor agg_tensor;
-      agg_tensor.name = gradients[i].name;
-      agg_tensor.shape = gradients[i].shape;
-      agg_tensor.dtype = gradients[i].dtype;
-      
-      size_t data_size = gradients[i].data.size();
-      agg_tensor.data.resize(data_size, 0.0f);
-      
-      for (const auto& [wid, grad_vec] : state.worker_gradients) {
-        if (i < grad_vec.size()) {
-          for (size_t j = 0; j < data_size && j < grad_vec[i].data.size(); ++j) {
-            agg_tensor.data[j] += grad_vec[i].data[j];
-          }
+  reduce(slots, pieces);
+  finish_push(slot, iteration, generation, last, workers_received);
+  return false;
+}
+
+int64_t ParameterServerCore::next_gradient_chunk(int32_t worker_id, int32_t iteration) const {
+  if (independent_pushes_ || quorum_pushes_) {
+    if (worker_id < 0 || worker_id >= capacity_) return 0;
+    const worker_push& push = pushes_[worker_id];
+    int32_t held = push.iteration.load(std::memory_order_acquire);
+    int64_t next = push.next_chunk.load(std::memory_order_acquire);
+    if (push.iteration.load(std::memory_order_acquire) == held && held >= iteration) {
+      return held == iteration ? next : -1;
+    }
+    return pushed_clock_[worker_id].load(std::memory_order_acquire) >= iteration ? -1 : 0;
+  }
+  const iteration_slot& slot = slot_for(iteration);
+  if (slot.iteration.load(std::memory_order_acquire) == iteration) {
+    bool aggregated = slot.aggregated.load(std::memory_order_acquire);
+    int64_t next = worker_id >= 0 && worker_id < capacity_ ? slot.next_chunk[worker_id].load(std::memory_order_acquire) : 0;
+    // the iteration does not wait for a worker outside its membership, there is nothing to resend
+    bool outsider = next == 0 && worker_id >= 0 && worker_id < capacity_ && !member_of(slot, worker_id);
+    if (slot.iteration.load(std::memory_order_acquire) == iteration) {
+      return aggregated || outsider ? -1 : next;
+    }
+  }
+  return iteration <= last_aggregated_iteration_.load(std::memory_order_acquire) ? -1 : 0;
+}
+
+bool ParameterServerCore::late_push(int32_t worker_id, int32_t iteration) const {
+  if (worker_id < 0 || worker_id >= capacity_) return false;
+  if (quorum_pushes_) {
+    const worker_push& push = pushes_[worker_id];
+    bool late = push.late.load(std::memory_order_acquire);
+    if (push.iteration.load(std::memory_order_acquire) == iteration && late) return true;
+  }
+  if (!consistency_.elastic) return false;
+  // a worker that joined mid-job starts out behind everyone else
+  if (independent_pushes_) return iteration < pushed_clock_[worker_id].load(std::memory_order_acquire);
+  return iteration <= last_aggregated_iteration_.load(std::memory_order_acquire);
+}
+
+std::vector<ParameterServerCore::accumulator_slot*> ParameterServerCore::slots_for(iteration_sums& sums,
+                                                                                    const std::vector<tensor_piece>& pieces) {
+  std::vector<accumulator_slot*> slots;
+  slots.reserve(pieces.size());
+  for (const auto& piece : pieces) {
+    auto index = sums.index.find(piece.view.name);
+    if (index == sums.index.end()) {
+      auto slot = std::make_unique<accumulator_slot>();
+      slot->sum.name = piece.view.name;
+      slot->sum.shape = piece.view.shape;
+      slot->sum.dtype = kDtypeFloat32;  // quantized and 16-bit pieces are widened as they are added
+      slot->total_elements = piece.total_elements;
+      slot->stripes = std::vector<std::mutex>((piece.total_elements + kReduceStripeElements - 1) / kReduceStripeElements);
+      index = sums.index.emplace(piece.view.name, sums.slots.size()).first;
+      sums.slots.push_back(std::move(slot));
+    }
+    slots.push_back(sums.slots[index->second].get());
+  }
+  return slots;
+}
+
+void ParameterServerCore::reduce(const std::vector<accumulator_slot*>& slots, const std::vector<tensor_piece>& pieces) {
+  // one task per piece and stripe it overlaps, so large tensors spread over cores and small ones cost one task
+  struct stripe_task {
+    size_t piece;
+    size_t stripe;
+    size_t first;  // sparse pieces: entries [first, last) fall in the stripe
+    size_t last;
+  };
+  std::vector<stripe_task> tasks;
+  for (size_t p = 0; p < pieces.size(); ++p) {
+    size_t begin = pieces[p].offset;
+    const tensor_view& view = pieces[p].view;
+    if (view.indices) {
+      // only the stripes holding entries get a task, the first one also allocates the sum
+      tasks.push_back({p, 0, 0, 0});
+      for (size_t j = 0; j < view.nnz && begin + view.index(j) < slots[p]->total_elements;) {
+        size_t stripe = (begin + view.index(j)) / kReduceStripeElements;
+        size_t k = j;
+        while (k < view.nnz && begin + view.index(k) < slots[p]->total_elements &&
+               (begin + view.index(k)) / kReduceStripeElements == stripe) {
+          ++k;
         }
+        tasks.push_back({p, stripe, j, k});
+        j = k;
       }
-      
-      int32_t actual_workers = static_cast<int32_t>(current_count);
-      for (size_t j = 0; j < data_size; ++j) {
-        agg_tensor.data[j] /= actual_workers;
-      }
-      
-      aggregated.push_back(agg_tensor);
+      continue;
+    }
+    size_t end = std::min(slots[p]->total_elements, begin + view.size);
+    for (size_t s = begin / kReduceStripeElements; begin < end && s * kReduceStripeElements < end; ++s) {
+      tasks.push_back({p, s, 0, 0});
     }
+  }
+  
+  aggregation_pool_.parallel_for(tasks.size(), [&](size_t t) {
+    const tensor_piece& piece = pieces[tasks[t].piece];
+    accumulator_slot& slot = *slots[tasks[t].piece];
+    std::call_once(slot.allocated, [&slot]() { slot.sum.data.resize(slot.total_elements, 0.0f); });
     
-        {
-        std::lock_guard<std::mutex> params_lock(params_mutex_);
-        ParameterServerCore::aggregate_gradients(aggregated);
-        }
+    if (piece.view.indices) {
+      if (tasks[t].first == tasks[t].last) return;
+      float* acc = slot.sum.data.data() + piece.offset;
+      std::lock_guard<std::mutex> lock(slot.stripes[tasks[t].stripe]);
+      for (size_t j = tasks[t].first; j < tasks[t].last; ++j) {
+        acc[piece.view.index(j)] += piece.view.load(j);
+      }
+      return;
+    }
     
-    state.aggregated = true;
+    size_t stripe_begin = tasks[t].stripe * kReduceStripeElements;
+    size_t begin = std::max(piece.offset, stripe_begin);
+    size_t end = std::min({piece.offset + piece.view.size, stripe_begin + kReduceStripeElements, slot.total_elements});
+    std::lock_guard<std::mutex> lock(slot.stripes[tasks[t].stripe]);
+    if (piece.view.dtype == kDtypeInt8Block) {
+      sum_int8_into(slot.sum.data.data() + begin, piece.view.data, piece.view.scales, piece.view.block,
+                    begin - piece.offset, end - begin);
+    } else if (piece.view.dtype == kDtypeSignBlock) {
+      sum_sign_into(slot.sum.data.data() + begin, piece.view.data, piece.view.scales, piece.view.block,
+                    begin - piece.offset, end - begin);
+    } else if (piece.view.half()) {
+      sum_half_into(slot.sum.data.data() + begin, piece.view.data + (begin - piece.offset) * sizeof(uint16_t),
+                    piece.view.dtype == kDtypeBfloat16, end - begin);
+    } else {
+      const unsigned char* in = piece.view.data + (begin - piece.offset) * sizeof(float);
+      sum_into(slot.sum.data.data() + begin, &in, 1, end - begin);
+    }
+  });
+}
+
+void ParameterServerCore::finish_push(iteration_slot& slot, int32_t iteration, uint64_t generation, bool counted,
+                                      int32_t& workers_received) {
+  std::lock_guard<std::mutex> lock(slot.mutex);
+  if (slot.iteration.load(std::memory_order_relaxed) != iteration || slot.generation != generation) {
+    // a checkpoint load reset the ring while this push was reducing
+    workers_received = 0;
+    return;
+  }
+  int32_t received = slot.workers_received.load(std::memory_order_relaxed);
+  if (counted) {
+    slot.workers_received.store(++received, std::memory_order_release);
+  }
+  workers_received = received;
+  if (counted && !slot.closed && received >= needed(slot)) {
+    // every push has been reduced
+    close_iteration(slot);
+  }
+}
+
+std::vector<tensor> ParameterServerCore::take_sums(iteration_sums& sums) {
+  std::vector<tensor> gradients;
+  gradients.reserve(sums.slots.size());
+  for (auto& acc : sums.slots) {
+    gradients.push_back(std::move(acc->sum));
+  }
+  sums.slots.clear();
+  sums.index.clear();
+  return gradients;
+}
+
+void ParameterServerCore::add_sums(std::vector<tensor>& gradients, std::vector<tensor>&& more) {
+  for (auto& t : more) {
+    auto same = std::find_if(gradients.begin(), gradients.end(), [&](const tensor& g) { return g.name == t.name; });
+    if (same == gradients.end()) {
+      gradients.push_back(std::move(t));
+    } else if (same->data.size() == t.data.size()) {
+      const unsigned char* in = reinterpret_cast<const unsigned char*>(t.data.data());
+      sum_into(same->data.data(), &in, 1, t.data.size());
+    }
+  }
+}
+
+void ParameterServerCore::apply_iteration(iteration_slot& slot, int32_t iteration, int32_t pushes, uint64_t generation,
+                                          const std::vector<std::shared_ptr<iteration_sums>>& sums) {
+  // no push touches the accumulators any more, they were all counted before this was queued
+  std::vector<tensor> gradients;
+  for (const auto& s : sums) {
+    add_sums(gradients, take_sums(*s));
+  }
+  
+  {
+    std::lock_guard<std::mutex> update_lock(update_mutex_);
+    if (generation != generation_.load(std::memory_order_relaxed)) {
+      // a checkpoint was loaded since, these gradients belong to the parameters it replaced
+      return;
+    }
+    if (quorum_pushes_) {
+      std::lock_guard<std::mutex> carried_lock(carried_mutex_);
+      add_sums(gradients, std::move(carried_));
+      pushes += carried_pushes_;
+      carried_.clear();
+      carried_pushes_ = 0;
+    }
+    aggregate_gradients(std::move(gradients), iteration, iteration, 1.0f / static_cast<float>(pushes));
+    // under update_mutex_, so a load cannot slip in between the publish and these
+    raise_to(last_aggregated_iteration_, iteration);
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    if (slot.iteration.load(std::memory_order_relaxed) == iteration) {
+      slot.sums.reset();
+      slot.pushed.clear();
+      slot.aggregated.store(true, std::memory_order_release);
+    }
+  }
+}
+
+bool ParameterServerCore::receive_own_push(int32_t worker_id, int32_t iteration, int64_t sequence,
+                                           const std::vector<tensor_piece>& pieces, bool last, int32_t& workers_received) {
+  if (worker_id < 0 || worker_id >= capacity_) {
+    workers_received = 0;
+    return false;
+  }
+  raise_to(current_iteration_, iteration);
+  
+  std::shared_ptr<iteration_sums> sums;
+  uint64_t generation = 0;
+  bool done = reduce_own_push(worker_id, iteration, sequence, pieces, last, sums, generation);
+  if (quorum_pushes_) {
+    if (done) {
+      return count_quorum_push(worker_id, iteration, generation, sums, workers_received);
+    }
+    bool complete = check_sync_status(iteration, workers_received);
+    return complete && next_gradient_chunk(worker_id, iteration) < 0;
+  }
+  
+  if (done) {
+    raise_to(pushed_clock_[worker_id], iteration);
+    aggregation_pool_.submit([this, worker_id, iteration, generation, sums]() {
+      apply_push(worker_id, iteration, generation, sums);
+    });
+  }
+  // retries of a push that is already in get the same answer, a partial one is not ready yet
+  bool ready = may_proceed(iteration, workers_received);
+  return ready && (done || next_gradient_chunk(worker_id, iteration) < 0);
+}
+
+bool ParameterServerCore::reduce_own_push(int32_t worker_id, int32_t iteration, int64_t sequence,
+                                          const std::vector<tensor_piece>& pieces, bool last,
+                                          std::shared_ptr<iteration_sums>& sums, uint64_t& generation) {
+  worker_push& push = pushes_[worker_id];
+  std::vector<accumulator_slot*> slots;
+  {
+    std::lock_guard<std::mutex> lock(push.mutex);
+    int32_t held = push.iteration.load(std::memory_order_relaxed);
+    if (iteration < held || pushed_clock_[worker_id].load(std::memory_order_relaxed) >= iteration) {
+      // a late retry of a push that is already in
+      return false;
+    }
+    if (iteration > held) {
+      // a worker sends one push at a time, its next iteration replaces whatever is left of the last one
+      push.sums = std::make_shared<iteration_sums>();
+      push.generation = generation_.load(std::memory_order_relaxed);
+      push.next_chunk.store(0, std::memory_order_relaxed);
+      push.late.store(false, std::memory_order_relaxed);
+      push.iteration.store(iteration, std::memory_order_release);
+    }
+    if (sequence != push.next_chunk.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    push.next_chunk.store(last ? -1 : sequence + 1, std::memory_order_release);
+    sums = push.sums;
+    generation = push.generation;
+    slots = slots_for(*sums, pieces);
+  }
+  
+  reduce(slots, pieces);
+  return last && generation == generation_.load(std::memory_order_relaxed);
+}
+
+bool ParameterServerCore::count_quorum_push(int32_t worker_id, int32_t iteration, uint64_t generation,
+                                            const std::shared_ptr<iteration_sums>& sums, int32_t& workers_received) {
+  iteration_slot& slot = slot_for(iteration);
+  std::lock_guard<std::mutex> lock(slot.mutex);
+  bool complete = false;
+  bool claimed = open_push(slot, iteration, worker_id, workers_received, complete);
+  if (!claimed && !complete) {
+    // the ring is a lap behind: forget the push, the worker's retry sends it again
+    worker_push& push = pushes_[worker_id];
+    std::lock_guard<std::mutex> push_lock(push.mutex);
+    if (push.sums == sums) {
+      push.iteration.store(-1, std::memory_order_release);
+      push.sums.reset();
+    }
+    return false;
+  }
+  raise_to(pushed_clock_[worker_id], iteration);
+  
+  if (!claimed || slot.closed) {
+    // the quorum closed the iteration without this push, the worker skips ahead
+    pushes_[worker_id].late.store(true, std::memory_order_release);
+    late_pushes_.fetch_add(1, std::memory_order_relaxed);
+    if (consistency_.late_pushes == "next") {
+      std::lock_guard<std::mutex> carried_lock(carried_mutex_);
+      if (generation == generation_.load(std::memory_order_relaxed)) {
+        add_sums(carried_, take_sums(*sums));
+        carried_pushes_++;
+      }
+    }
     return true;
   }
+  if (!member_of(slot, worker_id)) {
+    // joined after the iteration opened, or left: the worker waits for it without counting
+    return false;
+  }
   
+  slot.pushed.push_back(sums);
+  int32_t received = slot.workers_received.load(std::memory_order_relaxed) + 1;
+  slot.workers_received.store(received, std::memory_order_release);
+  workers_received = received;
+  if (received >= needed(slot)) {
+    close_iteration(slot);
+  }
   return false;
 }
 
-void ParameterServerCore::aggregate_gradients(const std::vector<tensor>& gradients) {
-  if (parameters_.empty()) {
-    parameters_ = gradients;
+void ParameterServerCore::apply_push(int32_t worker_id, int32_t iteration, uint64_t generation,
+                                     const std::shared_ptr<iteration_sums>& sums) {
+  std::vector<tensor> gradients = take_sums(*sums);
+  
+  std::lock_guard<std::mutex> update_lock(update_mutex_);
+  if (generation != generation_.load(std::memory_order_relaxed)) {
     return;
   }
+  applied_clock_[worker_id] = std::max(applied_clock_[worker_id], iteration);
+  int32_t slowest = INT32_MAX;
+  int32_t fastest = iteration;
+  for (int w = 0; w < capacity_; ++w) {
+    if (joined_epoch_[w].load(std::memory_order_acquire) >= 0) {
+      slowest = std::min(slowest, applied_clock_[w]);
+      fastest = std::max(fastest, applied_clock_[w]);
+    }
+  }
+  gradient_staleness_.record(fastest - iteration);
+  // each push is 1/total_workers of a synchronous step, so learning rates carry over between modes
+  aggregate_gradients(std::move(gradients), iteration, slowest == INT32_MAX ? iteration : slowest,
+                      1.0f / static_cast<float>(std::max(total_workers_.load(std::memory_order_acquire), 1)));
+}
+
+bool ParameterServerCore::may_proceed(int32_t iteration, int32_t& workers_received) const {
+  int32_t slowest = INT32_MAX;
+  int32_t pushed = 0;
+  for (int w = 0; w < capacity_; ++w) {
+    if (joined_epoch_[w].load(std::memory_order_acquire) < 0) continue;
+    int32_t clock = pushed_clock_[w].load(std::memory_order_acquire);
+    slowest = std::min(slowest, clock);
+    if (clock >= iteration) {
+      ++pushed;
+    }
+  }
+  workers_received = pushed;
+  return consistency_.mode == "async" || slowest >= iteration - consistency_.staleness;
+}
+
+int32_t ParameterServerCore::staleness_of(const parameter_snapshot& snapshot, int32_t iteration) {
+  // a pull for iteration should see every worker's pushes up to the one before it
+  int32_t staleness = std::max(0, iteration - 1 - snapshot.synced_iteration);
+  pull_staleness_.record(staleness);
+  return staleness;
+}
+
+void ParameterServerCore::aggregate_gradients(std::vector<tensor>&& gradients, int32_t iteration, int32_t synced_iteration,
+                                              float scale) {
+  auto current = serve_parameters();
+  auto next = std::make_shared<parameter_snapshot>();
+  next->version = current->version + 1;
+  next->iteration = std::max(current->iteration, iteration);
+  next->synced_iteration = std::max(current->synced_iteration, synced_iteration);
   
-  for (size_t i = 0; i < gradients.size() && i < parameters_.size(); ++i) {
-    if (gradients[i].name == parameters_[i].name &&
-        gradients[i].shape == parameters_[i].shape) {
-      for (size_t j = 0; j < gradients[i].data.size() && j < parameters_[i].data.size(); ++j) {
-        parameters_[i].data[j] -= gradients[i].data[j]; // can add learning rate here
+  if (current->tensors.empty()) {
+    next->layout_version = next->version;
+    optimizer_.reset();
+    for (auto& g : gradients) {
+      for (auto& v : g.data) {
+        v *= scale;
       }
+      stamp(g, next->version);
+      next->tensors.push_back(std::make_shared<const tensor>(std::move(g)));
     }
+    publish(std::move(next));
+    return;
+  }
+  
+  // tensors without a matching gradient keep pointing at the current version's data,
+  // blocks the step left untouched keep their version so delta pulls skip them
+  next->layout_version = current->layout_version;
+  next->tensors = current->tensors;
+  // sums come in the order pushes first reached the server, bucketed or carried ones included,
+  // so each is matched to its parameter by name: targets[k] is the snapshot tensor gradients[sources[k]] steps
+  std::unordered_map<std::string, size_t> index;
+  index.reserve(current->tensors.size());
+  for (size_t i = 0; i < current->tensors.size(); ++i) {
+    index.emplace(current->tensors[i]->name, i);
+  }
+  std::vector<size_t> targets;
+  std::vector<size_t> sources;
+  for (size_t g = 0; g < gradients.size(); ++g) {
+    auto it = index.find(gradients[g].name);
+    if (it != index.end() && gradients[g].shape == current->tensors[it->second]->shape) {
+      targets.push_back(it->second);
+      sources.push_back(g);
+    }
+  }
+  
+  std::vector<std::shared_ptr<tensor>> updated(targets.size());
+  for (size_t k = 0; k < targets.size(); ++k) {
+    optimizer_.prepare(targets[k], current->tensors[targets[k]]->data.size());
   }
+  aggregation_pool_.parallel_for(targets.size(), [&](size_t k) {
+    const tensor& param = *current->tensors[targets[k]];
+    updated[k] = std::make_shared<tensor>();
+    updated[k]->name = param.name;
+    updated[k]->shape = param.shape;
+    updated[k]->dtype = param.dtype;
+    updated[k]->data.resize(param.data.size());
+    updated[k]->block_versions.resize(num_blocks(param.data.size()));
+  });
+  
+  // the optimizer step is spread over the pool one version block at a time, across every tensor at once
+  struct block_task {
+    size_t target;
+    size_t block;
+  };
+  std::vector<block_task> tasks;
+  for (size_t k = 0; k < targets.size(); ++k) {
+    for (size_t b = 0; b < updated[k]->block_versions.size(); ++b) {
+      tasks.push_back({k, b});
+    }
+  }
+  std::vector<char> block_changed(tasks.size(), 0);
+  aggregation_pool_.parallel_for(tasks.size(), [&](size_t t) {
+    size_t k = tasks[t].target;
+    size_t b = tasks[t].block;
+    const tensor& param = *current->tensors[targets[k]];
+    const tensor& grad = gradients[sources[k]];
+    size_t n = std::min(grad.data.size(), param.data.size());
+    size_t begin = std::min(b * kVersionBlockElements, n);
+    size_t end = std::min(begin + kVersionBlockElements, n);
+    bool nontemporal = param.data.size() * sizeof(float) >= kNontemporalBytes;
+    block_changed[t] = optimizer_.step(targets[k], updated[k]->data.data() + begin, param.data.data() + begin,
+                                       grad.data.data() + begin, scale, begin, end, nontemporal);
+    updated[k]->block_versions[b] = block_changed[t] ? next->version : block_version(param, b);
+  });
+  for (size_t k = 0; k < targets.size(); ++k) {
+    optimizer_.finish(targets[k]);
+  }
+  
+  size_t t = 0;
+  for (size_t k = 0; k < targets.size(); ++k) {
+    bool changed = false;
+    for (size_t b = 0; b < updated[k]->block_versions.size(); ++b, ++t) {
+      changed |= block_changed[t] != 0;
+    }
+    if (!changed) {
+      continue;
+    }
+    const tensor& param = *current->tensors[targets[k]];
+    size_t n = std::min(gradients[sources[k]].data.size(), param.data.size());
+    std::copy(param.data.begin() + n, param.data.end(), updated[k]->data.begin() + n);
+    updated[k]->version = next->version;
+    next->tensors[targets[k]] = std::move(updated[k]);
+  }
+  publish(std::move(next));
 }
 
-std::vector<tensor> ParameterServerCore::serve_parameters(int32_t iteration) {
-  std::lock_guard<std::mutex> lock(params_mutex_);
-  std::vector<tensor> result = parameters_;
-  return result;
+std::shared_ptr<const parameter_snapshot> ParameterServerCore::serve_parameters() const {
+  return std::atomic_load(&snapshot_);
 }
 
-bool ParameterServerCore::check_sync_status(int32_t iteration, int32_t& workers_received) {
-  std::lock_guard<std::mutex> lock(state_mutex_);
+bool ParameterServerCore::check_sync_status(int32_t iteration, int32_t& workers_received) const {
+  if (independent_pushes_) {
+    return may_proceed(iteration, workers_received);
+  }
+  const iteration_slot& slot = slot_for(iteration);
+  if (slot.iteration.load(std::memory_order_acquire) == iteration) {
+    int32_t received = slot.workers_received.load(std::memory_order_acquire);
+    bool aggregated = slot.aggregated.load(std::memory_order_acquire);
+    // still the same iteration after the reads, so they belong to it
+    if (slot.iteration.load(std::memory_order_acquire) == iteration) {
+      workers_received = received;
+      return aggregated;
+    }
+  }
   
-  auto it = iteration_states_.find(iteration);
-  if (it == iteration_states_.end()) {
-    workers_received = 0;
-    return false;
+  // the slot holds another iteration: anything up to the newest applied one is done, the rest has not started
+  bool done = iteration <= last_aggregated_iteration_.load(std::memory_order_acquire);
+  workers_received = done ? total_workers_.load(std::memory_order_acquire) : 0;
+  return done;
+}
+
+bool ParameterServerCore::update_membership(int64_t epoch, const std::vector<int32_t>& worker_ids) {
+  if (!consistency_.elastic) return false;
+  std::lock_guard<std::mutex> membership_lock(membership_mutex_);
+  if (epoch <= membership_epoch_.load(std::memory_order_relaxed)) return false;
+  
+  std::vector<char> member(capacity_, 0);
+  int32_t count = 0;
+  for (int32_t w : worker_ids) {
+    if (w >= 0 && w < capacity_ && !member[w]) {
+      member[w] = 1;
+      ++count;
+    }
+  }
+  // newcomers start where the others are, so ssp does not hold everyone back until they catch up
+  int32_t joined_at = current_iteration_.load(std::memory_order_relaxed) - 1;
+  std::vector<int32_t> newcomers;
+  for (int w = 0; w < capacity_; ++w) {
+    bool was = joined_epoch_[w].load(std::memory_order_relaxed) >= 0;
+    if (member[w] && !was) {
+      raise_to(pushed_clock_[w], joined_at);
+      joined_epoch_[w].store(epoch, std::memory_order_release);
+      newcomers.push_back(w);
+    } else if (!member[w] && was) {
+      joined_epoch_[w].store(-1, std::memory_order_release);
+    }
+  }
+  total_workers_.store(count, std::memory_order_release);
+  membership_epoch_.store(epoch, std::memory_order_release);
+  {
+    std::lock_guard<std::mutex> update_lock(update_mutex_);
+    for (int32_t w : newcomers) {
+      applied_clock_[w] = std::max(applied_clock_[w], joined_at);
+    }
   }
   
-  workers_received = static_cast<int32_t>(it->second.worker_gradients.size());
-  return it->second.aggregated;
+  for (int32_t i = 0; i < kIterationSlots; ++i) {
+    release_departed(ring_[i]);
+  }
+  return true;
+}
+
+void ParameterServerCore::release_departed(iteration_slot& slot) {
+  std::lock_guard<std::mutex> lock(slot.mutex);
+  if (slot.iteration.load(std::memory_order_relaxed) < 0 || slot.closed) return;
+  // still waited for: members that stayed, and those that left with their whole push already in
+  int32_t expected = 0;
+  for (int w = 0; w < capacity_; ++w) {
+    bool pushed = !quorum_pushes_ && slot.next_chunk[w].load(std::memory_order_relaxed) < 0;
+    expected += member_of(slot, w) || pushed ? 1 : 0;
+  }
+  slot.expected = std::min(slot.expected, expected);
+  int32_t received = slot.workers_received.load(std::memory_order_relaxed);
+  if (received > 0 && received >= needed(slot)) {
+    close_iteration(slot);
+  }
 }
 
 bool ParameterServerCore::save_checkpoint(int32_t epoch, const std::string& path) {
-  std::lock_guard<std::mutex> lock(params_mutex_);
-  
-  std::ofstream file(path, std::ios::binary);
+  return write_checkpoint(capture_checkpoint(epoch), path);
+}
+
+checkpoint_image ParameterServerCore::capture_checkpoint(int32_t epoch) {
+  checkpoint_image image;
+  image.epoch = epoch;
+  // snapshot, moments and iteration all from between the same two updates. Both are shared, not copied: the
+  // parameters are immutable once published and the next update steps the moments into buffers of its own
+  std::lock_guard<std::mutex> update_lock(update_mutex_);
+  image.snapshot = serve_parameters();
+  image.optimizer = std::make_shared<const Optimizer>(optimizer_);
+  // a load resumes after the newest iteration every worker's pushes are folded into
+  image.iteration = std::max(0, image.snapshot->synced_iteration + 1);
+  return image;
+}
+
+bool ParameterServerCore::write_checkpoint(const checkpoint_image& image, const std::string& path) {
+  // the image cannot change underneath the write, pulls and updates carry on meanwhile
+  std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+  std::string temporary = path + ".tmp";
+  std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
   if (!file.is_open()) {
     return false;
   }
   
-  file.write(reinterpret_cast<const char*>(&epoch), sizeof(int32_t));
-  file.write(reinterpret_cast<const char*>(&current_iteration_), sizeof(int32_t));
+  file.write(reinterpret_cast<const char*>(&image.epoch), sizeof(int32_t));
+  file.write(reinterpret_cast<const char*>(&image.iteration), sizeof(int32_t));
   
-  size_t num_tensors = parameters_.size();
+  size_t num_tensors = image.snapshot->tensors.size();
   file.write(reinterpret_cast<const char*>(&num_tensors), sizeof(size_t));
   
-  for (const auto& t : parameters_) {
+  for (const auto& ptr : image.snapshot->tensors) {
+    const tensor& t = *ptr;
     size_t name_len = t.name.size();
     file.write(reinterpret_cast<const char*>(&name_len), sizeof(size_t));
     file.write(t.name.c_str(), name_len);
@@ -138,13 +928,20 @@ bool ParameterServerCore::save_checkpoint(int32_t epoch, const std::string& path
     file.write(reinterpret_cast<const char*>(&data_size), sizeof(size_t));
     file.write(reinterpret_cast<const char*>(t.data.data()), data_size * sizeof(float));
   }
+  image.optimizer->save(file);
   
   file.close();
+  if (file.fail() || !sync_file(temporary) || std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    return false;
+  }
+  // the rename itself only survives a crash once the directory is on disk too
+  sync_directory_of(path);
   return true;
 }
 
 bool ParameterServerCore::load_checkpoint(const std::string& path, int32_t& epoch) {
-  std::lock_guard<std::mutex> lock(params_mutex_);
+  std::lock_guard<std::mutex> lock(update_mutex_);
   
   std::ifstream file(path, std::ios::binary);
   if (!file.is_open()) {
@@ -152,13 +949,46 @@ bool ParameterServerCore::load_checkpoint(const std::string& path, int32_t& epoc
   }
   
   file.read(reinterpret_cast<char*>(&epoch), sizeof(int32_t));
-  file.read(reinterpret_cast<char*>(&current_iteration_), sizeof(int32_t));
+  int32_t iteration = 0;
+  file.read(reinterpret_cast<char*>(&iteration), sizeof(int32_t));
+  
+  // workers restart their iteration count after a load, forget what was applied before it.
+  // pushes still reducing see the new generation in finish_push and drop their sums
+  generation_.fetch_add(1, std::memory_order_relaxed);
+  for (int32_t i = 0; i < kIterationSlots; ++i) {
+    std::lock_guard<std::mutex> slot_lock(ring_[i].mutex);
+    ring_[i].iteration.store(-1, std::memory_order_release);
+    ring_[i].sums.reset();
+    ring_[i].workers_received.store(0, std::memory_order_relaxed);
+    ring_[i].aggregated.store(false, std::memory_order_relaxed);
+    ring_[i].closed = false;
+    ring_[i].pushed.clear();
+  }
+  last_aggregated_iteration_.store(-1, std::memory_order_release);
+  for (int w = 0; w < capacity_; ++w) {
+    std::lock_guard<std::mutex> push_lock(pushes_[w].mutex);
+    pushes_[w].iteration.store(-1, std::memory_order_release);
+    pushes_[w].sums.reset();
+    pushes_[w].next_chunk.store(0, std::memory_order_relaxed);
+    pushes_[w].late.store(false, std::memory_order_relaxed);
+    pushed_clock_[w].store(-1, std::memory_order_release);
+    applied_clock_[w] = -1;
+  }
+  {
+    std::lock_guard<std::mutex> carried_lock(carried_mutex_);
+    carried_.clear();
+    carried_pushes_ = 0;
+  }
+  current_iteration_.store(iteration, std::memory_order_relaxed);
   
   size_t num_tensors = 0;
   file.read(reinterpret_cast<char*>(&num_tensors), sizeof(size_t));
   
-  parameters_.clear();
-  parameters_.reserve(num_tensors);
+  auto next = std::make_shared<parameter_snapshot>();
+  next->version = serve_parameters()->version + 1;
+  next->layout_version = next->version;
+  next->synced_iteration = iteration - 1;
+  next->tensors.reserve(num_tensors);
   
   for (size_t i = 0; i < num_tensors; ++i) {
     tensor t;
@@ -179,11 +1009,16 @@ bool ParameterServerCore::load_checkpoint(const std::string& path, int32_t& epoc
     file.read(reinterpret_cast<char*>(&data_size), sizeof(size_t));
     t.data.resize(data_size);
     file.read(reinterpret_cast<char*>(t.data.data()), data_size * sizeof(float));
+    stamp(t, next->version);
     
-    parameters_.push_back(t);
+    next->tensors.push_back(std::make_shared<const tensor>(std::move(t)));
+  }
+  if (!optimizer_.load(file, num_tensors) && optimizer_.state_bytes() > 0) {
+    std::cout << "no " << optimizer_.options().name << " state in " << path << ", moments start from zero" << std::endl;
   }
   
   file.close();
+  publish(std::move(next));
   return true;
 }
 
@@ -1,192 +1,716 @@
 #include "parameter_server.h"
 #include "parameter_server_service.h"
+#include "tensor_codec.h"
+#include "broadcast_cache.h"
+#include "checkpoint_writer.h"
+#include "kernels.h"
+#include "async_call.h"
+#include "thread_pool.h"
+#include "shared_memory.h"
 #include <grpcpp/grpcpp.h>
 #include "parameter_server.grpc.pb.h"
 #include <iostream>
 #include <sstream>
 #include <thread>
 #include <chrono>
+#include <deque>
+#include <algorithm>
 
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
+using grpc::ServerCompletionQueue;
 using grpc::Status;
+using parameter_server::ParameterServer;
 
-class parameter_server_service_impl final : public parameter_server::ParameterServer::Service {
+namespace {
+
+// progress of one PushGradientChunks stream
+struct push_progress {
+  int32_t worker_id = -1;
+  int32_t iteration = 0;
+  int32_t workers_received = 0;
+  bool complete = false;
+};
+
+// state of one PullParameterChunks stream
+struct pull_progress {
+  int32_t iteration = 0;
+  bool ready = false;
+  int64_t version = 0;
+  int64_t base_version = 0;
+  bool up_to_date = false;
+  int32_t staleness = 0;
+  std::shared_ptr<const std::vector<BroadcastCache::body>> chunks;
+  size_t next = 0;
+};
+
+}  // namespace
+
+// rpc handlers, independent of how calls reach them; the async server below drives them
+class parameter_server_service_impl {
 
   public:
-    parameter_server_service_impl(int total_workers, int checkpoint_interval = 10)
-      : ps_(total_workers), checkpoint_interval_(checkpoint_interval), running_(true) {
+    parameter_server_service_impl(int total_workers, int checkpoint_interval = 10, int shard_id = -1, size_t aggregation_threads = 0,
+                                  const OptimizerOptions& optimizer = OptimizerOptions(),
+                                  const ConsistencyOptions& consistency = ConsistencyOptions())
+      : ps_(total_workers, aggregation_threads, optimizer, consistency), broadcast_(total_workers),
+        checkpoint_interval_(checkpoint_interval), shard_id_(shard_id), checkpoints_(ps_), running_(true) {
+      if (consistency.mode != "bsp" || consistency.quorum > 0 || consistency.elastic) {
+        periodic_thread_ = std::thread(&parameter_server_service_impl::periodic_work, this);
+      }
       if (checkpoint_interval_ > 0) {
-        checkpoint_thread_ = std::thread(&parameter_server_service_impl::periodic_checkpoint, this);
+        checkpoint_thread_ = std::thread(&parameter_server_service_impl::checkpoint_work, this);
       }
     }
     
     ~parameter_server_service_impl() {
       running_ = false;
+      if (periodic_thread_.joinable()) {
+        periodic_thread_.join();
+      }
       if (checkpoint_thread_.joinable()) {
         checkpoint_thread_.join();
       }
     }
 
-    Status ReceiveGradients(ServerContext* context, const parameter_server::GradientUpdate* request, parameter_server::PushResponse* response) override {
-      std::vector<tensor> gradients;
-      
-      for (const auto& proto_tensor : request->gradients()) {
-        tensor t;
-        t.name = proto_tensor.name();
-        t.shape.assign(proto_tensor.shape().begin(), proto_tensor.shape().end());
-        t.data.assign(proto_tensor.data().begin(), proto_tensor.data().end());
-        t.dtype = proto_tensor.dtype();
-        gradients.push_back(t);
+    Status ReceiveGradients(const grpc::ByteBuffer& request, grpc::ByteBuffer& response) {
+      parameter_server::GradientUpdate header;
+      TensorPayloadReader reader;
+      if (!reader.parse(request, parameter_server::GradientUpdate::kGradientsFieldNumber, &header)) {
+        return Status(grpc::StatusCode::INVALID_ARGUMENT, "malformed gradient update");
       }
-      
-      bool complete = ps_.receive_gradients(request->worker_id(), 
-                                            request->iteration(), 
-                                            gradients);
-      
-      response->set_success(true);
-      response->set_message("gradients received");
-      response->set_iteration(request->iteration());
-      response->set_aggregation_complete(complete);
-      
+
       int32_t workers_received = 0;
-      ps_.check_sync_status(request->iteration(), workers_received);
-      response->set_workers_received(workers_received);
-      response->set_total_workers(ps_.get_total_workers());
-      
+      bool complete = ps_.receive_gradients(header.worker_id(),
+                                            header.iteration(),
+                                            reader.tensors(),
+                                            workers_received);
+
+      parameter_server::PushResponse reply;
+      reply.set_success(true);
+      reply.set_message("gradients received");
+      reply.set_iteration(header.iteration());
+      reply.set_aggregation_complete(complete);
+      reply.set_workers_received(workers_received);
+      reply.set_total_workers(ps_.get_total_workers());
+      mark_late(header.worker_id(), header.iteration(), reply);
+      response = serialize_message(reply);
       return Status::OK;
     }
 
-    Status ServeParameters(ServerContext* context, const parameter_server::PullRequest* request, parameter_server::ParameterUpdate* response) override {
-      auto params = ps_.serve_parameters(request->iteration());
-      
+    Status ServeParameters(const grpc::ByteBuffer& request, grpc::ByteBuffer& response) {
+      parameter_server::PullRequest pull;
+      if (!parse_message(request, &pull) || !is_float_dtype(pull.dtype())) {
+        return Status(grpc::StatusCode::INVALID_ARGUMENT, "malformed pull request");
+      }
+
+      auto snapshot = ps_.serve_parameters();
+      int64_t base_version = delta_base(pull, *snapshot);
+
+      int32_t workers_received = 0;
+      bool ready = ps_.check_sync_status(pull.iteration(), workers_received);
+
+      parameter_server::ParameterUpdate header;
+      header.set_iteration(pull.iteration());
+      header.set_ready(ready);
+      header.set_version(snapshot->version);
+      header.set_applied_iteration(snapshot->iteration);
+      header.set_base_version(base_version);
+      header.set_incarnation(ps_.incarnation());
+      header.set_staleness(ps_.staleness_of(*snapshot, pull.iteration()));
+      if (base_version == snapshot->version) {
+        header.set_up_to_date(true);
+        response = serialize_message(header);
+        return Status::OK;
+      }
+
+      // the tensors are encoded once per snapshot version and base, every response shares those slices
+      auto body = broadcast_.parameters(snapshot, base_version, pull.dtype());
+      header.set_up_to_date(base_version > 0 && body->empty());
+      response = assemble_message(header, *body);
+      return Status::OK;
+    }
+
+    Status CheckSyncStatus(const parameter_server::SyncStatusRequest& request, parameter_server::SyncStatusResponse& response) {
       int32_t workers_received = 0;
-      bool ready = ps_.check_sync_status(request->iteration(), workers_received);
+      bool ready = ps_.check_sync_status(request.iteration(), workers_received);
       
-      response->set_iteration(request->iteration());
-      response->set_ready(ready);
+      response.set_iteration(request.iteration());
+      response.set_ready(ready);
+      response.set_workers_received(workers_received);
+      response.set_total_workers(ps_.get_total_workers());
+      response.set_next_chunk(ps_.next_gradient_chunk(request.worker_id(), request.iteration()));
       
-      for (const auto& t : params) {
-        parameter_server::Tensor* proto_tensor = response->add_parameters();
-        proto_tensor->set_name(t.name);
-        for (int32_t dim : t.shape) {
-          proto_tensor->add_shape(dim);
-        }
-        for (float val : t.data) {
-          proto_tensor->add_data(val);
+      return Status::OK;
+    }
+
+    // PushGradientChunks: each chunk is reduced as soon as it has been read
+    Status reduce_chunk(const parameter_server::GradientChunk& chunk, push_progress& progress) {
+      progress.worker_id = chunk.worker_id();
+      progress.iteration = chunk.iteration();
+      
+      std::deque<std::vector<unsigned char>> owned;
+      std::vector<tensor_piece> pieces;
+      pieces.reserve(chunk.pieces_size());
+      for (const auto& p : chunk.pieces()) {
+        tensor_piece piece;
+        if (!view_tensor(p.tensor(), piece.view, owned) || p.offset() < 0 || p.total_elements() < 0) {
+          return Status(grpc::StatusCode::INVALID_ARGUMENT, "malformed gradient chunk");
         }
-        proto_tensor->set_dtype(t.dtype);
+        piece.offset = static_cast<size_t>(p.offset());
+        piece.total_elements = static_cast<size_t>(p.total_elements());
+        pieces.push_back(std::move(piece));
       }
-      
+      progress.complete = ps_.receive_gradient_chunk(progress.worker_id, progress.iteration, chunk.sequence(),
+                                                     pieces, chunk.last(), progress.workers_received);
       return Status::OK;
     }
 
-    Status CheckSyncStatus(ServerContext* context, const parameter_server::SyncStatusRequest* request, parameter_server::SyncStatusResponse* response) override {
-      int32_t workers_received = 0;
-      bool ready = ps_.check_sync_status(request->iteration(), workers_received);
+    void finish_chunk_push(const push_progress& progress, parameter_server::PushResponse& response) {
+      int64_t next_chunk = ps_.next_gradient_chunk(progress.worker_id, progress.iteration);
+      response.set_success(next_chunk < 0);
+      response.set_message(next_chunk < 0 ? "gradients received" : "gradient chunks missing");
+      response.set_iteration(progress.iteration);
+      response.set_aggregation_complete(progress.complete);
+      response.set_workers_received(progress.workers_received);
+      response.set_total_workers(ps_.get_total_workers());
+      response.set_next_chunk(next_chunk);
+      mark_late(progress.worker_id, progress.iteration, response);
+    }
+
+    // PullParameterChunks: takes the parameters once, the chunks come encoded from the broadcast cache
+    Status start_pull(const grpc::ByteBuffer& request, pull_progress& progress) {
+      parameter_server::PullRequest pull;
+      if (!parse_message(request, &pull) || !is_float_dtype(pull.dtype())) {
+        return Status(grpc::StatusCode::INVALID_ARGUMENT, "malformed pull request");
+      }
+      progress.iteration = pull.iteration();
+      auto snapshot = ps_.serve_parameters();
+      progress.version = snapshot->version;
+      progress.base_version = delta_base(pull, *snapshot);
       
-      response->set_iteration(request->iteration());
-      response->set_ready(ready);
-      response->set_workers_received(workers_received);
-      response->set_total_workers(ps_.get_total_workers());
+      int32_t workers_received = 0;
+      progress.ready = ps_.check_sync_status(pull.iteration(), workers_received);
+      progress.staleness = ps_.staleness_of(*snapshot, pull.iteration());
       
+      size_t chunk_bytes = pull.chunk_bytes() > 0 ? static_cast<size_t>(pull.chunk_bytes()) : kDefaultChunkBytes;
+      progress.chunks = broadcast_.chunks(snapshot, progress.base_version, chunk_bytes, pull.dtype());
+      progress.up_to_date = progress.base_version > 0 && progress.chunks->size() == 1 && progress.chunks->front().empty();
+      progress.next = static_cast<size_t>(std::max<int64_t>(0, pull.start_chunk()));
       return Status::OK;
     }
 
-    Status SaveCheckpoint(ServerContext* context, const parameter_server::SaveCheckpointRequest* request, parameter_server::SaveCheckpointResponse* response) override {
-      std::string path = request->path();
+    // false once every chunk has been handed out
+    bool next_pull_chunk(pull_progress& progress, grpc::ByteBuffer& chunk) {
+      if (progress.next >= progress.chunks->size()) {
+        return false;
+      }
+      size_t seq = progress.next++;
+      parameter_server::ParameterChunk header;
+      header.set_iteration(progress.iteration);
+      header.set_ready(progress.ready);
+      header.set_sequence(static_cast<int64_t>(seq));
+      header.set_version(progress.version);
+      header.set_base_version(progress.base_version);
+      header.set_up_to_date(progress.up_to_date);
+      header.set_incarnation(ps_.incarnation());
+      header.set_staleness(progress.staleness);
+      chunk = assemble_message(header, (*progress.chunks)[seq]);
+      return true;
+    }
+
+    Status SaveCheckpoint(const parameter_server::SaveCheckpointRequest& request, parameter_server::SaveCheckpointResponse& response) {
+      std::string path = request.path();
       if (path.empty()) {
-        std::ostringstream oss;
-        oss << "checkpoint_epoch_" << request->epoch() << ".ckpt";
-        path = oss.str();
+        path = default_checkpoint_path(request.epoch());
       }
       
-      bool success = ps_.save_checkpoint(request->epoch(), path);
-      response->set_success(success);
+      bool success = ps_.save_checkpoint(request.epoch(), path);
+      response.set_success(success);
       if (success) {
-        response->set_message("checkpoint saved");
-        response->set_checkpoint_path(path);
+        response.set_message("checkpoint saved");
+        response.set_checkpoint_path(path);
       } else {
-        response->set_message("failed to save checkpoint");
+        response.set_message("failed to save checkpoint");
       }
       
       return Status::OK;
     }
 
-    Status LoadCheckpoint(ServerContext* context, const parameter_server::LoadCheckpointRequest* request, parameter_server::LoadCheckpointResponse* response) override {
+    Status LoadCheckpoint(const parameter_server::LoadCheckpointRequest& request, parameter_server::LoadCheckpointResponse& response) {
       int32_t epoch = 0;
-      bool success = ps_.load_checkpoint(request->path(), epoch);
+      bool success = ps_.load_checkpoint(request.path(), epoch);
       
-      response->set_success(success);
+      response.set_success(success);
       if (success) {
-        response->set_message("checkpoint loaded");
-        response->set_epoch(epoch);
-        
-        auto params = ps_.serve_parameters(0);
-        for (const auto& t : params) {
-          parameter_server::Tensor* proto_tensor = response->add_parameters();
-          proto_tensor->set_name(t.name);
-          for (int32_t dim : t.shape) {
-            proto_tensor->add_shape(dim);
-          }
-          for (float val : t.data) {
-            proto_tensor->add_data(val);
-          }
-          proto_tensor->set_dtype(t.dtype);
-        }
+        response.set_message("checkpoint loaded");
+        response.set_epoch(epoch);
       } else {
-        response->set_message("failed to load checkpoint");
+        response.set_message("failed to load checkpoint");
       }
       
       return Status::OK;
     }
 
+    Status UpdateMembership(const parameter_server::MembershipUpdate& request, parameter_server::MembershipResponse& response) {
+      std::vector<int32_t> worker_ids(request.worker_ids().begin(), request.worker_ids().end());
+      bool success = ps_.update_membership(request.epoch(), worker_ids);
+      if (success) {
+        broadcast_.set_total_workers(ps_.get_total_workers());
+        response.set_message("membership updated");
+        std::cout << "membership epoch " << request.epoch() << ": " << ps_.get_total_workers() << " workers" << std::endl;
+      } else {
+        response.set_message(ps_.consistency().elastic ? "stale membership epoch" : "server is not elastic");
+      }
+      response.set_success(success);
+      response.set_epoch(ps_.membership_epoch());
+      response.set_total_workers(ps_.get_total_workers());
+      return Status::OK;
+    }
+
     ParameterServerCore& get_parameter_server() {
       return ps_;
     }
 
   private:
-    void periodic_checkpoint() {
-      int32_t last_checkpointed_epoch = -1;
+    // a push that missed its iteration's quorum moves the worker on to where the others are
+    void mark_late(int32_t worker_id, int32_t iteration, parameter_server::PushResponse& response) const {
+      if (ps_.late_push(worker_id, iteration)) {
+        response.set_message("iteration closed without these gradients");
+        response.set_skip_to(std::max(ps_.get_current_iteration(), iteration + 1));
+      }
+    }
+
+    // version a pull can be answered with a delta against, 0 when the worker needs every tensor
+    int64_t delta_base(const parameter_server::PullRequest& pull, const parameter_snapshot& snapshot) const {
+      if (pull.known_incarnation() != ps_.incarnation() || pull.known_version() < snapshot.layout_version ||
+          pull.known_version() > snapshot.version) {
+        return 0;
+      }
+      return pull.known_version();
+    }
+
+    // matches ShardMap::shard_checkpoint_path on the worker side
+    std::string default_checkpoint_path(int32_t epoch) const {
+      std::ostringstream oss;
+      oss << "checkpoint_epoch_" << epoch << ".ckpt";
+      if (shard_id_ >= 0) {
+        oss << ".shard" << shard_id_;
+      }
+      return oss.str();
+    }
+
+    // the staleness distribution when workers run ahead of each other, and late pushes
+    void periodic_work() {
+      uint64_t reported_pulls = 0;
+      uint64_t reported_gradients = 0;
+      uint64_t reported_late = 0;
       while (running_) {
         std::this_thread::sleep_for(std::chrono::seconds(5));
         
-        int32_t current_iter = ps_.get_current_iteration();
-        int32_t current_epoch = current_iter / checkpoint_interval_;
-        
-        if (current_epoch > last_checkpointed_epoch && current_iter > 0) {
-          std::ostringstream oss;
-          oss << "checkpoint_epoch_" << current_epoch << ".ckpt";
-          std::string path = oss.str();
-          
-          if (ps_.save_checkpoint(current_epoch, path)) {
-            last_checkpointed_epoch = current_epoch;
-            std::cout << "saved checkpoint: " << path << " (epoch " << current_epoch << ")" << std::endl;
-          }
+        if (ps_.consistency().mode != "bsp" &&
+            (ps_.pull_staleness().count() != reported_pulls || ps_.gradient_staleness().count() != reported_gradients)) {
+          reported_pulls = ps_.pull_staleness().count();
+          reported_gradients = ps_.gradient_staleness().count();
+          std::cout << "staleness: pulls " << ps_.pull_staleness().summary() << ", gradients "
+                    << ps_.gradient_staleness().summary() << std::endl;
+        }
+        if (ps_.late_pushes() != reported_late) {
+          reported_late = ps_.late_pushes();
+          std::cout << "late pushes: " << reported_late << " ("
+                    << (ps_.consistency().late_pushes == "next" ? "folded into the next update" : "dropped") << ")"
+                    << std::endl;
+        }
+      }
+    }
+
+    // woken by every published update: the first one completing an interval of iterations is captured right
+    // away and handed to the writer, so the checkpoint holds exactly that point of training
+    void checkpoint_work() {
+      int32_t last_checkpointed_epoch = -1;
+      int64_t seen_version = 0;
+      while (running_) {
+        auto snapshot = ps_.wait_for_update(seen_version, std::chrono::seconds(1));
+        seen_version = snapshot->version;
+        int32_t completed = snapshot->synced_iteration + 1;
+        int32_t current_epoch = completed / checkpoint_interval_;
+        if (completed > 0 && current_epoch > last_checkpointed_epoch) {
+          checkpoints_.submit(ps_.capture_checkpoint(current_epoch), default_checkpoint_path(current_epoch));
+          last_checkpointed_epoch = current_epoch;
         }
       }
     }
 
     ParameterServerCore ps_;
+    BroadcastCache broadcast_;
     int checkpoint_interval_;
+    int shard_id_;
+    CheckpointWriter checkpoints_;
+    std::thread periodic_thread_;
     std::thread checkpoint_thread_;
     std::atomic<bool> running_;
 };
 
-void run_server(const std::string& server_address, int total_workers, int checkpoint_interval) {
-  parameter_server_service_impl service(total_workers, checkpoint_interval);
+namespace {
+
+// tensor-carrying rpcs take raw byte buffers so payloads skip the protobuf copy in both directions
+using async_service = ParameterServer::WithRawMethod_ReceiveGradients<
+  ParameterServer::WithRawMethod_ServeParameters<
+  ParameterServer::WithAsyncMethod_CheckSyncStatus<
+  ParameterServer::WithAsyncMethod_SaveCheckpoint<
+  ParameterServer::WithAsyncMethod_LoadCheckpoint<
+  ParameterServer::WithAsyncMethod_UpdateMembership<
+  ParameterServer::WithAsyncMethod_PushGradientChunks<
+  ParameterServer::WithRawMethod_PullParameterChunks<
+  ParameterServer::WithAsyncMethod_AttachSharedMemory<
+  ParameterServer::Service>>>>>>>>>;
+
+// PushGradientChunks: one read outstanding at a time, each chunk reduced on the executor before the next read
+class push_chunks_call : public call_state {
+  public:
+    push_chunks_call(call_pool<push_chunks_call>* pool, async_service* service, ServerCompletionQueue* cq,
+                     parameter_server_service_impl* impl, ThreadPool* executor)
+      : pool_(pool), service_(service), cq_(cq), impl_(impl), executor_(executor), stage_(REQUESTED) {
+      reset();
+    }
+
+    void arm() {
+      stage_ = REQUESTED;
+      service_->RequestPushGradientChunks(ctx_.get(), reader_.get(), cq_, cq_, this);
+    }
+
+    void reset() {
+      ctx_ = std::make_unique<ServerContext>();
+      reader_ = std::make_unique<grpc::ServerAsyncReader<parameter_server::PushResponse, parameter_server::GradientChunk>>(ctx_.get());
+      chunk_.Clear();
+      response_.Clear();
+      progress_ = push_progress();
+    }
+
+    void proceed(bool ok) override {
+      switch (stage_) {
+        case REQUESTED:
+          if (!ok) {
+            pool_->release(this);
+            return;
+          }
+          pool_->acquire()->arm();
+          stage_ = READING;
+          reader_->Read(&chunk_, this);
+          return;
+        case READING:
+          if (ok) {
+            executor_->submit([this]() {
+              Status status = impl_->reduce_chunk(chunk_, progress_);
+              if (!status.ok()) {
+                stage_ = FINISHING;
+                reader_->FinishWithError(status, this);
+                return;
+              }
+              reader_->Read(&chunk_, this);
+            });
+            return;
+          }
+          // the worker closed its side of the stream
+          executor_->submit([this]() {
+            impl_->finish_chunk_push(progress_, response_);
+            stage_ = FINISHING;
+            reader_->Finish(response_, Status::OK, this);
+          });
+          return;
+        case FINISHING:
+          pool_->release(this);
+          return;
+      }
+    }
+
+  private:
+    enum stage { REQUESTED, READING, FINISHING };
+
+    call_pool<push_chunks_call>* pool_;
+    async_service* service_;
+    ServerCompletionQueue* cq_;
+    parameter_server_service_impl* impl_;
+    ThreadPool* executor_;
+    stage stage_;
+    std::unique_ptr<ServerContext> ctx_;
+    std::unique_ptr<grpc::ServerAsyncReader<parameter_server::PushResponse, parameter_server::GradientChunk>> reader_;
+    parameter_server::GradientChunk chunk_;
+    parameter_server::PushResponse response_;
+    push_progress progress_;
+};
+
+// PullParameterChunks: one write outstanding at a time, the next chunk is assembled on the executor
+class pull_chunks_call : public call_state {
+  public:
+    pull_chunks_call(call_pool<pull_chunks_call>* pool, async_service* service, ServerCompletionQueue* cq,
+                     parameter_server_service_impl* impl, ThreadPool* executor)
+      : pool_(pool), service_(service), cq_(cq), impl_(impl), executor_(executor), stage_(REQUESTED) {
+      reset();
+    }
+
+    void arm() {
+      stage_ = REQUESTED;
+      service_->RequestPullParameterChunks(ctx_.get(), &request_, writer_.get(), cq_, cq_, this);
+    }
+
+    void reset() {
+      ctx_ = std::make_unique<ServerContext>();
+      writer_ = std::make_unique<grpc::ServerAsyncWriter<grpc::ByteBuffer>>(ctx_.get());
+      request_.Clear();
+      chunk_.Clear();
+      progress_ = pull_progress();
+    }
+
+    void proceed(bool ok) override {
+      switch (stage_) {
+        case REQUESTED:
+          if (!ok) {
+            pool_->release(this);
+            return;
+          }
+          pool_->acquire()->arm();
+          executor_->submit([this]() {
+            Status status = impl_->start_pull(request_, progress_);
+            if (!status.ok()) {
+              stage_ = FINISHING;
+              writer_->Finish(status, this);
+              return;
+            }
+            write_next();
+          });
+          return;
+        case WRITING:
+          if (!ok) {
+            stage_ = FINISHING;
+            writer_->Finish(Status(grpc::StatusCode::CANCELLED, "worker closed the parameter stream"), this);
+            return;
+          }
+          executor_->submit([this]() { write_next(); });
+          return;
+        case FINISHING:
+          pool_->release(this);
+          return;
+      }
+    }
+
+  private:
+    enum stage { REQUESTED, WRITING, FINISHING };
+
+    void write_next() {
+      if (!impl_->next_pull_chunk(progress_, chunk_)) {
+        stage_ = FINISHING;
+        writer_->Finish(Status::OK, this);
+        return;
+      }
+      stage_ = WRITING;
+      writer_->Write(chunk_, this);
+    }
+
+    call_pool<pull_chunks_call>* pool_;
+    async_service* service_;
+    ServerCompletionQueue* cq_;
+    parameter_server_service_impl* impl_;
+    ThreadPool* executor_;
+    stage stage_;
+    std::unique_ptr<ServerContext> ctx_;
+    std::unique_ptr<grpc::ServerAsyncWriter<grpc::ByteBuffer>> writer_;
+    grpc::ByteBuffer request_;
+    grpc::ByteBuffer chunk_;
+    pull_progress progress_;
+};
+
+// every call pool of one completion queue
+struct queue_calls {
+  std::unique_ptr<call_pool<unary_call<grpc::ByteBuffer, grpc::ByteBuffer>>> receive_gradients;
+  std::unique_ptr<call_pool<unary_call<grpc::ByteBuffer, grpc::ByteBuffer>>> serve_parameters;
+  std::unique_ptr<call_pool<unary_call<parameter_server::SyncStatusRequest, parameter_server::SyncStatusResponse>>> check_sync_status;
+  std::unique_ptr<call_pool<unary_call<parameter_server::SaveCheckpointRequest, parameter_server::SaveCheckpointResponse>>> save_checkpoint;
+  std::unique_ptr<call_pool<unary_call<parameter_server::LoadCheckpointRequest, parameter_server::LoadCheckpointResponse>>> load_checkpoint;
+  std::unique_ptr<call_pool<unary_call<parameter_server::MembershipUpdate, parameter_server::MembershipResponse>>> update_membership;
+  std::unique_ptr<call_pool<unary_call<parameter_server::SharedMemoryRequest, parameter_server::SharedMemoryResponse>>> attach_shared_memory;
+  std::unique_ptr<call_pool<push_chunks_call>> push_chunks;
+  std::unique_ptr<call_pool<pull_chunks_call>> pull_chunks;
+};
+
+// pool of unary calls for one method; request binds the service's RequestX to the queue
+template <class Request, class Response, class RequestFn, class Handler>
+std::unique_ptr<call_pool<unary_call<Request, Response>>> make_unary_pool(RequestFn request, Handler handler, ThreadPool* executor) {
+  using call = unary_call<Request, Response>;
+  return std::make_unique<call_pool<call>>([request, handler, executor](call_pool<call>* pool) {
+    return std::make_unique<call>(pool, request, handler, executor);
+  });
+}
+
+template <class Call>
+void prepost(call_pool<Call>& pool, int count) {
+  for (int i = 0; i < count; ++i) {
+    pool.acquire()->arm();
+  }
+}
+
+}  // namespace
+
+void run_server(const std::string& server_address, int total_workers, int checkpoint_interval, int shard_id,
+                const ServerOptions& options) {
+  parameter_server_service_impl impl(total_workers, checkpoint_interval, shard_id,
+                                     static_cast<size_t>(std::max(0, options.aggregation_threads)), options.optimizer,
+                                     options.consistency);
+  async_service service;
+  ThreadPool executor(static_cast<size_t>(std::max(0, options.executor_threads)));
+  // co-located workers' pushes, pulls and polls, answered by the same handlers as the raw rpcs
+  SharedMemoryServer shared_memory([&impl](shm_op op, const grpc::ByteBuffer& req, grpc::ByteBuffer& resp) {
+    switch (op) {
+      case shm_op::receive_gradients:
+        return impl.ReceiveGradients(req, resp);
+      case shm_op::serve_parameters:
+        return impl.ServeParameters(req, resp);
+      case shm_op::check_sync_status: {
+        parameter_server::SyncStatusRequest request;
+        parameter_server::SyncStatusResponse response;
+        if (!parse_message(req, &request)) {
+          return Status(grpc::StatusCode::INVALID_ARGUMENT, "malformed status request");
+        }
+        Status s = impl.CheckSyncStatus(request, response);
+        resp = serialize_message(response);
+        return s;
+      }
+      default:
+        return Status(grpc::StatusCode::UNIMPLEMENTED, "not carried over shared memory");
+    }
+  });
   
   ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  // workers keep idle channels alive with pings, accept them instead of answering with too_many_pings
+  builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+  builder.AddChannelArgument(GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS, 5000);
   builder.RegisterService(&service);
   
+  int num_queues = std::max(1, options.completion_queues);
+  std::vector<std::unique_ptr<ServerCompletionQueue>> queues;
+  for (int q = 0; q < num_queues; ++q) {
+    queues.push_back(builder.AddCompletionQueue());
+  }
+  
   std::unique_ptr<Server> server(builder.BuildAndStart());
   std::cout << "parameter server listening on " << server_address << std::endl;
+  if (shard_id >= 0) {
+    std::cout << "serving as shard " << shard_id << std::endl;
+  }
   if (checkpoint_interval > 0) {
     std::cout << "periodic checkpointing every " << checkpoint_interval << " iterations" << std::endl;
   }
   
-  server->Wait();
+  using grpc::ByteBuffer;
+  using grpc::ServerAsyncResponseWriter;
+  namespace ps = parameter_server;
+  
+  std::vector<queue_calls> calls(queues.size());
+  for (size_t q = 0; q < queues.size(); ++q) {
+    ServerCompletionQueue* cq = queues[q].get();
+    auto& c = calls[q];
+    
+    c.receive_gradients = make_unary_pool<ByteBuffer, ByteBuffer>(
+      [&service, cq](ServerContext* ctx, ByteBuffer* req, ServerAsyncResponseWriter<ByteBuffer>* w, void* tag) {
+        service.RequestReceiveGradients(ctx, req, w, cq, cq, tag);
+      },
+      [&impl](const ByteBuffer& req, ByteBuffer& resp) { return impl.ReceiveGradients(req, resp); }, &executor);
+    c.serve_parameters = make_unary_pool<ByteBuffer, ByteBuffer>(
+      [&service, cq](ServerContext* ctx, ByteBuffer* req, ServerAsyncResponseWriter<ByteBuffer>* w, void* tag) {
+        service.RequestServeParameters(ctx, req, w, cq, cq, tag);
+      },
+      [&impl](const ByteBuffer& req, ByteBuffer& resp) { return impl.ServeParameters(req, resp); }, &executor);
+    // answered from a counter, cheap enough for the polling thread
+    c.check_sync_status = make_unary_pool<ps::SyncStatusRequest, ps::SyncStatusResponse>(
+      [&service, cq](ServerContext* ctx, ps::SyncStatusRequest* req, ServerAsyncResponseWriter<ps::SyncStatusResponse>* w, void* tag) {
+        service.RequestCheckSyncStatus(ctx, req, w, cq, cq, tag);
+      },
+      [&impl](const ps::SyncStatusRequest& req, ps::SyncStatusResponse& resp) { return impl.CheckSyncStatus(req, resp); }, nullptr);
+    c.save_checkpoint = make_unary_pool<ps::SaveCheckpointRequest, ps::SaveCheckpointResponse>(
+      [&service, cq](ServerContext* ctx, ps::SaveCheckpointRequest* req, ServerAsyncResponseWriter<ps::SaveCheckpointResponse>* w, void* tag) {
+        service.RequestSaveCheckpoint(ctx, req, w, cq, cq, tag);
+      },
+      [&impl](const ps::SaveCheckpointRequest& req, ps::SaveCheckpointResponse& resp) { return impl.SaveCheckpoint(req, resp); }, &executor);
+    c.load_checkpoint = make_unary_pool<ps::LoadCheckpointRequest, ps::LoadCheckpointResponse>(
+      [&service, cq](ServerContext* ctx, ps::LoadCheckpointRequest* req, ServerAsyncResponseWriter<ps::LoadCheckpointResponse>* w, void* tag) {
+        service.RequestLoadCheckpoint(ctx, req, w, cq, cq, tag);
+      },
+      [&impl](const ps::LoadCheckpointRequest& req, ps::LoadCheckpointResponse& resp) { return impl.LoadCheckpoint(req, resp); }, &executor);
+    c.update_membership = make_unary_pool<ps::MembershipUpdate, ps::MembershipResponse>(
+      [&service, cq](ServerContext* ctx, ps::MembershipUpdate* req, ServerAsyncResponseWriter<ps::MembershipResponse>* w, void* tag) {
+        service.RequestUpdateMembership(ctx, req, w, cq, cq, tag);
+      },
+      [&impl](const ps::MembershipUpdate& req, ps::MembershipResponse& resp) { return impl.UpdateMembership(req, resp); }, &executor);
+    c.attach_shared_memory = make_unary_pool<ps::SharedMemoryRequest, ps::SharedMemoryResponse>(
+      [&service, cq](ServerContext* ctx, ps::SharedMemoryRequest* req, ServerAsyncResponseWriter<ps::SharedMemoryResponse>* w, void* tag) {
+        service.RequestAttachSharedMemory(ctx, req, w, cq, cq, tag);
+      },
+      [&shared_memory, &options](const ps::SharedMemoryRequest& req, ps::SharedMemoryResponse& resp) {
+        resp.set_attached(options.shared_memory && shared_memory.attach(req.name(), req.token()));
+        return Status::OK;
+      }, &executor);
+    c.push_chunks = std::make_unique<call_pool<push_chunks_call>>([&service, cq, &impl, &executor](call_pool<push_chunks_call>* pool) {
+      return std::make_unique<push_chunks_call>(pool, &service, cq, &impl, &executor);
+    });
+    c.pull_chunks = std::make_unique<call_pool<pull_chunks_call>>([&service, cq, &impl, &executor](call_pool<pull_chunks_call>* pool) {
+      return std::make_unique<pull_chunks_call>(pool, &service, cq, &impl, &executor);
+    });
+    
+    int n = std::max(1, options.preposted_calls);
+    prepost(*c.receive_gradients, n);
+    prepost(*c.serve_parameters, n);
+    prepost(*c.check_sync_status, n);
+    prepost(*c.save_checkpoint, 1);
+    prepost(*c.load_checkpoint, 1);
+    prepost(*c.update_membership, 1);
+    prepost(*c.attach_shared_memory, 1);
+    prepost(*c.push_chunks, n);
+    prepost(*c.pull_chunks, n);
+  }
+  
+  std::vector<std::thread> pollers;
+  int threads_per_queue = std::max(1, options.polling_threads);
+  for (size_t q = 0; q < queues.size(); ++q) {
+    for (int t = 0; t < threads_per_queue; ++t) {
+      ServerCompletionQueue* cq = queues[q].get();
+      pollers.emplace_back([cq]() {
+        void* tag = nullptr;
+        bool ok = false;
+        while (cq->Next(&tag, &ok)) {
+          static_cast<call_state*>(tag)->proceed(ok);
+        }
+      });
+      if (options.pin_threads) {
+        pin_thread_to_core(pollers.back(), static_cast<unsigned>(pollers.size() - 1));
+      }
+    }
+  }
+  std::cout << queues.size() << " completion queues, " << pollers.size() << " polling threads, "
+            << executor.size() << " executor threads, " << impl.get_parameter_server().aggregation_threads()
+            << " aggregation threads, " << kernel_name() << " kernels" << std::endl;
+  const OptimizerOptions& optimizer = impl.get_parameter_server().optimizer();
+  std::cout << optimizer.name << " optimizer, learning rate " << optimizer.learning_rate
+            << (optimizer.bf16_state ? ", bf16 state" : "") << std::endl;
+  std::cout << options.consistency.mode << " consistency";
+  if (options.consistency.mode == "ssp") {
+    std::cout << ", staleness bound " << options.consistency.staleness;
+  }
+  if (options.consistency.mode == "bsp" && options.consistency.quorum > 0 &&
+      (options.consistency.elastic || options.consistency.quorum < total_workers)) {
+    std::cout << ", quorum " << options.consistency.quorum << " of " << total_workers << ", late pushes "
+              << (options.consistency.late_pushes == "next" ? "folded into the next update" : "dropped");
+  }
+  if (options.consistency.elastic) {
+    std::cout << ", elastic membership";
+  }
+  std::cout << std::endl;
+  if (!options.shared_memory) {
+    std::cout << "shared memory lanes refused, co-located workers stay on gRPC" << std::endl;
+  }
+  
+  for (auto& t : pollers) {
+    t.join();
+  }
 }
-
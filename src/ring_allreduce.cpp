@@ -0,0 +1,180 @@
+#include "ring_allreduce.h"
+#include "kernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+class RingAllreduce::service final : public peer::PeerWorker::Service {
+  public:
+    explicit service(RingAllreduce& ring) : ring_(ring) {}
+
+    grpc::Status SendSegment(grpc::ServerContext* context, const peer::RingSegment* request, peer::RingAck* response) override {
+      response->set_success(ring_.deliver(peer::RingSegment(*request)));
+      return grpc::Status::OK;
+    }
+
+  private:
+    RingAllreduce& ring_;
+};
+
+namespace {
+// first element of segment i when elements are cut into n segments
+size_t segment_begin(size_t elements, size_t i, size_t n) {
+  return elements * i / n;
+}
+}  // namespace
+
+RingAllreduce::RingAllreduce(const RingOptions& options)
+  : options_(options), service_(std::make_unique<service>(*this)) {
+  if (options_.segment_bytes < sizeof(float)) {
+    options_.segment_bytes = sizeof(float);
+  }
+}
+
+RingAllreduce::~RingAllreduce() {
+  if (server_) {
+    server_->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(1));
+  }
+}
+
+int32_t RingAllreduce::start(const std::string& address) {
+  int selected_port = 0;
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort(address, grpc::InsecureServerCredentials(), &selected_port);
+  builder.RegisterService(service_.get());
+  server_ = builder.BuildAndStart();
+  if (!server_) {
+    return 0;
+  }
+  return selected_port;
+}
+
+void RingAllreduce::set_ring(int64_t epoch, size_t rank, const std::vector<std::string>& addresses) {
+  epoch_ = epoch;
+  rank_ = rank;
+  size_ = addresses.size();
+  std::string right = size_ > 1 ? addresses[(rank_ + 1) % size_] : "";
+  if (right != right_address_) {
+    right_address_ = right;
+    right_ = right.empty() ? nullptr : peer::PeerWorker::NewStub(grpc::CreateChannel(right, grpc::InsecureChannelCredentials()));
+  }
+}
+
+bool RingAllreduce::allreduce(int iteration, std::vector<float>& data) {
+  if (size_ <= 1) {
+    return size_ == 1;
+  }
+  size_t n = size_;
+  size_t total = data.size();
+  auto segment = [&](size_t i, size_t& begin, size_t& end) {
+    begin = segment_begin(total, i % n, n);
+    end = segment_begin(total, i % n + 1, n);
+  };
+
+  // reduce-scatter: at step s the segment rank - s goes right and rank - s - 1 comes in from the left,
+  // so after n - 1 steps this worker holds the full sum of segment rank + 1
+  for (size_t s = 0; s + 1 < n; ++s) {
+    size_t begin = 0, end = 0;
+    segment(rank_ + n - s, begin, end);
+    if (!send(iteration, static_cast<int>(s), data.data() + begin, end - begin)) {
+      return false;
+    }
+    segment(rank_ + n - s - 1, begin, end);
+    if (!receive(iteration, static_cast<int>(s), data.data() + begin, end - begin, true)) {
+      return false;
+    }
+  }
+  // all-gather: the summed segments travel once more around the ring, replacing the partial sums
+  for (size_t s = 0; s + 1 < n; ++s) {
+    int step = static_cast<int>(n - 1 + s);
+    size_t begin = 0, end = 0;
+    segment(rank_ + n + 1 - s, begin, end);
+    if (!send(iteration, step, data.data() + begin, end - begin)) {
+      return false;
+    }
+    segment(rank_ + n - s, begin, end);
+    if (!receive(iteration, step, data.data() + begin, end - begin, false)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RingAllreduce::send(int iteration, int step, const float* segment, size_t elements) {
+  size_t per_message = options_.segment_bytes / sizeof(float);
+  for (size_t offset = 0; offset < elements; offset += per_message) {
+    size_t count = std::min(per_message, elements - offset);
+    peer::RingSegment piece;
+    piece.set_epoch(epoch_);
+    piece.set_iteration(iteration);
+    piece.set_step(step);
+    piece.set_offset(static_cast<int64_t>(offset));
+    piece.set_segment_elements(static_cast<int64_t>(elements));
+    piece.set_data(segment + offset, count * sizeof(float));
+
+    grpc::ClientContext ctx;
+    // the neighbour may still be coming up, wait for it rather than failing the step
+    ctx.set_wait_for_ready(true);
+    ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(options_.step_timeout_ms));
+    peer::RingAck ack;
+    if (!right_->SendSegment(&ctx, piece, &ack).ok() || !ack.success()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RingAllreduce::deliver(peer::RingSegment&& piece) {
+  if (piece.offset() < 0 || piece.data().size() % sizeof(float) != 0 ||
+      piece.offset() + static_cast<int64_t>(piece.data().size() / sizeof(float)) > piece.segment_elements()) {
+    return false;
+  }
+  step_key key(piece.epoch(), piece.iteration(), piece.step());
+  {
+    std::lock_guard<std::mutex> lock(inbox_mutex_);
+    inbox& box = inboxes_[key];
+    box.elements += piece.data().size() / sizeof(float);
+    box.pieces.push_back(std::move(piece));
+  }
+  arrived_.notify_all();
+  return true;
+}
+
+bool RingAllreduce::receive(int iteration, int step, float* segment, size_t elements, bool add) {
+  if (elements == 0) {
+    // nothing was sent for an empty segment
+    return true;
+  }
+  step_key key(epoch_, iteration, step);
+  inbox box;
+  {
+    std::unique_lock<std::mutex> lock(inbox_mutex_);
+    bool complete = arrived_.wait_for(lock, std::chrono::milliseconds(options_.step_timeout_ms), [&]() {
+      auto it = inboxes_.find(key);
+      return it != inboxes_.end() && it->second.elements >= elements;
+    });
+    if (!complete) {
+      return false;
+    }
+    box = std::move(inboxes_[key]);
+    // steps before this one are done with, pieces of a broken earlier ring included
+    inboxes_.erase(inboxes_.begin(), inboxes_.upper_bound(key));
+  }
+
+  for (const auto& piece : box.pieces) {
+    if (piece.segment_elements() != static_cast<int64_t>(elements)) {
+      // the left neighbour cut the buffer differently, its ring is not ours
+      return false;
+    }
+    float* dst = segment + piece.offset();
+    size_t count = piece.data().size() / sizeof(float);
+    if (add) {
+      const unsigned char* in = reinterpret_cast<const unsigned char*>(piece.data().data());
+      sum_into(dst, &in, 1, count);
+    } else {
+      std::memcpy(dst, piece.data().data(), count * sizeof(float));
+    }
+  }
+  return true;
+}
@@ -0,0 +1,43 @@
+#include "shard_map.h"
+
+ShardMap::ShardMap() : split_threshold_bytes_(0) {}
+
+ShardMap::ShardMap(const std::vector<std::string>& addresses, int64_t split_threshold_bytes)
+  : addresses_(addresses), split_threshold_bytes_(split_threshold_bytes) {}
+
+bool ShardMap::is_split(size_t num_elements) const {
+  if (addresses_.size() <= 1 || split_threshold_bytes_ <= 0) {
+    return false;
+  }
+  return static_cast<int64_t>(num_elements * sizeof(float)) >= split_threshold_bytes_ &&
+         num_elements >= addresses_.size();
+}
+
+size_t ShardMap::shard_for_name(const std::string& name) const {
+  if (addresses_.size() <= 1) {
+    return 0;
+  }
+
+  // FNV-1a, std::hash is not guaranteed to agree between workers built differently
+  uint64_t hash = 1469598103934665603ULL;
+  for (unsigned char c : name) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return static_cast<size_t>(hash % addresses_.size());
+}
+
+void ShardMap::split_range(size_t num_elements, size_t shard, size_t& begin, size_t& end) const {
+  size_t n = addresses_.size();
+  size_t base = num_elements / n;
+  size_t extra = num_elements % n;
+  begin = shard * base + (shard < extra ? shard : extra);
+  end = begin + base + (shard < extra ? 1 : 0);
+}
+
+std::string ShardMap::shard_checkpoint_path(const std::string& path, size_t shard) const {
+  if (addresses_.size() <= 1) {
+    return path;
+  }
+  return path + ".shard" + std::to_string(shard);
+}
@@ -0,0 +1,394 @@
+#include "shared_memory.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <random>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+const uint64_t kMagic = 0x70732d73686d3031;  // "ps-shm01"
+const uint32_t kSlots = 16;
+// yields before falling asleep on the futex, a reply usually comes back sooner than a wakeup takes
+const int kSpins = 64;
+// how often a waiting side looks up from the futex to check on its peer
+const std::chrono::milliseconds kWaitSlice(100);
+const char kNamePrefix[] = "/ps-shm-";
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "the rings need lock-free 32-bit atomics");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futexes wait on the atomics themselves");
+
+uint32_t* futex_word(std::atomic<uint32_t>& word) {
+  return reinterpret_cast<uint32_t*>(&word);
+}
+
+// shared, not private, futexes: the two sides are different processes
+void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, std::chrono::nanoseconds timeout) {
+  timespec ts;
+  ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+  ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+  syscall(SYS_futex, futex_word(word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t>& word) {
+  syscall(SYS_futex, futex_word(word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+}  // namespace
+
+// what one side tells the other is in its data area
+struct shm_message {
+  uint64_t sequence;  // a reply carries its request's
+  uint32_t op;
+  int32_t status;  // grpc::StatusCode of a reply, the area holds the error message when not OK
+  uint64_t bytes;
+};
+
+// single-producer single-consumer ring of messages
+struct shm_queue {
+  std::atomic<uint32_t> head;  // messages published, moved by the producer only
+  std::atomic<uint32_t> tail;  // messages taken, moved by the consumer only
+  std::atomic<uint32_t> sleeping;  // the consumer is in, or about to enter, a futex wait on head
+  shm_message slots[kSlots];
+};
+
+// start of a region, followed by the request area and the reply area, capacity bytes each
+struct shm_region {
+  uint64_t magic;
+  uint64_t token;  // handed to the server over gRPC, proves it mapped the region the worker made
+  uint64_t capacity;
+  int32_t worker_pid;
+  std::atomic<int32_t> server_pid;  // set by the server on attach
+  std::atomic<uint32_t> closed;  // the worker is gone, the server stops serving the region
+  alignas(64) shm_queue requests;
+  alignas(64) shm_queue replies;
+};
+
+namespace {
+const size_t kHeaderBytes = (sizeof(shm_region) + 4095) / 4096 * 4096;
+
+unsigned char* request_area(shm_region* region) {
+  return reinterpret_cast<unsigned char*>(region) + kHeaderBytes;
+}
+
+// capacity is each side's own copy, never the header's: the other process can rewrite that at any time
+unsigned char* reply_area(shm_region* region, size_t capacity) {
+  return request_area(region) + capacity;
+}
+
+void publish(shm_queue& q, const shm_message& m) {
+  // one call is in flight per region, the ring never fills
+  uint32_t head = q.head.load(std::memory_order_relaxed);
+  q.slots[head % kSlots] = m;
+  // sequentially consistent against the consumer's sleeping flag, so either it sees head move or we see it asleep
+  q.head.store(head + 1, std::memory_order_seq_cst);
+  if (q.sleeping.load(std::memory_order_seq_cst) != 0) {
+    futex_wake(q.head);
+  }
+}
+
+// true once a message is waiting, false if none came before until
+bool wait_message(shm_queue& q, std::chrono::steady_clock::time_point until) {
+  uint32_t tail = q.tail.load(std::memory_order_relaxed);
+  for (int i = 0; i < kSpins; ++i) {
+    if (q.head.load(std::memory_order_acquire) != tail) {
+      return true;
+    }
+    std::this_thread::yield();
+  }
+  while (true) {
+    q.sleeping.store(1, std::memory_order_seq_cst);
+    uint32_t head = q.head.load(std::memory_order_seq_cst);
+    auto now = std::chrono::steady_clock::now();
+    if (head != tail || now >= until) {
+      q.sleeping.store(0, std::memory_order_relaxed);
+      return head != tail;
+    }
+    // returns at once if head moved since it was read
+    futex_wait(q.head, head, until - now);
+    q.sleeping.store(0, std::memory_order_relaxed);
+    if (q.head.load(std::memory_order_acquire) != tail) {
+      return true;
+    }
+  }
+}
+
+// pids of another pid namespace cannot be checked, only ones that answer now are watched
+bool can_watch(int32_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+bool exited(int32_t pid) {
+  return kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+shm_message take(shm_queue& q) {
+  uint32_t tail = q.tail.load(std::memory_order_relaxed);
+  shm_message m = q.slots[tail % kSlots];
+  q.tail.store(tail + 1, std::memory_order_release);
+  return m;
+}
+
+// copies buffer into area, false when it does not fit
+bool copy_out(const grpc::ByteBuffer& buffer, unsigned char* area, size_t capacity, uint64_t& bytes) {
+  bytes = buffer.Length();
+  std::vector<grpc::Slice> slices;
+  if (bytes > capacity || !buffer.Dump(&slices).ok()) {
+    return false;
+  }
+  for (const auto& slice : slices) {
+    std::memcpy(area, slice.begin(), slice.size());
+    area += slice.size();
+  }
+  return true;
+}
+
+// the host part of "host:port", "[v6]:port" or a bare host
+std::string host_of(const std::string& address) {
+  if (!address.empty() && address[0] == '[') {
+    size_t close = address.find(']');
+    return address.substr(1, close == std::string::npos ? std::string::npos : close - 1);
+  }
+  size_t colon = address.rfind(':');
+  if (colon != std::string::npos && address.find(':') == colon) {
+    return address.substr(0, colon);
+  }
+  return address;
+}
+}  // namespace
+
+shm_op shm_op_for(const std::string& method) {
+  auto ends_with = [&](const char* suffix) {
+    size_t n = std::strlen(suffix);
+    return method.size() >= n && method.compare(method.size() - n, n, suffix) == 0;
+  };
+  if (ends_with("/ReceiveGradients")) return shm_op::receive_gradients;
+  if (ends_with("/ServeParameters")) return shm_op::serve_parameters;
+  if (ends_with("/CheckSyncStatus")) return shm_op::check_sync_status;
+  return shm_op::none;
+}
+
+bool is_local_address(const std::string& address, const std::string& hostname) {
+  std::string host = host_of(address);
+  return host == "localhost" || host == "::1" || host.rfind("127.", 0) == 0 || (!hostname.empty() && host == hostname);
+}
+
+// worker side
+
+std::unique_ptr<SharedMemoryChannel> SharedMemoryChannel::create(size_t capacity) {
+  static std::atomic<uint32_t> created(0);
+  std::random_device random;
+  uint64_t token = (static_cast<uint64_t>(random()) << 32) | random();
+  std::string name = kNamePrefix + std::to_string(getpid()) + "-" + std::to_string(created++);
+
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    return nullptr;
+  }
+  size_t bytes = kHeaderBytes + 2 * capacity;
+  // reserve the pages now: a /dev/shm too small for them would otherwise fault on first touch, mid-call
+  void* mapped = MAP_FAILED;
+  if (ftruncate(fd, static_cast<off_t>(bytes)) == 0 && posix_fallocate(fd, 0, static_cast<off_t>(bytes)) == 0) {
+    mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    return nullptr;
+  }
+
+  shm_region* region = new (mapped) shm_region();
+  region->token = token;
+  region->capacity = capacity;
+  region->worker_pid = static_cast<int32_t>(getpid());
+  region->magic = kMagic;
+
+  std::unique_ptr<SharedMemoryChannel> channel(new SharedMemoryChannel());
+  channel->name_ = name;
+  channel->region_ = region;
+  channel->mapped_bytes_ = bytes;
+  channel->capacity_ = capacity;
+  return channel;
+}
+
+SharedMemoryChannel::~SharedMemoryChannel() {
+  if (!region_) {
+    return;
+  }
+  region_->closed.store(1, std::memory_order_release);
+  unlink();
+  munmap(region_, mapped_bytes_);
+}
+
+uint64_t SharedMemoryChannel::token() const {
+  return region_->token;
+}
+
+void SharedMemoryChannel::unlink() {
+  if (!name_.empty()) {
+    shm_unlink(name_.c_str());
+    name_.clear();
+  }
+}
+
+size_t SharedMemoryChannel::capacity() const {
+  return capacity_;
+}
+
+grpc::Status SharedMemoryChannel::call(shm_op op, const grpc::ByteBuffer& request, grpc::ByteBuffer* response,
+                                       std::chrono::system_clock::time_point deadline,
+                                       const std::function<bool()>& broken) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (failed_) {
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "shared memory lane closed");
+  }
+  if (sequence_ == 0) {
+    // the server that just attached is alive, whether its pid means anything from here is decided now
+    watch_server_ = can_watch(region_->server_pid.load(std::memory_order_acquire));
+  }
+  shm_message m{++sequence_, static_cast<uint32_t>(op), 0, 0};
+  if (!copy_out(request, request_area(region_), capacity_, m.bytes)) {
+    return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "request larger than the shared memory region");
+  }
+  publish(region_->requests, m);
+
+  while (!wait_message(region_->replies, std::chrono::steady_clock::now() + kWaitSlice)) {
+    // a reply that comes later would land on the next call's, the lane cannot be used again
+    if (std::chrono::system_clock::now() >= deadline) {
+      failed_ = true;
+      return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED, "no reply over shared memory");
+    }
+    if ((watch_server_ && exited(region_->server_pid.load(std::memory_order_relaxed))) || (broken && broken())) {
+      failed_ = true;
+      return grpc::Status(grpc::StatusCode::UNAVAILABLE, "parameter server went away");
+    }
+  }
+  shm_message reply = take(region_->replies);
+  if (reply.sequence != m.sequence || reply.bytes > capacity_) {
+    failed_ = true;
+    return grpc::Status(grpc::StatusCode::INTERNAL, "shared memory reply out of step");
+  }
+  const unsigned char* in = reply_area(region_, capacity_);
+  if (reply.status != grpc::StatusCode::OK) {
+    return grpc::Status(static_cast<grpc::StatusCode>(reply.status),
+                        std::string(reinterpret_cast<const char*>(in), reply.bytes));
+  }
+  grpc::Slice slice(in, reply.bytes);
+  *response = grpc::ByteBuffer(&slice, 1);
+  return grpc::Status::OK;
+}
+
+// parameter server side
+
+struct SharedMemoryServer::lane {
+  shm_region* region = nullptr;
+  size_t mapped_bytes = 0;
+  size_t capacity = 0;  // checked against the mapping on attach
+  bool watch_pid = false;  // the worker's pid means something here, it is not in another pid namespace
+  std::thread thread;
+  std::atomic<bool> done{false};
+};
+
+SharedMemoryServer::SharedMemoryServer(handler handle) : handle_(std::move(handle)) {}
+
+SharedMemoryServer::~SharedMemoryServer() {
+  stopping_ = true;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& l : lanes_) {
+    l->thread.join();
+  }
+}
+
+bool SharedMemoryServer::attach(const std::string& name, uint64_t token) {
+  // only regions workers made, never an arbitrary object under /dev/shm
+  if (name.rfind(kNamePrefix, 0) != 0 || name.find('/', 1) != std::string::npos) {
+    return false;
+  }
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  void* mapped = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= kHeaderBytes) {
+    mapped = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  size_t bytes = static_cast<size_t>(st.st_size);
+  shm_region* region = static_cast<shm_region*>(mapped);
+  // read once: the value checked here is the only one the lane ever uses
+  uint64_t capacity = region->capacity;
+  if (region->magic != kMagic || region->token != token || capacity > (bytes - kHeaderBytes) / 2) {
+    munmap(mapped, bytes);
+    return false;
+  }
+
+  auto l = std::make_unique<lane>();
+  l->region = region;
+  l->mapped_bytes = bytes;
+  l->capacity = static_cast<size_t>(capacity);
+  l->watch_pid = can_watch(region->worker_pid);
+  region->server_pid.store(static_cast<int32_t>(getpid()), std::memory_order_release);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  // lanes of workers that left
+  for (auto it = lanes_.begin(); it != lanes_.end();) {
+    if ((*it)->done) {
+      (*it)->thread.join();
+      it = lanes_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  l->thread = std::thread(&SharedMemoryServer::serve, this, l.get());
+  lanes_.push_back(std::move(l));
+  return true;
+}
+
+void SharedMemoryServer::serve(lane* l) {
+  shm_region* region = l->region;
+  while (!stopping_) {
+    if (!wait_message(region->requests, std::chrono::steady_clock::now() + kWaitSlice)) {
+      if (region->closed.load(std::memory_order_acquire) != 0 ||
+          (l->watch_pid && exited(region->worker_pid))) {
+        break;
+      }
+      continue;
+    }
+    shm_message m = take(region->requests);
+    shm_message reply{m.sequence, m.op, grpc::StatusCode::OK, 0};
+    grpc::Status s;
+    grpc::ByteBuffer response;
+    if (m.bytes > l->capacity) {
+      s = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "request larger than the shared memory region");
+    } else {
+      // the request is read in place, the worker leaves it alone until the reply is in
+      grpc::Slice slice(request_area(region), m.bytes, grpc::Slice::STATIC_SLICE);
+      grpc::ByteBuffer request(&slice, 1);
+      s = handle_(static_cast<shm_op>(m.op), request, response);
+    }
+    if (s.ok() && !copy_out(response, reply_area(region, l->capacity), l->capacity, reply.bytes)) {
+      // the worker falls back to streaming, as it does when a reply outgrows gRPC's message limit
+      s = grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "reply larger than the shared memory region");
+    }
+    if (!s.ok()) {
+      const std::string& message = s.error_message();
+      reply.status = s.error_code();
+      reply.bytes = std::min<uint64_t>(message.size(), l->capacity);
+      std::memcpy(reply_area(region, l->capacity), message.data(), reply.bytes);
+    }
+    publish(region->replies, reply);
+  }
+  munmap(region, l->mapped_bytes);
+  l->done = true;
+}
@@ -0,0 +1,671 @@
+#include "tensor_codec.h"
+#include "parameter_server.pb.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+enum wire_type { WIRE_VARINT = 0, WIRE_FIXED64 = 1, WIRE_LEN = 2, WIRE_FIXED32 = 5 };
+
+// Tensor field numbers in parameter_server.proto
+const int kTensorName = 1;
+const int kTensorShape = 2;
+const int kTensorData = 3;
+const int kTensorDtype = 4;
+const int kTensorRawData = 5;
+const int kTensorByteOrder = 6;
+const int kTensorIndices = 7;
+const int kTensorDenseSize = 8;
+const int kTensorBlockSize = 9;
+static_assert(kDtypeInt8Block == parameter_server::DT_INT8_BLOCK && kDtypeSignBlock == parameter_server::DT_SIGN_BLOCK &&
+              kDtypeFloat16 == parameter_server::DT_FLOAT16 && kDtypeBfloat16 == parameter_server::DT_BFLOAT16,
+              "tensor_view dtype constants out of sync with the proto");
+const int kTensorScales = 10;
+
+// TensorChunk field numbers
+const int kChunkTensor = 1;
+const int kChunkOffset = 2;
+const int kChunkTotalElements = 3;
+
+// payloads below this size are copied into the framing slice, a separate slice costs more than the copy
+const size_t kInlinePayloadBytes = 4096;
+
+bool host_is_little_endian() {
+  uint16_t x = 1;
+  unsigned char b;
+  std::memcpy(&b, &x, 1);
+  return b == 1;
+}
+
+void append_varint(std::string& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+void append_tag(std::string& out, int field, wire_type type) {
+  append_varint(out, (static_cast<uint64_t>(field) << 3) | type);
+}
+
+size_t varint_size(uint64_t v) {
+  size_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+void release_owner(void* owner) {
+  delete static_cast<std::shared_ptr<const void>*>(owner);
+}
+
+// sequential reader over the slices of a received message
+class slice_cursor {
+  public:
+    explicit slice_cursor(const std::vector<grpc::Slice>& slices) : slices_(slices), index_(0), offset_(0), consumed_(0) {
+      skip_empty();
+    }
+
+    size_t consumed() const { return consumed_; }
+    bool at_end() const { return index_ >= slices_.size(); }
+
+    bool read_byte(unsigned char& b) {
+      if (at_end()) return false;
+      b = slices_[index_].begin()[offset_];
+      advance(1);
+      return true;
+    }
+
+    bool read_varint(uint64_t& v) {
+      v = 0;
+      for (int shift = 0; shift < 64; shift += 7) {
+        unsigned char b;
+        if (!read_byte(b)) return false;
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+      }
+      return false;
+    }
+
+    // the next n bytes if they sit inside the current slice, nullptr otherwise
+    const unsigned char* contiguous(size_t n) {
+      if (at_end() || slices_[index_].size() - offset_ < n) return nullptr;
+      const unsigned char* p = slices_[index_].begin() + offset_;
+      advance(n);
+      return p;
+    }
+
+    bool read(size_t n, unsigned char* out) {
+      while (n > 0) {
+        if (at_end()) return false;
+        size_t chunk = std::min(n, slices_[index_].size() - offset_);
+        std::memcpy(out, slices_[index_].begin() + offset_, chunk);
+        out += chunk;
+        n -= chunk;
+        advance(chunk);
+      }
+      return true;
+    }
+
+    bool skip(size_t n) {
+      while (n > 0) {
+        if (at_end()) return false;
+        size_t chunk = std::min(n, slices_[index_].size() - offset_);
+        n -= chunk;
+        advance(chunk);
+      }
+      return true;
+    }
+
+  private:
+    void advance(size_t n) {
+      offset_ += n;
+      consumed_ += n;
+      skip_empty();
+    }
+
+    void skip_empty() {
+      while (index_ < slices_.size() && offset_ >= slices_[index_].size()) {
+        index_++;
+        offset_ = 0;
+      }
+    }
+
+    const std::vector<grpc::Slice>& slices_;
+    size_t index_;
+    size_t offset_;
+    size_t consumed_;
+};
+
+bool skip_field(slice_cursor& cur, uint64_t type) {
+  uint64_t v = 0;
+  switch (type) {
+    case WIRE_VARINT:
+      return cur.read_varint(v);
+    case WIRE_FIXED64:
+      return cur.skip(8);
+    case WIRE_LEN:
+      return cur.read_varint(v) && cur.skip(v);
+    case WIRE_FIXED32:
+      return cur.skip(4);
+    default:
+      return false;
+  }
+}
+
+// copies the field's raw wire bytes (tag included) so the envelope can be parsed by protobuf afterwards
+bool copy_field(slice_cursor& cur, uint64_t tag, std::string& out) {
+  append_varint(out, tag);
+  uint64_t v = 0;
+  switch (tag & 7) {
+    case WIRE_VARINT:
+      if (!cur.read_varint(v)) return false;
+      append_varint(out, v);
+      return true;
+    case WIRE_FIXED64:
+    case WIRE_FIXED32: {
+      size_t n = (tag & 7) == WIRE_FIXED64 ? 8 : 4;
+      size_t at = out.size();
+      out.resize(at + n);
+      return cur.read(n, reinterpret_cast<unsigned char*>(&out[at]));
+    }
+    case WIRE_LEN: {
+      if (!cur.read_varint(v)) return false;
+      append_varint(out, v);
+      size_t at = out.size();
+      out.resize(at + v);
+      return cur.read(v, reinterpret_cast<unsigned char*>(&out[at]));
+    }
+    default:
+      return false;
+  }
+}
+// points view at payload, or at a host-order float32 copy of it in owned when it needs converting;
+// 16-bit floats stay 16-bit, the consumer widens them while reading
+void set_payload(tensor_view& view, const unsigned char* payload, size_t payload_bytes, int32_t dtype, int32_t byte_order,
+                 std::deque<std::vector<unsigned char>>& owned) {
+  size_t elem_bytes = element_bytes(dtype);
+  bool swap = (byte_order == parameter_server::BYTE_ORDER_LITTLE) != host_is_little_endian();
+  view.dtype = parameter_server::DT_FLOAT32;
+  view.size = payload_bytes / elem_bytes;
+
+  if (dtype == parameter_server::DT_FLOAT16 || dtype == parameter_server::DT_BFLOAT16) {
+    view.dtype = dtype;
+    view.data = payload;
+    if (swap) {
+      owned.emplace_back(payload, payload + view.size * elem_bytes);
+      for (size_t i = 0; i < view.size; ++i) {
+        std::swap(owned.back()[i * elem_bytes], owned.back()[i * elem_bytes + 1]);
+      }
+      view.data = owned.back().data();
+    }
+    return;
+  }
+
+  if (dtype == parameter_server::DT_FLOAT32 && !swap) {
+    view.data = payload;
+    return;
+  }
+
+  // rare path: convert into host order float32
+  owned.emplace_back(view.size * sizeof(float));
+  unsigned char* out = owned.back().data();
+  for (size_t i = 0; i < view.size; ++i) {
+    unsigned char elem[sizeof(double)];
+    std::memcpy(elem, payload + i * elem_bytes, elem_bytes);
+    if (swap) std::reverse(elem, elem + elem_bytes);
+    float f;
+    if (elem_bytes == sizeof(double)) {
+      double d;
+      std::memcpy(&d, elem, sizeof(double));
+      f = static_cast<float>(d);
+    } else {
+      std::memcpy(&f, elem, sizeof(float));
+    }
+    std::memcpy(out + i * sizeof(float), &f, sizeof(float));
+  }
+  view.data = out;
+}
+
+// turns a view of nnz values into a sparse view of the dense_size tensor they index; false unless there
+// is one ascending, in-range index per value
+bool set_indices(tensor_view& view, const unsigned char* indices, size_t index_bytes, uint64_t dense_size,
+                 int32_t byte_order, std::deque<std::vector<unsigned char>>& owned) {
+  if (index_bytes != view.size * sizeof(uint32_t) || dense_size > UINT32_MAX + uint64_t(1)) return false;
+  if ((byte_order == parameter_server::BYTE_ORDER_LITTLE) != host_is_little_endian()) {
+    owned.emplace_back(indices, indices + index_bytes);
+    for (size_t j = 0; j < index_bytes; j += sizeof(uint32_t)) {
+      std::reverse(owned.back().begin() + j, owned.back().begin() + j + sizeof(uint32_t));
+    }
+    indices = owned.back().data();
+  }
+  static const unsigned char kNoEntries = 0;
+  view.indices = indices ? indices : &kNoEntries;  // still marks the view sparse
+  view.nnz = view.size;
+  view.size = static_cast<size_t>(dense_size);
+  for (size_t j = 0; j < view.nnz; ++j) {
+    if (view.index(j) >= dense_size || (j > 0 && view.index(j) <= view.index(j - 1))) return false;
+  }
+  return true;
+}
+
+// points view at block-quantized codes for elements values; false unless the codes, block size and scales agree
+bool set_quantized(tensor_view& view, const unsigned char* codes, size_t code_bytes, int32_t dtype, uint64_t elements,
+                   uint64_t block, const unsigned char* scales, size_t scale_bytes, int32_t byte_order,
+                   std::deque<std::vector<unsigned char>>& owned) {
+  uint64_t expected = dtype == parameter_server::DT_INT8_BLOCK ? elements : (elements + 7) / 8;
+  if (block == 0 || block % 8 != 0 || code_bytes != expected ||
+      scale_bytes != (elements + block - 1) / block * sizeof(float)) {
+    return false;
+  }
+  if ((byte_order == parameter_server::BYTE_ORDER_LITTLE) != host_is_little_endian()) {
+    owned.emplace_back(scales, scales + scale_bytes);
+    for (size_t j = 0; j < scale_bytes; j += sizeof(float)) {
+      std::reverse(owned.back().begin() + j, owned.back().begin() + j + sizeof(float));
+    }
+    scales = owned.back().data();
+  }
+  view.dtype = dtype;
+  view.data = codes;
+  view.size = static_cast<size_t>(elements);
+  view.scales = scales;
+  view.block = static_cast<size_t>(block);
+  return true;
+}
+}  // namespace
+
+int32_t host_byte_order() {
+  return host_is_little_endian() ? parameter_server::BYTE_ORDER_LITTLE : parameter_server::BYTE_ORDER_BIG;
+}
+
+bool parse_float_dtype(const std::string& name, int32_t& dtype) {
+  if (name == "fp32") {
+    dtype = parameter_server::DT_FLOAT32;
+  } else if (name == "fp16") {
+    dtype = parameter_server::DT_FLOAT16;
+  } else if (name == "bf16") {
+    dtype = parameter_server::DT_BFLOAT16;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool is_float_dtype(int32_t dtype) {
+  return dtype == parameter_server::DT_FLOAT32 || dtype == parameter_server::DT_FLOAT16 ||
+         dtype == parameter_server::DT_BFLOAT16;
+}
+
+size_t element_bytes(int32_t dtype) {
+  switch (dtype) {
+    case parameter_server::DT_FLOAT64:
+      return sizeof(double);
+    case parameter_server::DT_FLOAT16:
+    case parameter_server::DT_BFLOAT16:
+      return sizeof(uint16_t);
+    default:
+      return sizeof(float);
+  }
+}
+
+TensorPayloadWriter::TensorPayloadWriter() {}
+
+TensorPayloadWriter::TensorPayloadWriter(const google::protobuf::MessageLite& envelope) {
+  envelope.SerializeToString(&pending_);
+}
+
+std::string TensorPayloadWriter::tensor_header(const std::string& name, const std::vector<int32_t>& shape, int32_t dtype) {
+  parameter_server::Tensor header;
+  header.set_name(name);
+  for (int32_t d : shape) header.add_shape(d);
+  header.set_dtype(static_cast<parameter_server::DataType>(dtype));
+  header.set_byte_order(static_cast<parameter_server::ByteOrder>(host_byte_order()));
+  return header.SerializeAsString();
+}
+
+size_t TensorPayloadWriter::payload_field_size(int field, size_t payload_bytes) {
+  return varint_size((static_cast<uint64_t>(field) << 3) | WIRE_LEN) + varint_size(payload_bytes) + payload_bytes;
+}
+
+void TensorPayloadWriter::append_payload(int field, const void* data, size_t payload_bytes, std::shared_ptr<const void> owner) {
+  append_tag(pending_, field, WIRE_LEN);
+  append_varint(pending_, payload_bytes);
+
+  if (payload_bytes < kInlinePayloadBytes || !owner) {
+    pending_.append(reinterpret_cast<const char*>(data), payload_bytes);
+    return;
+  }
+
+  flush_pending();
+  slices_.emplace_back(const_cast<void*>(data), payload_bytes, &release_owner, new std::shared_ptr<const void>(std::move(owner)));
+}
+
+const void* TensorPayloadWriter::encode_elements(const float* data, size_t n, int32_t dtype,
+                                                 std::shared_ptr<const void>& owner) {
+  if (dtype != parameter_server::DT_FLOAT16 && dtype != parameter_server::DT_BFLOAT16) {
+    return data;
+  }
+  auto narrowed = std::make_shared<std::vector<unsigned char>>(n * sizeof(uint16_t));
+  narrow_half(narrowed->data(), data, dtype == parameter_server::DT_BFLOAT16, n);
+  owner = narrowed;
+  return narrowed->data();
+}
+
+void TensorPayloadWriter::add_tensor(int field_number, const std::string& name, const std::vector<int32_t>& shape,
+                                     const float* data, size_t size, std::shared_ptr<const void> owner, int32_t dtype) {
+  std::string header_bytes = tensor_header(name, shape, dtype);
+  size_t payload_bytes = size * element_bytes(dtype);
+  const void* payload = encode_elements(data, size, dtype, owner);
+
+  append_tag(pending_, field_number, WIRE_LEN);
+  append_varint(pending_, header_bytes.size() + payload_field_size(kTensorRawData, payload_bytes));
+  pending_ += header_bytes;
+  append_payload(kTensorRawData, payload, payload_bytes, std::move(owner));
+}
+
+void TensorPayloadWriter::add_sparse_tensor(int field_number, const std::string& name, const std::vector<int32_t>& shape,
+                                            const uint32_t* indices, const float* values, size_t nnz, size_t dense_size,
+                                            std::shared_ptr<const void> owner) {
+  std::string header_bytes = tensor_header(name, shape);
+  append_tag(header_bytes, kTensorDenseSize, WIRE_VARINT);
+  append_varint(header_bytes, dense_size);
+  size_t index_bytes = nnz * sizeof(uint32_t);
+  size_t payload_bytes = nnz * sizeof(float);
+
+  append_tag(pending_, field_number, WIRE_LEN);
+  append_varint(pending_, header_bytes.size() + payload_field_size(kTensorIndices, index_bytes) +
+                          payload_field_size(kTensorRawData, payload_bytes));
+  pending_ += header_bytes;
+  append_payload(kTensorIndices, indices, index_bytes, owner);
+  append_payload(kTensorRawData, values, payload_bytes, std::move(owner));
+}
+
+void TensorPayloadWriter::add_quantized_tensor(int field_number, const std::string& name, const std::vector<int32_t>& shape,
+                                               int32_t dtype, const unsigned char* codes, size_t code_bytes,
+                                               const float* scales, size_t block, size_t elements,
+                                               std::shared_ptr<const void> owner) {
+  std::string header_bytes = tensor_header(name, shape, dtype);
+  append_tag(header_bytes, kTensorDenseSize, WIRE_VARINT);
+  append_varint(header_bytes, elements);
+  append_tag(header_bytes, kTensorBlockSize, WIRE_VARINT);
+  append_varint(header_bytes, block);
+  size_t scale_bytes = (elements + block - 1) / block * sizeof(float);
+
+  append_tag(pending_, field_number, WIRE_LEN);
+  append_varint(pending_, header_bytes.size() + payload_field_size(kTensorScales, scale_bytes) +
+                          payload_field_size(kTensorRawData, code_bytes));
+  pending_ += header_bytes;
+  append_payload(kTensorScales, scales, scale_bytes, owner);
+  append_payload(kTensorRawData, codes, code_bytes, std::move(owner));
+}
+
+void TensorPayloadWriter::add_tensor_chunk(int field_number, const std::string& name, const std::vector<int32_t>& shape,
+                                           const float* data, size_t begin, size_t end, size_t total,
+                                           std::shared_ptr<const void> owner, int32_t dtype) {
+  std::string header_bytes = tensor_header(name, shape, dtype);
+  size_t payload_bytes = (end - begin) * element_bytes(dtype);
+  const void* payload = encode_elements(data + begin, end - begin, dtype, owner);
+  size_t tensor_len = header_bytes.size() + payload_field_size(kTensorRawData, payload_bytes);
+
+  // offset and total_elements go ahead of the nested tensor so the payload can stay the last bytes
+  std::string prefix;
+  append_tag(prefix, kChunkOffset, WIRE_VARINT);
+  append_varint(prefix, begin);
+  append_tag(prefix, kChunkTotalElements, WIRE_VARINT);
+  append_varint(prefix, total);
+  append_tag(prefix, kChunkTensor, WIRE_LEN);
+  append_varint(prefix, tensor_len);
+
+  append_tag(pending_, field_number, WIRE_LEN);
+  append_varint(pending_, prefix.size() + tensor_len);
+  pending_ += prefix;
+  pending_ += header_bytes;
+  append_payload(kTensorRawData, payload, payload_bytes, std::move(owner));
+}
+
+void TensorPayloadWriter::flush_pending() {
+  if (pending_.empty()) return;
+  slices_.emplace_back(pending_);
+  pending_.clear();
+}
+
+grpc::ByteBuffer TensorPayloadWriter::finish() {
+  flush_pending();
+  grpc::ByteBuffer buffer(slices_.data(), slices_.size());
+  slices_.clear();
+  return buffer;
+}
+
+std::vector<grpc::Slice> TensorPayloadWriter::finish_slices() {
+  flush_pending();
+  return std::move(slices_);
+}
+
+bool TensorPayloadReader::parse(const grpc::ByteBuffer& buffer, int tensor_field, google::protobuf::MessageLite* envelope) {
+  slices_.clear();
+  owned_.clear();
+  tensors_.clear();
+  if (!buffer.Dump(&slices_).ok()) return false;
+
+  std::string envelope_bytes;
+  slice_cursor cur(slices_);
+
+  while (!cur.at_end()) {
+    uint64_t tag = 0;
+    if (!cur.read_varint(tag)) return false;
+    if (static_cast<int>(tag >> 3) != tensor_field || (tag & 7) != WIRE_LEN) {
+      if (!copy_field(cur, tag, envelope_bytes)) return false;
+      continue;
+    }
+
+    uint64_t len = 0;
+    if (!cur.read_varint(len)) return false;
+    size_t end = cur.consumed() + len;
+
+    tensor_view view;
+    view.dtype = parameter_server::DT_FLOAT32;
+    view.data = nullptr;
+    view.size = 0;
+    int32_t dtype = parameter_server::DT_FLOAT32;
+    int32_t byte_order = parameter_server::BYTE_ORDER_LITTLE;
+    const unsigned char* payload = nullptr;
+    size_t payload_bytes = 0;
+    const unsigned char* indices = nullptr;
+    size_t index_bytes = 0;
+    bool sparse = false;
+    uint64_t dense_size = 0;
+    uint64_t block_size = 0;
+    const unsigned char* scales = nullptr;
+    size_t scale_bytes = 0;
+    std::vector<unsigned char> legacy;  // unpacked repeated float, one fixed32 per element
+
+    while (cur.consumed() < end) {
+      uint64_t field_tag = 0;
+      if (!cur.read_varint(field_tag)) return false;
+      int field = static_cast<int>(field_tag >> 3);
+      uint64_t type = field_tag & 7;
+      uint64_t v = 0;
+
+      if (field == kTensorName && type == WIRE_LEN) {
+        if (!cur.read_varint(v)) return false;
+        view.name.resize(v);
+        if (!cur.read(v, reinterpret_cast<unsigned char*>(&view.name[0]))) return false;
+      } else if (field == kTensorShape && type == WIRE_LEN) {
+        if (!cur.read_varint(v)) return false;
+        size_t shape_end = cur.consumed() + v;
+        while (cur.consumed() < shape_end) {
+          uint64_t d = 0;
+          if (!cur.read_varint(d)) return false;
+          view.shape.push_back(static_cast<int32_t>(d));
+        }
+      } else if (field == kTensorShape && type == WIRE_VARINT) {
+        if (!cur.read_varint(v)) return false;
+        view.shape.push_back(static_cast<int32_t>(v));
+      } else if ((field == kTensorRawData || field == kTensorData) && type == WIRE_LEN) {
+        if (!cur.read_varint(v)) return false;
+        payload_bytes = v;
+        payload = cur.contiguous(payload_bytes);
+        if (!payload) {
+          owned_.emplace_back(payload_bytes);
+          if (!cur.read(payload_bytes, owned_.back().data())) return false;
+          payload = owned_.back().data();
+        }
+        if (field == kTensorData) {
+          // packed repeated float is always little endian float32
+          dtype = parameter_server::DT_FLOAT32;
+          byte_order = parameter_server::BYTE_ORDER_LITTLE;
+        }
+      } else if (field == kTensorIndices && type == WIRE_LEN) {
+        if (!cur.read_varint(v)) return false;
+        sparse = true;
+        index_bytes = v;
+        indices = cur.contiguous(index_bytes);
+        if (!indices) {
+          owned_.emplace_back(index_bytes);
+          if (!cur.read(index_bytes, owned_.back().data())) return false;
+          indices = owned_.back().data();
+        }
+      } else if (field == kTensorDenseSize && type == WIRE_VARINT) {
+        if (!cur.read_varint(dense_size)) return false;
+        sparse = true;
+      } else if (field == kTensorBlockSize && type == WIRE_VARINT) {
+        if (!cur.read_varint(block_size)) return false;
+      } else if (field == kTensorScales && type == WIRE_LEN) {
+        if (!cur.read_varint(v)) return false;
+        scale_bytes = v;
+        scales = cur.contiguous(scale_bytes);
+        if (!scales) {
+          owned_.emplace_back(scale_bytes);
+          if (!cur.read(scale_bytes, owned_.back().data())) return false;
+          scales = owned_.back().data();
+        }
+      } else if (field == kTensorData && type == WIRE_FIXED32) {
+        size_t at = legacy.size();
+        legacy.resize(at + 4);
+        if (!cur.read(4, &legacy[at])) return false;
+      } else if (field == kTensorDtype && type == WIRE_VARINT) {
+        if (!cur.read_varint(v)) return false;
+        dtype = static_cast<int32_t>(v);
+      } else if (field == kTensorByteOrder && type == WIRE_VARINT) {
+        if (!cur.read_varint(v)) return false;
+        byte_order = static_cast<int32_t>(v);
+      } else if (!skip_field(cur, type)) {
+        return false;
+      }
+    }
+
+    if (!legacy.empty()) {
+      owned_.push_back(std::move(legacy));
+      payload = owned_.back().data();
+      payload_bytes = owned_.back().size();
+      dtype = parameter_server::DT_FLOAT32;
+      byte_order = parameter_server::BYTE_ORDER_LITTLE;
+    }
+
+    if (dtype == parameter_server::DT_INT8_BLOCK || dtype == parameter_server::DT_SIGN_BLOCK) {
+      // codes stay as received, the server decodes them while adding them in
+      if (!set_quantized(view, payload, payload_bytes, dtype, dense_size, block_size, scales, scale_bytes, byte_order, owned_)) {
+        return false;
+      }
+      tensors_.push_back(std::move(view));
+      continue;
+    }
+    set_payload(view, payload, payload_bytes, dtype, byte_order, owned_);
+    // sparse values are always float32
+    if (sparse && (view.half() || !set_indices(view, indices, index_bytes, dense_size, byte_order, owned_))) return false;
+    tensors_.push_back(std::move(view));
+  }
+
+  return envelope->ParseFromString(envelope_bytes);
+}
+
+bool parse_message(const grpc::ByteBuffer& buffer, google::protobuf::MessageLite* message) {
+  std::vector<grpc::Slice> slices;
+  if (!buffer.Dump(&slices).ok()) return false;
+  if (slices.size() == 1) {
+    return message->ParseFromArray(slices[0].begin(), static_cast<int>(slices[0].size()));
+  }
+  std::string bytes;
+  for (const auto& s : slices) {
+    bytes.append(reinterpret_cast<const char*>(s.begin()), s.size());
+  }
+  return message->ParseFromString(bytes);
+}
+
+grpc::ByteBuffer serialize_message(const google::protobuf::MessageLite& message) {
+  grpc::Slice slice(message.SerializeAsString());
+  return grpc::ByteBuffer(&slice, 1);
+}
+
+grpc::ByteBuffer assemble_message(const google::protobuf::MessageLite& envelope, const std::vector<grpc::Slice>& body) {
+  std::vector<grpc::Slice> slices;
+  slices.reserve(body.size() + 1);
+  slices.emplace_back(envelope.SerializeAsString());
+  slices.insert(slices.end(), body.begin(), body.end());
+  return grpc::ByteBuffer(slices.data(), slices.size());
+}
+
+std::vector<std::vector<chunk_piece>> plan_chunks(const std::vector<size_t>& sizes, size_t chunk_bytes,
+                                                  size_t element_bytes) {
+  size_t per_chunk = std::max<size_t>(1, chunk_bytes / element_bytes);
+  std::vector<std::vector<chunk_piece>> chunks;
+  size_t used = per_chunk;  // forces a new chunk for the first piece
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    size_t begin = 0;
+    do {
+      if (used >= per_chunk) {
+        chunks.emplace_back();
+        used = 0;
+      }
+      size_t end = std::min(sizes[i], begin + (per_chunk - used));
+      chunks.back().push_back({i, begin, end});
+      used += end - begin;
+      begin = end;
+    } while (begin < sizes[i]);
+  }
+  return chunks;
+}
+
+void set_tensor_chunk(parameter_server::TensorChunk* piece, const std::string& name, const std::vector<int32_t>& shape,
+                      const float* data, size_t begin, size_t end, size_t total, int32_t dtype) {
+  auto* t = piece->mutable_tensor();
+  t->set_name(name);
+  for (int32_t d : shape) t->add_shape(d);
+  t->set_dtype(static_cast<parameter_server::DataType>(dtype));
+  t->set_byte_order(static_cast<parameter_server::ByteOrder>(host_byte_order()));
+  if (dtype == parameter_server::DT_FLOAT16 || dtype == parameter_server::DT_BFLOAT16) {
+    std::string* raw = t->mutable_raw_data();
+    raw->resize((end - begin) * sizeof(uint16_t));
+    narrow_half(reinterpret_cast<unsigned char*>(&(*raw)[0]), data + begin, dtype == parameter_server::DT_BFLOAT16, end - begin);
+  } else {
+    t->set_raw_data(reinterpret_cast<const char*>(data + begin), (end - begin) * sizeof(float));
+  }
+  piece->set_offset(static_cast<int64_t>(begin));
+  piece->set_total_elements(static_cast<int64_t>(total));
+}
+
+bool view_tensor(const parameter_server::Tensor& t, tensor_view& view, std::deque<std::vector<unsigned char>>& owned) {
+  if (!t.indices().empty() || t.dense_size() != 0 || t.dtype() == parameter_server::DT_INT8_BLOCK ||
+      t.dtype() == parameter_server::DT_SIGN_BLOCK) {
+    return false;
+  }
+  view.name = t.name();
+  view.shape.assign(t.shape().begin(), t.shape().end());
+  if (!t.raw_data().empty() || t.data_size() == 0) {
+    size_t elem_bytes = element_bytes(t.dtype());
+    if (t.raw_data().size() % elem_bytes != 0) {
+      return false;
+    }
+    set_payload(view, reinterpret_cast<const unsigned char*>(t.raw_data().data()), t.raw_data().size(),
+                t.dtype(), t.byte_order(), owned);
+    return true;
+  }
+  // legacy repeated float, already host order after parsing
+  view.dtype = parameter_server::DT_FLOAT32;
+  view.data = reinterpret_cast<const unsigned char*>(t.data().data());
+  view.size = static_cast<size_t>(t.data_size());
+  return true;
+}
@@ -0,0 +1,123 @@
+#include "work_stealing_pool.h"
+
+#include <algorithm>
+
+namespace {
+
+// queue of the pool thread we are running on, if any
+thread_local const WorkStealingPool* current_pool = nullptr;
+thread_local size_t current_queue = 0;
+
+}  // namespace
+
+WorkStealingPool::WorkStealingPool(size_t threads) : queued_(0), stopping_(false), next_queue_(0) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    queues_.push_back(std::make_unique<task_queue>());
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back(&WorkStealingPool::run, this, i);
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto& t : threads_) {
+    t.join();
+  }
+}
+
+void WorkStealingPool::submit(std::function<void()> task) {
+  size_t q = current_pool == this ? current_queue : next_queue_++ % queues_.size();
+  {
+    std::lock_guard<std::mutex> lock(queues_[q]->mutex);
+    queues_[q]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    queued_++;
+  }
+  cv_.notify_one();
+}
+
+void WorkStealingPool::parallel_for(size_t count, const std::function<void(size_t)>& fn) {
+  if (count <= 1 || threads_.size() <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      fn(i);
+    }
+    return;
+  }
+
+  // helpers claim indexes from a shared counter, so uneven items balance out by themselves
+  struct loop {
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+  };
+  auto state = std::make_shared<loop>();
+  auto body = [state, count, &fn]() {
+    size_t i;
+    while ((i = state->next.fetch_add(1)) < count) {
+      fn(i);
+      state->done.fetch_add(1, std::memory_order_release);
+    }
+  };
+  // a helper that only starts after the loop is over finds nothing left and never touches fn
+  size_t helpers = std::min(count - 1, threads_.size());
+  for (size_t h = 0; h < helpers; ++h) {
+    submit(body);
+  }
+  body();
+  // what is left are items other threads are in the middle of
+  while (state->done.load(std::memory_order_acquire) < count) {
+    std::this_thread::yield();
+  }
+}
+
+bool WorkStealingPool::take(size_t self, std::function<void()>& task) {
+  {
+    auto& own = *queues_[self];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+  for (size_t k = 1; k < queues_.size(); ++k) {
+    auto& victim = *queues_[(self + k) % queues_.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::run(size_t self) {
+  current_pool = this;
+  current_queue = self;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(sleep_mutex_);
+      cv_.wait(lock, [this]() { return stopping_ || queued_ > 0; });
+      if (queued_ == 0) {
+        return;
+      }
+      queued_--;
+    }
+    // a task is reserved for us, it may still take a moment to find if another thread stole it
+    std::function<void()> task;
+    while (!take(self, task)) {
+      std::this_thread::yield();
+    }
+    task();
+  }
+}
@@ -1,4 +1,9 @@
 #include "worker.h"
+#include "connection_manager.h"
+#include "tensor_codec.h"
+#include "kernels.h"
+#include "ring_allreduce.h"
+#include "host_aggregator.h"
 
 #include <grpcpp/grpcpp.h>
 #include "parameter_server.grpc.pb.h"
@@ -7,6 +12,12 @@
 #include <chrono>
 #include <functional>
 #include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <algorithm>
+#include <unordered_map>
+#include <deque>
+#include <unistd.h>
 
 #ifdef HAVE_NCCL
 #include <cuda_runtime.h>
@@ -20,7 +31,8 @@ using parameter_server::GradientUpdate;
 using parameter_server::PushResponse;
 using parameter_server::PullRequest;
 using parameter_server::ParameterUpdate;
-using parameter_server::Tensor;
+using parameter_server::GradientChunk;
+using parameter_server::ParameterChunk;
 using parameter_server::SyncStatusRequest;
 using parameter_server::SyncStatusResponse;
 using parameter_server::LoadCheckpointRequest;
@@ -28,52 +40,531 @@ using parameter_server::LoadCheckpointResponse;
 using coordinator::Coordinator;
 using coordinator::WorkerInfo;
 using coordinator::RegisterResponse;
-using coordinator::ListWorkersRequest;
-using coordinator::ListWorkersResponse;
 using coordinator::GetPSAddressRequest;
 using coordinator::GetPSAddressResponse;
+using coordinator::GetShardMapRequest;
+using coordinator::GetRingRequest;
+using coordinator::RingAssignment;
+using coordinator::GetHostGroupRequest;
+using coordinator::HostGroup;
 using coordinator::HeartbeatRequest;
 using coordinator::HeartbeatResponse;
 using coordinator::WorkerStatus;
 
 namespace {
-std::vector<Tensor> to_proto(const std::vector<TensorLite>& ts) {
-  std::vector<Tensor> out;
-  out.reserve(ts.size());
+// part of a tensor that belongs to one parameter server shard
+struct TensorSlice {
+  const TensorLite* tensor;
+  size_t begin;
+  size_t end;
+};
+
+size_t num_elements(const TensorLite& t) {
+  if (t.shape.empty()) return t.data.size();
+  size_t n = 1;
+  for (int32_t d : t.shape) n *= static_cast<size_t>(d);
+  return n;
+}
+
+// appends the part of t each shard holds
+void add_slices(const ShardMap& shard_map, const TensorLite& t, std::vector<std::vector<TensorSlice>>& per_shard) {
+  if (!shard_map.is_split(num_elements(t))) {
+    per_shard[shard_map.shard_for_name(t.name)].push_back({&t, 0, t.data.size()});
+    return;
+  }
+  for (size_t shard = 0; shard < shard_map.num_shards(); ++shard) {
+    size_t begin = 0, end = 0;
+    shard_map.split_range(t.data.size(), shard, begin, end);
+    per_shard[shard].push_back({&t, begin, end});
+  }
+}
+
+std::vector<std::vector<TensorSlice>> partition_by_shard(const ShardMap& shard_map, const std::vector<TensorLite>& ts) {
+  std::vector<std::vector<TensorSlice>> per_shard(shard_map.num_shards());
   for (const auto& t : ts) {
-    Tensor proto;
-    proto.set_name(t.name);
-    for (int32_t d : t.shape) proto.add_shape(d);
-    for (float v : t.data) proto.add_data(v);
-    proto.set_dtype(t.dtype);
-    out.push_back(std::move(proto));
+    add_slices(shard_map, t, per_shard);
+  }
+  return per_shard;
+}
+
+// rebuilds whole tensors from what the shards return, a split tensor arrives as one range per shard
+class ModelAssembler {
+ public:
+  // base is the model a delta pull patches, pieces then only overwrite what changed
+  explicit ModelAssembler(const ShardMap& shard_map, std::vector<TensorLite> base = {})
+    : shard_map_(shard_map), merged_(std::move(base)) {
+    for (size_t i = 0; i < merged_.size(); ++i) {
+      index_.emplace(merged_[i].name, i);
+    }
   }
-  return out;
+  
+  // piece holds elements [offset, offset + piece.size) of the shard's shard_elements-long part of the tensor
+  void add(size_t shard, const tensor_view& piece, size_t offset, size_t shard_elements) {
+    size_t n = shard_elements;
+    if (!piece.shape.empty()) {
+      n = 1;
+      for (int32_t d : piece.shape) n *= static_cast<size_t>(d);
+    }
+    
+    auto it = index_.find(piece.name);
+    if (it == index_.end()) {
+      TensorLite full;
+      full.name = piece.name;
+      full.shape = piece.shape;
+      full.dtype = 0;
+      full.data.resize(n, 0.0f);
+      it = index_.emplace(piece.name, merged_.size()).first;
+      merged_.push_back(std::move(full));
+    }
+    
+    size_t begin = 0, end = n;
+    if (shard_map_.is_split(n)) {
+      shard_map_.split_range(n, shard, begin, end);
+    }
+    begin += offset;
+    auto& full = merged_[it->second];
+    if (begin >= full.data.size()) return;
+    piece.copy_to(full.data.data() + begin, 0, std::min(piece.size, full.data.size() - begin));
+  }
+  
+  std::vector<TensorLite> take() { return std::move(merged_); }
+  
+ private:
+  const ShardMap& shard_map_;
+  std::vector<TensorLite> merged_;
+  std::unordered_map<std::string, size_t> index_;
+};
+
+// stands in for the model while the servers hold none yet, the first push creates it
+TensorLite placeholder_parameters() {
+  TensorLite dummy;
+  dummy.name = "weight";
+  dummy.shape = {10, 10};
+  dummy.dtype = 0;
+  dummy.data.resize(100, 0.0f);
+  return dummy;
 }
 
-std::vector<TensorLite> from_proto(const google::protobuf::RepeatedPtrField<Tensor>& ts) {
-  std::vector<TensorLite> out;
-  out.reserve(ts.size());
+// every tensor's elements back to back, in order, as the peer-to-peer reductions carry them
+std::vector<float> flatten(const std::vector<TensorLite>& ts) {
+  size_t total = 0;
   for (const auto& t : ts) {
-    TensorLite x;
-    x.name = t.name();
-    x.shape.assign(t.shape().begin(), t.shape().end());
-    x.data.assign(t.data().begin(), t.data().end());
-    x.dtype = t.dtype();
-    out.push_back(std::move(x));
+    total += t.data.size();
+  }
+  std::vector<float> flat;
+  flat.reserve(total);
+  for (const auto& t : ts) {
+    flat.insert(flat.end(), t.data.begin(), t.data.end());
+  }
+  return flat;
+}
+
+// this machine's name, what workers sharing it are grouped by
+std::string local_hostname() {
+  char name[256] = {};
+  if (gethostname(name, sizeof(name) - 1) != 0) {
+    return "localhost";
+  }
+  return name;
+}
+
+const std::string& serve_parameters_method() {
+  static const std::string method = std::string("/") + ParameterServer::service_full_name() + "/ServeParameters";
+  return method;
+}
+
+const std::string& receive_gradients_method() {
+  static const std::string method = std::string("/") + ParameterServer::service_full_name() + "/ReceiveGradients";
+  return method;
+}
+
+const std::string& check_sync_status_method() {
+  static const std::string method = std::string("/") + ParameterServer::service_full_name() + "/CheckSyncStatus";
+  return method;
+}
+
+// whole push of one shard's slices in a single message
+bool unary_push(ConnectionManager& connections, size_t shard, int worker_id, int iteration,
+                const std::vector<TensorSlice>& slices, const std::shared_ptr<const std::vector<TensorLite>>& grads,
+                int32_t dtype, PushResponse& resp) {
+  ClientContext ctx;
+  connections.prepare_context(ctx);
+  GradientUpdate header;
+  header.set_worker_id(worker_id);
+  header.set_iteration(iteration);
+  // gradient memory goes out as slices, grads stays alive until gRPC releases them
+  TensorPayloadWriter writer(header);
+  for (const auto& slice : slices) {
+    writer.add_tensor(GradientUpdate::kGradientsFieldNumber, slice.tensor->name, slice.tensor->shape,
+                      slice.tensor->data.data() + slice.begin, slice.end - slice.begin, grads, dtype);
+  }
+  grpc::ByteBuffer raw;
+  Status s = connections.call_raw(shard, receive_gradients_method(), &ctx, writer.finish(), &raw);
+  return s.ok() && parse_message(raw, &resp);
+}
+
+// compressed push of one shard's slices, slices stays alive until gRPC releases them
+bool unary_compressed_push(ConnectionManager& connections, size_t shard, int worker_id, int iteration,
+                           const std::shared_ptr<const std::vector<CompressedSlice>>& slices, int32_t dtype,
+                           PushResponse& resp) {
+  ClientContext ctx;
+  connections.prepare_context(ctx);
+  GradientUpdate header;
+  header.set_worker_id(worker_id);
+  header.set_iteration(iteration);
+  TensorPayloadWriter writer(header);
+  for (const auto& slice : *slices) {
+    if (slice.codes.dtype != 0) {
+      writer.add_quantized_tensor(GradientUpdate::kGradientsFieldNumber, slice.name, slice.shape, slice.codes.dtype,
+                                  slice.codes.codes.data(), slice.codes.codes.size(), slice.codes.scales.data(),
+                                  slice.codes.block, slice.dense_size, slices);
+    } else if (slice.sparse) {
+      writer.add_sparse_tensor(GradientUpdate::kGradientsFieldNumber, slice.name, slice.shape, slice.entries.indices.data(),
+                               slice.entries.values.data(), slice.entries.indices.size(), slice.dense_size, slices);
+    } else {
+      writer.add_tensor(GradientUpdate::kGradientsFieldNumber, slice.name, slice.shape, slice.values.data(),
+                        slice.values.size(), slices, dtype);
+    }
   }
-  return out;
+  grpc::ByteBuffer raw;
+  Status s = connections.call_raw(shard, receive_gradients_method(), &ctx, writer.finish(), &raw);
+  return s.ok() && parse_message(raw, &resp);
+}
+
+// where one shard stands on iteration; raw so a shared memory lane carries the polling too
+bool sync_status(ConnectionManager& connections, size_t shard, int worker_id, int iteration, SyncStatusResponse& resp) {
+  ClientContext ctx;
+  connections.prepare_context(ctx);
+  SyncStatusRequest req;
+  req.set_iteration(iteration);
+  req.set_worker_id(worker_id);
+  grpc::ByteBuffer raw;
+  Status s = connections.call_raw(shard, check_sync_status_method(), &ctx, serialize_message(req), &raw);
+  return s.ok() && parse_message(raw, &resp);
+}
+
+const int kStreamAttempts = 3;
+
+// the pieces of one chunk, each a range of one of slices
+void fill_chunk(GradientChunk& chunk, const std::vector<TensorSlice>& slices, const std::vector<chunk_piece>& pieces,
+                int32_t dtype) {
+  for (const auto& p : pieces) {
+    const auto& slice = slices[p.tensor];
+    set_tensor_chunk(chunk.add_pieces(), slice.tensor->name, slice.tensor->shape,
+                     slice.tensor->data.data() + slice.begin, p.begin, p.end, slice.end - slice.begin, dtype);
+  }
+}
+
+std::vector<std::vector<chunk_piece>> plan_slices(const std::vector<TensorSlice>& slices, size_t chunk_bytes, int32_t dtype) {
+  std::vector<size_t> sizes;
+  sizes.reserve(slices.size());
+  for (const auto& slice : slices) {
+    sizes.push_back(slice.end - slice.begin);
+  }
+  return plan_chunks(sizes, chunk_bytes, element_bytes(dtype));
+}
+
+// streams the planned chunks of one shard's slices; after a broken stream it resumes from the chunk the shard asks for
+bool send_chunks(ConnectionManager& connections, size_t shard, int worker_id, int iteration,
+                 const std::vector<TensorSlice>& slices, const std::vector<std::vector<chunk_piece>>& chunks,
+                 int32_t dtype, PushResponse& resp) {
+  size_t start = 0;
+  for (int attempt = 0; attempt < kStreamAttempts; ++attempt) {
+    auto stub = connections.parameter_server(shard);
+    if (!stub) return false;
+    
+    ClientContext ctx;
+    connections.prepare_context(ctx);
+    PushResponse reply;
+    auto writer = stub->PushGradientChunks(&ctx, &reply);
+    for (size_t seq = start; seq < chunks.size(); ++seq) {
+      GradientChunk chunk;
+      chunk.set_worker_id(worker_id);
+      chunk.set_iteration(iteration);
+      chunk.set_sequence(static_cast<int64_t>(seq));
+      chunk.set_last(seq + 1 == chunks.size());
+      fill_chunk(chunk, slices, chunks[seq], dtype);
+      if (!writer->Write(chunk)) break;
+    }
+    writer->WritesDone();
+    Status s = writer->Finish();
+    if (s.ok() && reply.next_chunk() < 0) {
+      resp = reply;
+      return true;
+    }
+    if (s.ok()) {
+      start = static_cast<size_t>(reply.next_chunk());
+      continue;
+    }
+    
+    // the stream broke, ask the shard how far it got
+    ClientContext status_ctx;
+    connections.prepare_context(status_ctx);
+    SyncStatusRequest req;
+    req.set_iteration(iteration);
+    req.set_worker_id(worker_id);
+    SyncStatusResponse status;
+    if (!stub->CheckSyncStatus(&status_ctx, req, &status).ok()) continue;
+    if (status.ready() || status.next_chunk() < 0) {
+      resp.set_aggregation_complete(status.ready());
+      resp.set_workers_received(status.workers_received());
+      resp.set_total_workers(status.total_workers());
+      return true;
+    }
+    start = static_cast<size_t>(status.next_chunk());
+  }
+  return false;
+}
+
+// chunked push of one shard's slices
+bool stream_push(ConnectionManager& connections, size_t shard, int worker_id, int iteration,
+                 const std::vector<TensorSlice>& slices, size_t chunk_bytes, int32_t dtype, PushResponse& resp) {
+  return send_chunks(connections, shard, worker_id, iteration, slices, plan_slices(slices, chunk_bytes, dtype), dtype, resp);
+}
+
+// Gradients handed over in backward order collect into a bucket until it holds bucket_bytes; the full bucket is
+// cut into chunks and streamed to its shards right away, one PushGradientChunks stream per shard, while the
+// rest of backward carries on. A shard reduces every chunk as it lands, so little is left to sum at the end.
+class bucketed_push {
+  public:
+    using shard_pushed = std::function<void(size_t shard, const PushResponse& resp)>;
+    
+    bucketed_push(ConnectionManager& connections, const ShardMap& shard_map, int worker_id, int iteration,
+                  const WorkerOptions& options, shard_pushed pushed)
+      : connections_(connections), shard_map_(shard_map), worker_id_(worker_id), iteration_(iteration),
+        options_(options), pushed_(std::move(pushed)), streams_(shard_map.num_shards()) {
+      for (size_t shard = 0; shard < streams_.size(); ++shard) {
+        streams_[shard].sender = std::thread(&bucketed_push::send, this, shard);
+      }
+    }
+    
+    ~bucketed_push() {
+      close();
+    }
+    
+    // grad is final; it is kept until every shard has sent it
+    void mark_ready(TensorLite&& grad) {
+      grads_.push_back(std::move(grad));
+      pending_.push_back(&grads_.back());
+      pending_bytes_ += grads_.back().data.size() * element_bytes(options_.push_dtype);
+      if (pending_bytes_ >= options_.bucket_bytes) {
+        flush_bucket();
+      }
+    }
+    
+    // sends what is left and waits for every shard; false when one did not take the whole push
+    bool finish(std::vector<PushResponse>& replies) {
+      close();
+      replies.clear();
+      bool ok = true;
+      for (const auto& s : streams_) {
+        replies.push_back(s.reply);
+        ok = ok && s.ok;
+      }
+      return ok;
+    }
+
+  private:
+    struct shard_stream {
+      std::vector<TensorSlice> slices;
+      std::vector<std::vector<chunk_piece>> chunks;  // pieces index slices
+      PushResponse reply;
+      bool ok = false;
+      std::thread sender;
+    };
+    
+    void flush_bucket() {
+      if (pending_.empty()) return;
+      std::vector<std::vector<TensorSlice>> per_shard(streams_.size());
+      for (const TensorLite* t : pending_) {
+        add_slices(shard_map_, *t, per_shard);
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t shard = 0; shard < streams_.size(); ++shard) {
+          shard_stream& s = streams_[shard];
+          size_t base = s.slices.size();
+          for (auto& chunk : plan_slices(per_shard[shard], options_.chunk_bytes, options_.push_dtype)) {
+            for (auto& p : chunk) p.tensor += base;
+            s.chunks.push_back(std::move(chunk));
+          }
+          s.slices.insert(s.slices.end(), per_shard[shard].begin(), per_shard[shard].end());
+        }
+      }
+      pending_.clear();
+      pending_bytes_ = 0;
+      ready_.notify_all();
+    }
+    
+    void close() {
+      if (closed_) return;
+      closed_ = true;
+      flush_bucket();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& s : streams_) {
+          // every shard counts this worker, so one that got nothing still gets an empty last chunk
+          if (s.chunks.empty()) s.chunks.emplace_back();
+        }
+        finished_ = true;
+      }
+      ready_.notify_all();
+      for (auto& s : streams_) {
+        s.sender.join();
+      }
+    }
+    
+    void send(size_t shard) {
+      shard_stream& s = streams_[shard];
+      auto stub = connections_.parameter_server(shard);
+      ClientContext ctx;
+      connections_.prepare_context(ctx);
+      PushResponse reply;
+      std::unique_ptr<grpc::ClientWriter<GradientChunk>> writer;
+      if (stub) writer = stub->PushGradientChunks(&ctx, &reply);
+      bool broken = !writer;
+      
+      for (size_t seq = 0;; ++seq) {
+        // copied out so the message is built without holding up backward
+        std::vector<TensorSlice> slices;
+        std::vector<chunk_piece> pieces;
+        bool last = false;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          // the newest chunk waits until it is known whether it is the last one
+          ready_.wait(lock, [&] { return finished_ || s.chunks.size() > seq + 1; });
+          if (seq >= s.chunks.size()) break;
+          last = finished_ && seq + 1 == s.chunks.size();
+          pieces = s.chunks[seq];
+          for (auto& p : pieces) {
+            slices.push_back(s.slices[p.tensor]);
+            p.tensor = slices.size() - 1;
+          }
+        }
+        if (broken) continue;
+        GradientChunk chunk;
+        chunk.set_worker_id(worker_id_);
+        chunk.set_iteration(iteration_);
+        chunk.set_sequence(static_cast<int64_t>(seq));
+        chunk.set_last(last);
+        fill_chunk(chunk, slices, pieces, options_.push_dtype);
+        broken = !writer->Write(chunk);
+      }
+      
+      if (writer) {
+        writer->WritesDone();
+        Status status = writer->Finish();
+        s.ok = !broken && status.ok() && reply.next_chunk() < 0;
+      }
+      if (!s.ok) {
+        // every bucket is in by now, the plain chunked push resumes from wherever the shard got to
+        s.ok = send_chunks(connections_, shard, worker_id_, iteration_, s.slices, s.chunks, options_.push_dtype, reply);
+      }
+      s.reply = reply;
+      if (s.ok && pushed_) {
+        pushed_(shard, reply);
+      }
+    }
+    
+    ConnectionManager& connections_;
+    const ShardMap& shard_map_;
+    int worker_id_;
+    int iteration_;
+    const WorkerOptions& options_;
+    shard_pushed pushed_;
+    // grads_ never moves what it holds, slices point into it
+    std::deque<TensorLite> grads_;
+    std::vector<const TensorLite*> pending_;
+    size_t pending_bytes_ = 0;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    bool finished_ = false;
+    std::vector<shard_stream> streams_;
+};
+
+// folds every shard's reply to one push together: complete once every shard applied it
+bool summarize_push(const std::vector<PushResponse>& replies, int& workers_received, int& total_workers,
+                    int32_t& skip_to_iteration) {
+  bool complete = true;
+  workers_received = replies.empty() ? 0 : replies.front().workers_received();
+  total_workers = 0;
+  skip_to_iteration = -1;
+  for (const auto& resp : replies) {
+    workers_received = std::min(workers_received, resp.workers_received());
+    total_workers = std::max(total_workers, resp.total_workers());
+    if (resp.skip_to() > 0) {
+      skip_to_iteration = std::max(skip_to_iteration, resp.skip_to());
+    }
+    complete = complete && resp.aggregation_complete();
+  }
+  return complete;
+}
+
+// chunked pull of one shard's parameters, a broken stream resumes after the last chunk received
+bool stream_pull(ConnectionManager& connections, size_t shard, int worker_id, int iteration,
+                 int64_t known_version, uint64_t known_incarnation, size_t chunk_bytes, int32_t dtype,
+                 std::vector<ParameterChunk>& chunks) {
+  for (int attempt = 0; attempt < kStreamAttempts; ++attempt) {
+    auto stub = connections.parameter_server(shard);
+    if (!stub) return false;
+    
+    ClientContext ctx;
+    connections.prepare_context(ctx);
+    PullRequest req;
+    req.set_worker_id(worker_id);
+    req.set_iteration(iteration);
+    req.set_start_chunk(static_cast<int64_t>(chunks.size()));
+    req.set_chunk_bytes(static_cast<int64_t>(chunk_bytes));
+    req.set_known_version(known_version);
+    req.set_known_incarnation(known_incarnation);
+    req.set_dtype(static_cast<parameter_server::DataType>(dtype));
+    auto reader = stub->PullParameterChunks(&ctx, req);
+    ParameterChunk chunk;
+    bool stale = false;
+    while (reader->Read(&chunk)) {
+      if (!chunks.empty() && chunk.version() != chunks.front().version()) {
+        // parameters moved on since the broken stream, its chunks cannot be mixed with these
+        stale = true;
+        ctx.TryCancel();
+        break;
+      }
+      if (chunk.sequence() == static_cast<int64_t>(chunks.size())) {
+        chunks.push_back(std::move(chunk));
+      }
+    }
+    Status s = reader->Finish();
+    if (stale) {
+      chunks.clear();
+      continue;
+    }
+    if (s.ok()) {
+      return true;
+    }
+  }
+  return false;
 }
 }  // namespace
 
-Worker::Worker(int worker_id, const std::string& coordinator_address, const std::string& worker_address, int32_t worker_port)
-  : worker_id_(worker_id), coordinator_address_(coordinator_address), 
-    worker_address_(worker_address), worker_port_(worker_port), initialized_(false),
-    running_(true), current_status_(0)
+Worker::Worker(int worker_id, const std::string& coordinator_address, const std::string& worker_address, int32_t worker_port,
+               const WorkerOptions& options)
+  : worker_id_(worker_id), server_id_(worker_id), coordinator_address_(coordinator_address), 
+    worker_address_(worker_address), worker_port_(worker_port), options_(options), initialized_(false),
+    replica_optimizer_(options.optimizer), running_(true), current_status_(0)
 #ifdef HAVE_NCCL
     , nccl_manager_(nullptr), num_gpus_(0)
 #endif
 {
+  if (options_.hostname.empty()) {
+    options_.hostname = local_hostname();
+  }
+  
+  ConnectionOptions conn_options;
+  conn_options.channels_per_shard = options_.ps_channels;
+  conn_options.shared_memory_bytes = options_.shared_memory_bytes;
+  conn_options.hostname = options_.hostname;
+  connections_ = std::make_unique<ConnectionManager>(coordinator_address_, conn_options);
+  
   heartbeat_thread_ = std::thread(&Worker::heartbeat_loop, this);
   
 #ifdef HAVE_NCCL
@@ -92,6 +583,7 @@ Worker::Worker(int worker_id, const std::string& coordinator_address, const std:
 }
 
 Worker::~Worker() {
+  flush();
   running_ = false;
   if (heartbeat_thread_.joinable()) {
     heartbeat_thread_.join();
@@ -112,6 +604,26 @@ bool Worker::initialize() {
     return false;
   }
   
+  // peer services have to be up before the coordinator hands this worker's port to the others
+  if (options_.allreduce == "ring" && !ring_) {
+    auto ring = std::make_unique<RingAllreduce>(RingOptions{options_.chunk_bytes});
+    int32_t port = ring->start("0.0.0.0:" + std::to_string(worker_port_));
+    if (port == 0) {
+      return false;
+    }
+    worker_port_ = port;
+    ring_ = std::move(ring);
+  }
+  if (options_.local_aggregation && !host_) {
+    auto host = std::make_unique<HostAggregator>(HostAggregatorOptions{options_.chunk_bytes});
+    int32_t port = host->start("0.0.0.0:" + std::to_string(worker_port_));
+    if (port == 0) {
+      return false;
+    }
+    worker_port_ = port;
+    host_ = std::move(host);
+  }
+  
   if (!register_with_coordinator()) {
     return false;
   }
@@ -122,6 +634,8 @@ bool Worker::initialize() {
 }
 
 bool Worker::reconnect() {
+  // healthy channels are kept, initialize() only reopens shards whose address changed
+  connections_->reconnect();
   initialized_ = false;
   return initialize();
 }
@@ -140,16 +654,20 @@ bool Worker::query_with_retry(const std::function<bool()>& query_func, int max_r
 
 bool Worker::discover_parameter_server() {
   return query_with_retry([this]() {
-    auto channel = grpc::CreateChannel(coordinator_address_, grpc::InsecureChannelCredentials());
-    std::unique_ptr<Coordinator::Stub> stub = Coordinator::NewStub(channel);
+    auto stub = connections_->coordinator();
     
     ClientContext ctx;
-    GetPSAddressRequest req;
-    GetPSAddressResponse resp;
-    Status s = stub->GetParameterServerAddress(&ctx, req, &resp);
+    GetShardMapRequest req;
+    coordinator::ShardMap resp;
+    Status s = stub->GetShardMap(&ctx, req, &resp);
     
-    if (s.ok()) {
-      ps_address_ = resp.address() + ":" + std::to_string(resp.port());
+    if (s.ok() && resp.shards_size() > 0) {
+      std::vector<std::string> addresses;
+      for (const auto& shard : resp.shards()) {
+        addresses.push_back(shard.address() + ":" + std::to_string(shard.port()));
+      }
+      shard_map_ = ShardMap(addresses, resp.split_threshold_bytes());
+      connections_->set_parameter_servers(addresses);
       return true;
     }
     return false;
@@ -158,8 +676,7 @@ bool Worker::discover_parameter_server() {
 
 bool Worker::register_with_coordinator() {
   return query_with_retry([this]() {
-    auto channel = grpc::CreateChannel(coordinator_address_, grpc::InsecureChannelCredentials());
-    std::unique_ptr<Coordinator::Stub> stub = Coordinator::NewStub(channel);
+    auto stub = connections_->coordinator();
     
     ClientContext ctx;
     WorkerInfo req;
@@ -170,14 +687,16 @@ bool Worker::register_with_coordinator() {
       req.set_address("localhost");
     }
     req.set_port(worker_port_);
-    req.set_hostname("worker-" + std::to_string(worker_id_));
+    req.set_hostname(options_.hostname);
+    req.set_local_aggregation(options_.local_aggregation);
     
     RegisterResponse resp;
     Status s = stub->RegisterWorker(&ctx, req, &resp);
     
     if (s.ok() && resp.success()) {
-      if (!ps_address_.empty() && ps_address_ != resp.parameter_server_address()) {
-        ps_address_ = resp.parameter_server_address();
+      if (shard_map_.empty() && !resp.parameter_server_address().empty()) {
+        shard_map_ = ShardMap({resp.parameter_server_address()}, 0);
+        connections_->set_parameter_servers(shard_map_.addresses());
       }
       return true;
     }
@@ -185,39 +704,72 @@ bool Worker::register_with_coordinator() {
   });
 }
 
-std::vector<std::string> Worker::discover_peer_workers() {
-  std::vector<std::string> peers;
-  
-  query_with_retry([this, &peers]() {
-    auto channel = grpc::CreateChannel(coordinator_address_, grpc::InsecureChannelCredentials());
-    std::unique_ptr<Coordinator::Stub> stub = Coordinator::NewStub(channel);
+bool Worker::discover_ring(size_t min_members) {
+  // members still starting up register within seconds, past a minute the job is misconfigured
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  while (true) {
+    auto stub = connections_->coordinator();
     
     ClientContext ctx;
-    ListWorkersRequest req;
-    ListWorkersResponse resp;
-    Status s = stub->ListWorkers(&ctx, req, &resp);
+    GetRingRequest req;
+    req.set_worker_id(worker_id_);
+    RingAssignment resp;
+    Status s = stub->GetRing(&ctx, req, &resp);
     
-    if (s.ok()) {
-      peers.clear();
-      for (const auto& worker : resp.workers()) {
-        if (worker.worker_id() != worker_id_) {
-          std::string addr = worker.address() + ":" + std::to_string(worker.port());
-          peers.push_back(addr);
+    if (s.ok() && static_cast<size_t>(resp.members_size()) >= min_members) {
+      std::vector<std::string> addresses;
+      size_t rank = resp.members_size();
+      for (const auto& member : resp.members()) {
+        if (member.worker_id() == worker_id_) {
+          rank = addresses.size();
         }
+        addresses.push_back(member.address() + ":" + std::to_string(member.port()));
+      }
+      if (rank < addresses.size()) {
+        ring_->set_ring(resp.epoch(), rank, addresses);
+        return true;
+      }
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  }
+}
+
+bool Worker::discover_host_group(size_t min_members) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  while (true) {
+    auto stub = connections_->coordinator();
+    
+    ClientContext ctx;
+    GetHostGroupRequest req;
+    req.set_worker_id(worker_id_);
+    HostGroup resp;
+    Status s = stub->GetHostGroup(&ctx, req, &resp);
+    
+    if (s.ok() && resp.found() && static_cast<size_t>(resp.members()) >= min_members) {
+      host_leader_ = resp.leader().worker_id() == worker_id_;
+      server_id_ = host_leader_ ? resp.group_id() : worker_id_;
+      host_members_ = resp.members();
+      host_groups_ = std::max(resp.groups(), 1);
+      host_total_workers_ = std::max(resp.total_workers(), 1);
+      if (!host_leader_) {
+        host_->set_leader(resp.leader().address() + ":" + std::to_string(resp.leader().port()));
       }
       return true;
     }
-    return false;
-  });
-  
-  return peers;
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  }
 }
 
 void Worker::send_heartbeat() {
   if (!initialized_) return;
   
-  auto channel = grpc::CreateChannel(coordinator_address_, grpc::InsecureChannelCredentials());
-  std::unique_ptr<Coordinator::Stub> stub = Coordinator::NewStub(channel);
+  auto stub = connections_->coordinator();
   
   ClientContext ctx;
   HeartbeatRequest req;
@@ -225,7 +777,11 @@ void Worker::send_heartbeat() {
   req.set_status(static_cast<WorkerStatus>(current_status_.load()));
   
   HeartbeatResponse resp;
-  stub->Heartbeat(&ctx, req, &resp);
+  Status s = stub->Heartbeat(&ctx, req, &resp);
+  // the coordinator timed this worker out; registering again brings it back into the membership
+  if (s.ok() && !resp.success()) {
+    register_with_coordinator();
+  }
 }
 
 void Worker::heartbeat_loop() {
@@ -237,87 +793,366 @@ void Worker::heartbeat_loop() {
   }
 }
 
+void Worker::for_each_shard(const std::function<void(size_t)>& fn) {
+  size_t num_shards = shard_map_.num_shards();
+  std::vector<std::thread> threads;
+  for (size_t shard = 1; shard < num_shards; ++shard) {
+    threads.emplace_back(fn, shard);
+  }
+  if (num_shards > 0) {
+    fn(0);
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+// every shard's reply to one pull, kept until they are assembled into the model
+struct Worker::shard_replies {
+  explicit shard_replies(int iteration, size_t num_shards)
+    : iteration(iteration), unary(num_shards), headers(num_shards), streamed(num_shards), fetched(num_shards, 0) {}
+  
+  bool complete() const { return std::all_of(fetched.begin(), fetched.end(), [](char f) { return f != 0; }); }
+  
+  int iteration;
+  std::vector<TensorPayloadReader> unary;
+  std::vector<ParameterUpdate> headers;
+  std::vector<std::vector<ParameterChunk>> streamed;
+  std::vector<char> fetched;
+};
+
+void Worker::prepare_pull() {
+  size_t num_shards = shard_map_.num_shards();
+  if (stream_pulls_.size() != num_shards) {
+    stream_pulls_.assign(num_shards, 0);
+    known_versions_.assign(num_shards, 0);
+    known_incarnations_.assign(num_shards, 0);
+    model_.clear();
+  }
+}
+
+bool Worker::fetch_shard(size_t shard, shard_replies& replies) {
+  if (!stream_pulls_[shard]) {
+    ClientContext ctx;
+    connections_->prepare_context(ctx);
+    PullRequest req;
+    req.set_worker_id(server_id_);
+    req.set_iteration(replies.iteration);
+    req.set_known_version(known_versions_[shard]);
+    req.set_known_incarnation(known_incarnations_[shard]);
+    req.set_dtype(static_cast<parameter_server::DataType>(options_.pull_dtype));
+    grpc::ByteBuffer resp;
+    Status s = connections_->call_raw(shard, serve_parameters_method(), &ctx, serialize_message(req), &resp);
+    if (s.error_code() != grpc::StatusCode::RESOURCE_EXHAUSTED) {
+      // tensors stay views into resp's slices until the assembler copies them out
+      if (!s.ok() || !replies.unary[shard].parse(resp, ParameterUpdate::kParametersFieldNumber, &replies.headers[shard])) {
+        return false;
+      }
+      if (replies.headers[shard].base_version() == 0) {
+        // only a full reply tells how big the shard is, deltas are small whatever the model size
+        size_t bytes = 0;
+        for (const auto& t : replies.unary[shard].tensors()) bytes += t.size * t.element_bytes();
+        stream_pulls_[shard] = bytes > unary_limit(shard);
+      }
+      replies.fetched[shard] = 1;
+      return true;
+    }
+    // the shard outgrew a single response, stream it from now on
+    stream_pulls_[shard] = 1;
+  }
+  if (!stream_pull(*connections_, shard, server_id_, replies.iteration, known_versions_[shard], known_incarnations_[shard],
+                   options_.chunk_bytes, options_.pull_dtype, replies.streamed[shard])) {
+    return false;
+  }
+  replies.fetched[shard] = 1;
+  return true;
+}
+
+size_t Worker::unary_limit(size_t shard) {
+  // the same margin below the region as the default threshold leaves below gRPC's 4 MiB message limit
+  return std::max(options_.stream_threshold_bytes, connections_->shared_memory_capacity(shard) / 4 * 3);
+}
+
 std::vector<TensorLite> Worker::pull_parameters(int iteration) {
-  auto channel = grpc::CreateChannel(ps_address_, grpc::InsecureChannelCredentials());
-  std::unique_ptr<ParameterServer::Stub> stub = ParameterServer::NewStub(channel);
+  if (shard_map_.empty()) return {};
+  prepare_pull();
+  
+  shard_replies replies(iteration, shard_map_.num_shards());
+  std::atomic<bool> failed(false);
+  for_each_shard([&](size_t shard) {
+    if (!fetch_shard(shard, replies)) {
+      failed = true;
+    }
+  });
+  
+  if (failed) return {};
+  return assemble_pull(replies);
+}
 
-  ClientContext ctx;
-  PullRequest req;
-  req.set_worker_id(worker_id_);
-  req.set_iteration(iteration);
-  ParameterUpdate resp;
-  Status s = stub->ServeParameters(&ctx, req, &resp);
-  if (!s.ok()) return {};
-  return from_proto(resp.parameters());
+std::vector<TensorLite> Worker::assemble_pull(shard_replies& replies) {
+  size_t num_shards = shard_map_.num_shards();
+  auto& unary = replies.unary;
+  auto& headers = replies.headers;
+  auto& streamed = replies.streamed;
+  
+  // pick up each shard's envelope, streamed shards carry it on every chunk
+  bool patch = false;
+  for (size_t shard = 0; shard < num_shards; ++shard) {
+    if (stream_pulls_[shard] && !streamed[shard].empty()) {
+      const auto& first = streamed[shard].front();
+      headers[shard].set_version(first.version());
+      headers[shard].set_base_version(first.base_version());
+      headers[shard].set_incarnation(first.incarnation());
+      headers[shard].set_staleness(first.staleness());
+    }
+    patch |= headers[shard].base_version() > 0;
+  }
+  
+  // until the assembly succeeds the worker holds no model a delta could apply to
+  std::fill(known_versions_.begin(), known_versions_.end(), 0);
+  ModelAssembler model(shard_map_, patch ? std::move(model_) : std::vector<TensorLite>());
+  model_.clear();
+  std::deque<std::vector<unsigned char>> owned;
+  auto add_pieces = [&](size_t shard, const google::protobuf::RepeatedPtrField<parameter_server::TensorChunk>& pieces) {
+    for (const auto& p : pieces) {
+      tensor_view piece;
+      if (!view_tensor(p.tensor(), piece, owned)) return false;
+      model.add(shard, piece, static_cast<size_t>(p.offset()), static_cast<size_t>(p.total_elements()));
+    }
+    return true;
+  };
+  for (size_t shard = 0; shard < num_shards; ++shard) {
+    for (const auto& t : unary[shard].tensors()) {
+      model.add(shard, t, 0, t.size);
+    }
+    if (!add_pieces(shard, headers[shard].blocks())) return {};
+    for (const auto& chunk : streamed[shard]) {
+      if (!add_pieces(shard, chunk.pieces())) return {};
+    }
+  }
+  
+  model_ = model.take();
+  last_pull_staleness_ = 0;
+  for (size_t shard = 0; shard < num_shards; ++shard) {
+    known_versions_[shard] = headers[shard].version();
+    known_incarnations_[shard] = headers[shard].incarnation();
+    last_pull_staleness_ = std::max(last_pull_staleness_, headers[shard].staleness());
+  }
+  return model_;
 }
 
-bool Worker::push_gradients(int iteration, const std::vector<TensorLite>& grads, int& workers_received, int& total_workers) {
-  auto channel = grpc::CreateChannel(ps_address_, grpc::InsecureChannelCredentials());
-  std::unique_ptr<ParameterServer::Stub> stub = ParameterServer::NewStub(channel);
+size_t CompressedSlice::wire_bytes() const {
+  if (sparse) return entries.indices.size() * (sizeof(uint32_t) + sizeof(float));
+  if (codes.dtype != 0) return codes.codes.size() + codes.scales.size() * sizeof(float);
+  return values.size() * sizeof(float);
+}
 
-  ClientContext ctx;
-  GradientUpdate req;
-  req.set_worker_id(worker_id_);
-  req.set_iteration(iteration);
-  auto proto_tensors = to_proto(grads);
-  for (const auto& t : proto_tensors) {
-    *req.add_gradients() = t;
+std::vector<float> CompressedSlice::densify() const {
+  if (!sparse && codes.dtype == 0) return values;
+  std::vector<float> dense(dense_size, 0.0f);
+  const auto* scales = reinterpret_cast<const unsigned char*>(codes.scales.data());
+  if (sparse) {
+    for (size_t j = 0; j < entries.indices.size(); ++j) {
+      dense[entries.indices[j]] = entries.values[j];
+    }
+  } else if (codes.dtype == kDtypeInt8Block) {
+    sum_int8_into(dense.data(), codes.codes.data(), scales, codes.block, 0, dense_size);
+  } else {
+    sum_sign_into(dense.data(), codes.codes.data(), scales, codes.block, 0, dense_size);
   }
-  PushResponse resp;
-  Status s = stub->ReceiveGradients(&ctx, req, &resp);
-  if (!s.ok()) return false;
-  workers_received = resp.workers_received();
-  total_workers = resp.total_workers();
-  return resp.aggregation_complete();
+  return dense;
 }
 
-bool Worker::check_sync_ready(int iteration, int& workers_received, int& total_workers) {
-  auto channel = grpc::CreateChannel(ps_address_, grpc::InsecureChannelCredentials());
-  std::unique_ptr<ParameterServer::Stub> stub = ParameterServer::NewStub(channel);
+std::vector<std::shared_ptr<const std::vector<CompressedSlice>>> Worker::compress_gradients(const std::vector<TensorLite>& grads) {
+  bool sparse = options_.sparsify.mode != "none";
+  for (const auto& t : grads) {
+    if (!sparse && !quantizes(options_.quantize, t.name, t.data.size())) continue;
+    auto& residual = residuals_[t.name];
+    if (residual.size() != t.data.size()) {
+      residual.assign(t.data.size(), 0.0f);
+    }
+  }
+  
+  // shards own disjoint ranges of each residual, so they compress in parallel
+  auto per_shard = partition_by_shard(shard_map_, grads);
+  std::vector<std::shared_ptr<const std::vector<CompressedSlice>>> compressed(per_shard.size());
+  for_each_shard([&](size_t shard) {
+    auto slices = std::make_shared<std::vector<CompressedSlice>>();
+    for (const auto& slice : per_shard[shard]) {
+      CompressedSlice out;
+      out.name = slice.tensor->name;
+      out.shape = slice.tensor->shape;
+      out.dense_size = slice.end - slice.begin;
+      const float* grad = slice.tensor->data.data() + slice.begin;
+      if (sparse) {
+        out.sparse = true;
+        sparsify(grad, residuals_.at(out.name).data() + slice.begin, out.dense_size, options_.sparsify, out.entries);
+      } else if (quantizes(options_.quantize, out.name, slice.tensor->data.size())) {
+        quantize(grad, residuals_.at(out.name).data() + slice.begin, out.dense_size, options_.quantize, out.codes);
+      } else {
+        out.values.assign(grad, grad + out.dense_size);
+      }
+      slices->push_back(std::move(out));
+    }
+    compressed[shard] = std::move(slices);
+  });
+  return compressed;
+}
 
-  ClientContext ctx;
-  SyncStatusRequest req;
-  req.set_iteration(iteration);
-  SyncStatusResponse resp;
-  Status s = stub->CheckSyncStatus(&ctx, req, &resp);
-  if (!s.ok()) return false;
-  workers_received = resp.workers_received();
-  total_workers = resp.total_workers();
-  return resp.ready();
+bool Worker::push_gradients(int iteration, std::shared_ptr<const std::vector<TensorLite>> grads, int& workers_received,
+                            int& total_workers, int32_t& skip_to_iteration, const shard_pushed& pushed) {
+  if (shard_map_.empty()) return false;
+  
+  bool compressed = compresses();
+  if (compressed && compressed_iteration_ != iteration) {
+    compressed_push_ = compress_gradients(*grads);
+    compressed_iteration_ = iteration;
+  }
+  
+  auto per_shard = partition_by_shard(shard_map_, *grads);
+  std::vector<PushResponse> replies(shard_map_.num_shards());
+  std::atomic<bool> failed(false);
+  
+  // every shard gets a push, even an empty one, so each shard's barrier counts this worker
+  for_each_shard([&](size_t shard) {
+    size_t bytes = 0;
+    for (const auto& slice : per_shard[shard]) bytes += (slice.end - slice.begin) * element_bytes(options_.push_dtype);
+    
+    // compressed slices too large for one message are streamed decoded, zero where nothing was picked
+    std::vector<TensorLite> dense;
+    std::vector<TensorSlice> dense_slices;
+    if (compressed) {
+      bytes = 0;
+      for (const auto& slice : *compressed_push_[shard]) bytes += slice.wire_bytes();
+      if (bytes > unary_limit(shard)) {
+        dense.resize(compressed_push_[shard]->size());
+        for (size_t i = 0; i < dense.size(); ++i) {
+          const CompressedSlice& slice = (*compressed_push_[shard])[i];
+          dense[i].name = slice.name;
+          dense[i].shape = slice.shape;
+          dense[i].dtype = 0;
+          dense[i].data = slice.densify();
+          dense_slices.push_back({&dense[i], 0, slice.dense_size});
+        }
+      }
+    }
+    
+    PushResponse resp;
+    if (compressed && dense_slices.empty()) {
+      if (!unary_compressed_push(*connections_, shard, server_id_, iteration, compressed_push_[shard], options_.push_dtype, resp)) {
+        failed = true;
+        return;
+      }
+    } else if (compressed) {
+      if (!stream_push(*connections_, shard, server_id_, iteration, dense_slices, options_.chunk_bytes, options_.push_dtype,
+                       resp)) {
+        failed = true;
+        return;
+      }
+    } else if (bytes > unary_limit(shard)) {
+      if (!stream_push(*connections_, shard, server_id_, iteration, per_shard[shard], options_.chunk_bytes,
+                       options_.push_dtype, resp)) {
+        failed = true;
+        return;
+      }
+    } else if (!unary_push(*connections_, shard, server_id_, iteration, per_shard[shard], grads, options_.push_dtype,
+                           resp)) {
+      failed = true;
+      return;
+    }
+    replies[shard] = resp;
+    if (pushed) {
+      pushed(shard, resp.aggregation_complete(), resp.skip_to() > 0 ? resp.skip_to() : -1);
+    }
+  });
+  
+  bool complete = summarize_push(replies, workers_received, total_workers, skip_to_iteration);
+  return complete && !failed;
+}
+
+bool Worker::check_sync_ready(int iteration, int& workers_received, int& total_workers) {
+  if (shard_map_.empty()) return false;
+  
+  std::vector<int> received(shard_map_.num_shards(), 0);
+  std::vector<int> totals(shard_map_.num_shards(), 0);
+  std::atomic<bool> failed(false);
+  std::atomic<bool> ready(true);
+  
+  for_each_shard([&](size_t shard) {
+    SyncStatusResponse resp;
+    if (!sync_status(*connections_, shard, server_id_, iteration, resp)) {
+      failed = true;
+      return;
+    }
+    received[shard] = resp.workers_received();
+    totals[shard] = resp.total_workers();
+    if (!resp.ready()) {
+      ready = false;
+    }
+  });
+  
+  if (failed) return false;
+  workers_received = *std::min_element(received.begin(), received.end());
+  total_workers = *std::max_element(totals.begin(), totals.end());
+  return ready;
 }
 
 bool Worker::load_checkpoint_from_server(const std::string& checkpoint_path, int32_t& epoch) {
-  if (!initialized_ && ps_address_.empty()) {
+  if (!initialized_ && shard_map_.empty()) {
     // Try to discover parameter server if not initialized
     if (!discover_parameter_server()) {
       return false;
     }
   }
   
-  auto channel = grpc::CreateChannel(ps_address_, grpc::InsecureChannelCredentials());
-  std::unique_ptr<ParameterServer::Stub> stub = ParameterServer::NewStub(channel);
+  std::atomic<bool> failed(false);
+  std::vector<int32_t> epochs(shard_map_.num_shards(), 0);
+  
+  for_each_shard([&](size_t shard) {
+    auto stub = connections_->parameter_server(shard);
+    if (!stub) {
+      failed = true;
+      return;
+    }
 
-  ClientContext ctx;
-  LoadCheckpointRequest req;
-  req.set_path(checkpoint_path);
-  LoadCheckpointResponse resp;
-  Status s = stub->LoadCheckpoint(&ctx, req, &resp);
+    ClientContext ctx;
+    connections_->prepare_context(ctx);
+    LoadCheckpointRequest req;
+    req.set_path(shard_map_.shard_checkpoint_path(checkpoint_path, shard));
+    LoadCheckpointResponse resp;
+    Status s = stub->LoadCheckpoint(&ctx, req, &resp);
+    
+    if (!s.ok() || !resp.success()) {
+      failed = true;
+      return;
+    }
+    epochs[shard] = resp.epoch();
+  });
   
-  if (!s.ok() || !resp.success()) {
+  if (failed || epochs.empty()) {
     return false;
   }
   
-  epoch = resp.epoch();
+  epoch = epochs[0];
   // Parameters are loaded into the parameter server, so they'll be available
   // on the next pull_parameters call. We don't need to store them locally.
   return true;
 }
 
-std::vector<TensorLite> Worker::compute_gradients(const std::vector<TensorLite>& params) {
-  std::vector<TensorLite> grads = params;
-  for (auto& t : grads) {
-    for (auto& v : t.data) v = 0.01f;
+void Worker::compute_gradients(const std::vector<TensorLite>& params, const std::function<void(TensorLite&&)>& ready) {
+  // backward runs from the last layer to the first
+  for (auto it = params.rbegin(); it != params.rend(); ++it) {
+    TensorLite grad = *it;
+    for (auto& v : grad.data) v = 0.01f;
+    ready(std::move(grad));
   }
+}
+
+std::vector<TensorLite> Worker::compute_gradients(const std::vector<TensorLite>& params) {
+  std::vector<TensorLite> grads;
+  grads.reserve(params.size());
+  compute_gradients(params, [&grads](TensorLite&& grad) { grads.push_back(std::move(grad)); });
+  std::reverse(grads.begin(), grads.end());
   
 #ifdef HAVE_NCCL
   if (num_gpus_ > 1 && nccl_manager_ && nccl_manager_->is_initialized()) {
@@ -328,7 +1163,211 @@ std::vector<TensorLite> Worker::compute_gradients(const std::vector<TensorLite>&
   return grads;
 }
 
+bool Worker::compute_and_push(int iteration, const std::vector<TensorLite>& params, int& workers_received,
+                              int& total_workers, int32_t& skip_to_iteration, const shard_pushed& pushed) {
+  if (host_leader_) {
+    // the host goes up as one push. The servers average over the pushes they get, one per host, so the
+    // host's sum is scaled by hosts / workers for that average to come out as the mean over every worker
+    auto grads = compute_gradients(params);
+    std::vector<float> flat = flatten(grads);
+    host_->collect(iteration, static_cast<size_t>(host_members_ - 1), flat);
+    float scale = static_cast<float>(host_groups_) / static_cast<float>(host_total_workers_);
+    size_t offset = 0;
+    for (auto& g : grads) {
+      for (auto& v : g.data) {
+        v = flat[offset++] * scale;
+      }
+    }
+    return push_gradients(iteration, std::make_shared<const std::vector<TensorLite>>(std::move(grads)), workers_received,
+                          total_workers, skip_to_iteration, pushed);
+  }
+  bool bucketed = options_.bucket_bytes > 0 && !compresses() && !shard_map_.empty();
+#ifdef HAVE_NCCL
+  // gradients are summed across the local gpus before they are pushed, all of them at once
+  bucketed = bucketed && !(num_gpus_ > 1 && nccl_manager_ && nccl_manager_->is_initialized());
+#endif
+  if (!bucketed) {
+    auto grads = std::make_shared<const std::vector<TensorLite>>(compute_gradients(params));
+    return push_gradients(iteration, grads, workers_received, total_workers, skip_to_iteration, pushed);
+  }
+  
+  bucketed_push push(*connections_, shard_map_, server_id_, iteration, options_,
+                     [&pushed](size_t shard, const PushResponse& resp) {
+                       if (pushed) pushed(shard, resp.aggregation_complete(), resp.skip_to() > 0 ? resp.skip_to() : -1);
+                     });
+  compute_gradients(params, [&push](TensorLite&& grad) { push.mark_ready(std::move(grad)); });
+  std::vector<PushResponse> replies;
+  bool ok = push.finish(replies);
+  bool complete = summarize_push(replies, workers_received, total_workers, skip_to_iteration);
+  return ok && complete;
+}
+
+bool Worker::wait_for_shard(size_t shard, int iteration) {
+  // the shard usually applies the iteration right after the last push lands, so poll tightly at first
+  auto delay = std::chrono::milliseconds(1);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (std::chrono::steady_clock::now() < deadline) {
+    SyncStatusResponse status;
+    if (sync_status(*connections_, shard, server_id_, iteration, status) && status.ready()) {
+      return true;
+    }
+    std::this_thread::sleep_for(delay);
+    delay = std::min(delay * 2, std::chrono::milliseconds(50));
+  }
+  return false;
+}
+
+void Worker::push_and_prefetch(int iteration, std::vector<TensorLite> params) {
+  size_t num_shards = shard_map_.num_shards();
+  auto next = std::make_unique<shard_replies>(iteration + 1, num_shards);
+  std::atomic<size_t> pushed(0);
+  std::atomic<bool> failed(false);
+  int workers_received = 0, total_workers = 0;
+  // each shard moves on to the next iteration's pull as soon as it has applied this one, whatever the others do
+  compute_and_push(iteration, params, workers_received, total_workers, inflight_skip_to_,
+                   [&](size_t shard, bool aggregated, int32_t skip_to) {
+    pushed++;
+    if (skip_to >= 0) {
+      // late: the worker skips ahead, the next iteration is not the one to prefetch
+      return;
+    }
+    if (!aggregated && !wait_for_shard(shard, iteration)) {
+      failed = true;
+      return;
+    }
+    // a shard that fails here is pulled again by the next iteration
+    fetch_shard(shard, *next);
+  });
+  inflight_ok_ = !failed && pushed == num_shards;
+  if (next->complete()) {
+    prefetched_ = std::move(next);
+  }
+}
+
+bool Worker::flush() {
+  if (!inflight_.joinable()) return true;
+  inflight_.join();
+  skip_to_ = inflight_skip_to_;
+  return inflight_ok_;
+}
+
+bool Worker::run_pipelined_iteration(int iteration) {
+  current_status_ = 1;
+  
+  // the previous push has to be in before its parameters, prefetched with it, can be used
+  bool previous = flush();
+  std::unique_ptr<shard_replies> prefetched = std::move(prefetched_);
+  if (skip_to_ > iteration) {
+    // the previous push was late, the caller moves on to skip_to()
+    current_status_ = 0;
+    return previous;
+  }
+  
+  std::vector<TensorLite> params;
+  if (prefetched && prefetched->iteration == iteration) {
+    params = assemble_pull(*prefetched);
+  }
+  if (params.empty()) {
+    params = pull_parameters(iteration);
+  }
+  if (params.empty()) {
+    params.push_back(placeholder_parameters());
+  }
+  
+  // backward runs with the push, so buckets can go out as it produces them; each iteration's
+  // parameters and gradients belong to its own thread until the next iteration joins it
+  if (!shard_map_.empty()) {
+    prepare_pull();
+    inflight_ = std::thread(&Worker::push_and_prefetch, this, iteration, std::move(params));
+  }
+  current_status_ = 0;
+  return previous && !shard_map_.empty();
+}
+
+bool Worker::run_ring_iteration(int iteration) {
+  current_status_ = 1;
+  
+  if (replica_.empty()) {
+    // every member starts from what the servers hold, a loaded checkpoint included; nothing is pushed back
+    replica_ = pull_parameters(iteration);
+    if (replica_.empty()) {
+      replica_.push_back(placeholder_parameters());
+    }
+  }
+  if (!ring_formed_) {
+    // the first ring waits for every member, one re-formed after a failure goes on with whoever is left
+    ring_formed_ = discover_ring(ring_->size() == 0 ? options_.ring_size : 1);
+    if (!ring_formed_) {
+      current_status_ = 0;
+      return false;
+    }
+  }
+  
+  std::vector<float> flat = flatten(compute_gradients(replica_));
+  if (!ring_->allreduce(iteration, flat)) {
+    // a neighbour is gone or on another ring: the replica stays as it was and the ring is read again
+    ring_formed_ = false;
+    current_status_ = 0;
+    return false;
+  }
+  
+  // the same mean-gradient step the servers take, on every member's replica alike
+  float scale = 1.0f / static_cast<float>(ring_->size());
+  size_t offset = 0;
+  for (size_t i = 0; i < replica_.size(); ++i) {
+    auto& param = replica_[i].data;
+    replica_optimizer_.prepare(i, param.size());
+    replica_optimizer_.step(i, param.data(), param.data(), flat.data() + offset, scale, 0, param.size(), false);
+    offset += param.size();
+  }
+  
+  current_status_ = 0;
+  return true;
+}
+
+bool Worker::run_member_iteration(int iteration) {
+  current_status_ = 1;
+  skip_to_ = -1;
+  
+  std::vector<TensorLite> params;
+  int32_t served = -1;
+  if (!host_->pull(worker_id_, iteration, params, served)) {
+    current_status_ = 0;
+    return false;
+  }
+  if (served > iteration) {
+    // the leader pushed that iteration without this worker, catch up with it
+    skip_to_ = served;
+    current_status_ = 0;
+    return false;
+  }
+  if (params.empty()) {
+    params.push_back(placeholder_parameters());
+  }
+  
+  bool pushed = host_->push(worker_id_, iteration, flatten(compute_gradients(params)), skip_to_);
+  last_pull_staleness_ = 0;
+  current_status_ = 0;
+  return pushed;
+}
+
 bool Worker::run_iteration(int iteration) {
+  if (options_.allreduce == "ring") {
+    return run_ring_iteration(iteration);
+  }
+  if (options_.local_aggregation) {
+    // the group is looked at every iteration, so a member takes over from a leader that left
+    if (!discover_host_group(host_formed_ ? 1 : options_.host_workers) && !host_formed_) {
+      return false;
+    }
+    host_formed_ = true;
+    if (!host_leader_) {
+      return run_member_iteration(iteration);
+    }
+  }
+  if (options_.pipeline) {
+    return run_pipelined_iteration(iteration);
+  }
   current_status_ = 1;
   
   int retry_count = 0;
@@ -344,17 +1383,14 @@ bool Worker::run_iteration(int iteration) {
     }
     
     if (params.empty()) {
-      TensorLite dummy;
-      dummy.name = "weight";
-      dummy.shape = {10, 10};
-      dummy.dtype = 0;
-      dummy.data.resize(100, 0.0f);
-      params.push_back(dummy);
+      params.push_back(placeholder_parameters());
+    }
+    if (host_leader_) {
+      host_->publish(iteration, std::make_shared<const std::vector<TensorLite>>(params));
     }
     
-    auto grads = compute_gradients(params);
     int workers_received = 0, total_workers = 0;
-    bool aggregation_complete = push_gradients(iteration, grads, workers_received, total_workers);
+    bool aggregation_complete = compute_and_push(iteration, params, workers_received, total_workers, skip_to_);
     
     if (!aggregation_complete && retry_count < max_retries - 1) {
       std::this_thread::sleep_for(std::chrono::milliseconds(500));
@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
+#include <vector>
 #include "worker.h"
+#include "tensor_codec.h"
 
 int main(int argc, char** argv) {
   std::string coordinator_addr = "localhost:50052";
@@ -10,14 +13,131 @@ int main(int argc, char** argv) {
   int32_t worker_port = 0;
   std::string checkpoint_path = "";
 
-  if (argc > 1) coordinator_addr = argv[1];
-  if (argc > 2) worker_id = std::stoi(argv[2]);
-  if (argc > 3) iterations = std::stoi(argv[3]);
-  if (argc > 4) worker_addr = argv[4];
-  if (argc > 5) worker_port = std::stoi(argv[5]);
-  if (argc > 6) checkpoint_path = argv[6];
+  WorkerOptions options;
 
-  Worker w(worker_id, coordinator_addr, worker_addr, worker_port);
+  // --name=value flags may appear anywhere, everything else is positional
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      args.push_back(arg);
+      continue;
+    }
+    size_t eq = arg.find('=');
+    std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+    std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+    if (name == "ps-channels") {
+      options.ps_channels = std::stoi(value);
+    } else if (name == "chunk-bytes") {
+      options.chunk_bytes = std::stoull(value);
+    } else if (name == "stream-threshold-bytes") {
+      options.stream_threshold_bytes = std::stoull(value);
+    } else if (name == "shared-memory-bytes") {
+      options.shared_memory_bytes = std::stoull(value);
+    } else if (name == "sparsify") {
+      if (!valid_sparsify_mode(value)) {
+        std::cerr << "unknown sparsify mode " << value << ", expected none, topk or threshold" << std::endl;
+        return 1;
+      }
+      options.sparsify.mode = value;
+    } else if (name == "sparsify-ratio") {
+      options.sparsify.ratio = std::stod(value);
+    } else if (name == "sparsify-threshold") {
+      options.sparsify.threshold = std::stof(value);
+    } else if (name == "pull-dtype" || name == "push-dtype") {
+      if (!parse_float_dtype(value, name == "pull-dtype" ? options.pull_dtype : options.push_dtype)) {
+        std::cerr << "unknown " << name << " " << value << ", expected fp32, fp16 or bf16" << std::endl;
+        return 1;
+      }
+    } else if (name == "bucket-bytes") {
+      options.bucket_bytes = std::stoull(value);
+    } else if (name == "allreduce") {
+      if (value != "ps" && value != "ring") {
+        std::cerr << "unknown allreduce " << value << ", expected ps or ring" << std::endl;
+        return 1;
+      }
+      options.allreduce = value;
+    } else if (name == "ring-size") {
+      options.ring_size = std::stoull(value);
+    } else if (name == "optimizer") {
+      if (!valid_optimizer(value)) {
+        std::cerr << "unknown optimizer " << value << ", expected sgd, momentum, adam or adagrad" << std::endl;
+        return 1;
+      }
+      options.optimizer.name = value;
+    } else if (name == "learning-rate") {
+      options.optimizer.learning_rate = std::stof(value);
+    } else if (name == "momentum") {
+      options.optimizer.momentum = std::stof(value);
+    } else if (name == "beta1") {
+      options.optimizer.beta1 = std::stof(value);
+    } else if (name == "beta2") {
+      options.optimizer.beta2 = std::stof(value);
+    } else if (name == "epsilon") {
+      options.optimizer.epsilon = std::stof(value);
+    } else if (name == "local-aggregation") {
+      options.local_aggregation = value != "0" && value != "false";
+    } else if (name == "hostname") {
+      options.hostname = value;
+    } else if (name == "host-workers") {
+      options.host_workers = std::stoull(value);
+    } else if (name == "pipeline") {
+      options.pipeline = value != "0" && value != "false";
+    } else if (name == "quantize") {
+      if (!valid_quantize_mode(value)) {
+        std::cerr << "unknown quantize mode " << value << ", expected none, int8 or sign" << std::endl;
+        return 1;
+      }
+      options.quantize.mode = value;
+    } else if (name == "quantize-block") {
+      options.quantize.block = std::stoull(value);
+      if (options.quantize.block == 0 || options.quantize.block % 8 != 0) {
+        std::cerr << "quantize block must be a positive multiple of 8" << std::endl;
+        return 1;
+      }
+    } else if (name == "quantize-min-elements") {
+      options.quantize.min_elements = std::stoull(value);
+    } else if (name == "quantize-exclude") {
+      // comma-separated tensor names kept at float32
+      for (size_t begin = 0; begin <= value.size();) {
+        size_t comma = std::min(value.find(',', begin), value.size());
+        if (comma > begin) options.quantize.keep.push_back(value.substr(begin, comma - begin));
+        begin = comma + 1;
+      }
+    } else {
+      std::cerr << "unknown option " << arg << std::endl;
+      return 1;
+    }
+  }
+
+  if (options.sparsify.mode != "none" && options.quantize.mode != "none") {
+    std::cerr << "--sparsify and --quantize cannot be combined" << std::endl;
+    return 1;
+  }
+  if (options.bucket_bytes > 0 && (options.sparsify.mode != "none" || options.quantize.mode != "none")) {
+    std::cerr << "--bucket-bytes cannot be combined with --sparsify or --quantize" << std::endl;
+    return 1;
+  }
+
+  if (options.allreduce == "ring" && (options.pipeline || options.bucket_bytes > 0 || options.sparsify.mode != "none" ||
+                                     options.quantize.mode != "none")) {
+    std::cerr << "--allreduce=ring cannot be combined with --pipeline, --bucket-bytes, --sparsify or --quantize" << std::endl;
+    return 1;
+  }
+
+  if (options.local_aggregation && (options.allreduce == "ring" || options.pipeline || options.bucket_bytes > 0)) {
+    std::cerr << "--local-aggregation cannot be combined with --allreduce=ring, --pipeline or --bucket-bytes" << std::endl;
+    return 1;
+  }
+
+  if (args.size() > 0) coordinator_addr = args[0];
+  if (args.size() > 1) worker_id = std::stoi(args[1]);
+  if (args.size() > 2) iterations = std::stoi(args[2]);
+  if (args.size() > 3) worker_addr = args[3];
+  if (args.size() > 4 && !args[4].empty()) worker_port = std::stoi(args[4]);
+  if (args.size() > 5) checkpoint_path = args[5];
+
+  Worker w(worker_id, coordinator_addr, worker_addr, worker_port, options);
   
   if (!w.initialize()) {
     std::cerr << "worker " << worker_id << " failed to initialize" << std::endl;
@@ -39,7 +159,16 @@ int main(int argc, char** argv) {
   
   for (int it = 0; it < iterations; ++it) {
     bool done = w.run_iteration(it);
-    std::cout << "worker " << worker_id << " iter " << it << " done=" << (done ? "true" : "false") << std::endl;
+    std::cout << "worker " << worker_id << " iter " << it << " done=" << (done ? "true" : "false")
+              << " staleness=" << w.last_pull_staleness() << std::endl;
+    if (w.skip_to() > it + 1) {
+      // this worker fell behind the quorum, catch up with the others instead of replaying every iteration
+      std::cout << "worker " << worker_id << " late for iter " << it << ", skipping to " << w.skip_to() << std::endl;
+      it = w.skip_to() - 1;
+    }
+  }
+  if (!w.flush()) {
+    std::cerr << "worker " << worker_id << " last push did not go through" << std::endl;
   }
   return 0;
 }
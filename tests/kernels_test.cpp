@@ -0,0 +1,310 @@
+#include "kernels.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+// Every dispatchable kernel variant against the scalar one, bit for bit, quantized codecs included. Lengths straddle the vector widths and
+// buffers start off the natural alignment so heads and tails run through the scalar remainders too.
+
+namespace {
+
+const size_t kLengths[] = {0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 257, 1031};
+const size_t kSkews[] = {0, 1, 3};
+
+int failures = 0;
+
+void fail(const std::string& variant, const std::string& what, size_t n, size_t skew) {
+  std::cerr << variant << ": " << what << " differs from scalar, n=" << n << " skew=" << skew << std::endl;
+  failures++;
+}
+
+// finite values over a wide range of exponents, with exact zeros, subnormals and halfway cases mixed in
+std::vector<float> random_floats(std::mt19937& rng, size_t n) {
+  std::uniform_real_distribution<float> mantissa(-2.0f, 2.0f);
+  std::uniform_int_distribution<int> exponent(-30, 20);
+  std::uniform_int_distribution<int> pick(0, 15);
+  std::vector<float> values(n);
+  for (auto& x : values) {
+    switch (pick(rng)) {
+      case 0: x = 0.0f; break;
+      case 1: x = -0.0f; break;
+      case 2: x = std::numeric_limits<float>::denorm_min() * 7; break;
+      case 3: x = 1.0f + std::ldexp(1.0f, -11); break;  // a binary16 tie
+      case 4: x = 1.0f + std::ldexp(1.0f, -8); break;   // a bfloat16 tie
+      case 5: x = 70000.0f; break;                      // past binary16 range
+      default: x = std::ldexp(mantissa(rng), exponent(rng)); break;
+    }
+  }
+  return values;
+}
+
+// 16-bit patterns of finite values, so the comparison does not depend on NaN payloads
+std::vector<uint16_t> random_halves(std::mt19937& rng, size_t n, bool bf16) {
+  std::uniform_int_distribution<uint32_t> bits(0, 0xffff);
+  std::vector<uint16_t> values(n);
+  for (auto& h : values) {
+    do {
+      h = static_cast<uint16_t>(bits(rng));
+    } while (bf16 ? (h & 0x7f80) == 0x7f80 : (h & 0x7c00) == 0x7c00);
+  }
+  return values;
+}
+
+// runs the same call under the scalar kernels and the variant, on copies of the same inputs
+bool same(const std::string& variant, const std::function<std::vector<unsigned char>()>& run) {
+  select_kernels("scalar");
+  auto expected = run();
+  select_kernels(variant);
+  auto got = run();
+  return expected == got;
+}
+
+template <typename T>
+void append(std::vector<unsigned char>& out, const T* data, size_t count) {
+  auto bytes = reinterpret_cast<const unsigned char*>(data);
+  out.insert(out.end(), bytes, bytes + count * sizeof(T));
+}
+
+// optimizer state as the kernels keep it: floats, or their high halves when bf16
+std::vector<unsigned char> state_bytes(const std::vector<float>& values, bool bf16) {
+  std::vector<unsigned char> bytes;
+  if (!bf16) {
+    append(bytes, values.data(), values.size());
+    return bytes;
+  }
+  for (float x : values) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    uint16_t high = static_cast<uint16_t>(bits >> 16);
+    append(bytes, &high, 1);
+  }
+  return bytes;
+}
+
+void check_sum_into(const std::string& variant, std::mt19937& rng) {
+  for (size_t count = 1; count <= 3; count++) {
+    for (size_t n : kLengths) {
+      for (size_t skew : kSkews) {
+        auto acc = random_floats(rng, n + 1);
+        std::vector<std::vector<unsigned char>> payloads(count);
+        for (auto& payload : payloads) {
+          auto values = random_floats(rng, n);
+          payload.assign(skew, 0);
+          append(payload, values.data(), n);
+        }
+        bool ok = same(variant, [&]() {
+          auto out = acc;
+          std::vector<const unsigned char*> inputs;
+          for (const auto& payload : payloads) {
+            inputs.push_back(payload.data() + skew);
+          }
+          sum_into(out.data() + 1, inputs.data(), count, n);
+          std::vector<unsigned char> bytes;
+          append(bytes, out.data(), out.size());
+          return bytes;
+        });
+        if (!ok) fail(variant, "sum_into(" + std::to_string(count) + " inputs)", n, skew);
+      }
+    }
+  }
+}
+
+void check_half(const std::string& variant, std::mt19937& rng) {
+  for (bool bf16 : {false, true}) {
+    std::string kind = bf16 ? "bf16" : "fp16";
+    for (size_t n : kLengths) {
+      for (size_t skew : kSkews) {
+        auto halves = random_halves(rng, n, bf16);
+        std::vector<unsigned char> packed(skew);
+        append(packed, halves.data(), n);
+        auto floats = random_floats(rng, n + 1);
+        auto acc = random_floats(rng, n + 1);
+
+        bool ok = same(variant, [&]() {
+          std::vector<float> out(n + 1);
+          widen_half(out.data() + 1, packed.data() + skew, bf16, n);
+          std::vector<unsigned char> bytes;
+          append(bytes, out.data(), out.size());
+          return bytes;
+        });
+        if (!ok) fail(variant, "widen_half " + kind, n, skew);
+
+        ok = same(variant, [&]() {
+          std::vector<unsigned char> out(skew + 2 * n + 2);
+          narrow_half(out.data() + skew, floats.data() + 1, bf16, n);
+          return out;
+        });
+        if (!ok) fail(variant, "narrow_half " + kind, n, skew);
+
+        ok = same(variant, [&]() {
+          auto out = acc;
+          sum_half_into(out.data() + 1, packed.data() + skew, bf16, n);
+          std::vector<unsigned char> bytes;
+          append(bytes, out.data(), out.size());
+          return bytes;
+        });
+        if (!ok) fail(variant, "sum_half_into " + kind, n, skew);
+      }
+    }
+  }
+}
+
+void check_optimizer_step(const std::string& variant, std::mt19937& rng) {
+  struct config {
+    const char* name;
+    bool m;
+    bool v;
+    step_params p;
+  };
+  step_params sgd;
+  sgd.scale = 0.5f;
+  sgd.rate = 0.01f;
+  step_params momentum = sgd;
+  momentum.decay1 = 0.9f;
+  momentum.gain1 = 1.0f;
+  step_params adam = sgd;
+  adam.decay1 = 0.9f;
+  adam.gain1 = 0.1f;
+  adam.decay2 = 0.999f;
+  adam.gain2 = 0.001f;
+  adam.epsilon = 1e-8f;
+  const config configs[] = {{"sgd", false, false, sgd}, {"momentum", true, false, momentum}, {"adam", true, true, adam}};
+
+  for (const auto& c : configs) {
+    for (bool bf16 : {false, true}) {
+      for (bool nontemporal : {false, true}) {
+        std::string what = std::string("optimizer_step ") + c.name + (bf16 ? " bf16" : "") + (nontemporal ? " nontemporal" : "");
+        for (size_t n : kLengths) {
+          for (size_t skew : {size_t(0), size_t(1)}) {
+            auto param = random_floats(rng, n + skew);
+            auto grad = random_floats(rng, n + skew);
+            auto m = state_bytes(random_floats(rng, n + skew), bf16);
+            auto v_floats = random_floats(rng, n + skew);
+            for (auto& x : v_floats) x = std::fabs(x);
+            auto v = state_bytes(v_floats, bf16);
+            size_t state_skew = skew * (bf16 ? sizeof(uint16_t) : sizeof(float));
+
+            bool ok = same(variant, [&]() {
+              std::vector<float> out(n + skew);
+              auto state1 = m;
+              auto state2 = v;
+              void* m_ptr = c.m ? state1.data() + state_skew : nullptr;
+              void* v_ptr = c.v ? state2.data() + state_skew : nullptr;
+              bool moved = optimizer_step(out.data() + skew, param.data() + skew, grad.data() + skew, m_ptr, v_ptr, bf16,
+                                          c.p, n, nontemporal);
+              std::vector<unsigned char> bytes(1, moved);
+              append(bytes, out.data(), out.size());
+              bytes.insert(bytes.end(), state1.begin(), state1.end());
+              bytes.insert(bytes.end(), state2.begin(), state2.end());
+              return bytes;
+            });
+            if (!ok) fail(variant, what, n, skew);
+          }
+        }
+      }
+    }
+  }
+}
+
+// encodes first + n values and decodes the last n of them, blocks of every size the codecs are used with
+void check_quantize(const std::string& variant, std::mt19937& rng) {
+  const size_t blocks[] = {8, 16, 24, 64, 256};
+  const size_t firsts[] = {0, 1, 3, 7, 13, 70};
+  std::uniform_int_distribution<int> byte(0, 255);
+  for (size_t block : blocks) {
+    for (size_t first : firsts) {
+      for (size_t n : kLengths) {
+        size_t total = first + n;
+        size_t groups = (total + block - 1) / block;
+        std::string where = " block=" + std::to_string(block) + " first=" + std::to_string(first);
+        auto values = random_floats(rng, total + 1);
+
+        bool ok = same(variant, [&]() {
+          // values and scales one float off their allocation, the vector loops see unaligned heads
+          auto residual = values;
+          std::vector<unsigned char> codes(total);
+          std::vector<float> scales(groups + 1);
+          quantize_int8(residual.data() + 1, codes.data(), scales.data() + 1, total, block);
+          std::vector<unsigned char> bytes(codes);
+          append(bytes, scales.data(), scales.size());
+          append(bytes, residual.data(), residual.size());
+          return bytes;
+        });
+        if (!ok) fail(variant, "quantize_int8" + where, total, 1);
+
+        ok = same(variant, [&]() {
+          auto residual = values;
+          std::vector<unsigned char> bits((total + 7) / 8);
+          std::vector<float> scales(groups + 1);
+          quantize_sign(residual.data() + 1, bits.data(), scales.data() + 1, total, block);
+          std::vector<unsigned char> bytes(bits);
+          append(bytes, scales.data(), scales.size());
+          append(bytes, residual.data(), residual.size());
+          return bytes;
+        });
+        if (!ok) fail(variant, "quantize_sign" + where, total, 1);
+
+        for (size_t skew : kSkews) {
+          std::vector<unsigned char> codes(skew + total);
+          for (auto& c : codes) c = static_cast<unsigned char>(byte(rng));
+          auto scale_values = random_floats(rng, groups);
+          std::vector<unsigned char> scales(skew);
+          append(scales, scale_values.data(), groups);
+          auto acc = random_floats(rng, n + 1);
+
+          ok = same(variant, [&]() {
+            auto out = acc;
+            sum_int8_into(out.data() + 1, codes.data() + skew, scales.data() + skew, block, first, n);
+            std::vector<unsigned char> bytes;
+            append(bytes, out.data(), out.size());
+            return bytes;
+          });
+          if (!ok) fail(variant, "sum_int8_into" + where, n, skew);
+
+          ok = same(variant, [&]() {
+            auto out = acc;
+            sum_sign_into(out.data() + 1, codes.data() + skew, scales.data() + skew, block, first, n);
+            std::vector<unsigned char> bytes;
+            append(bytes, out.data(), out.size());
+            return bytes;
+          });
+          if (!ok) fail(variant, "sum_sign_into" + where, n, skew);
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  int checked = 0;
+  for (const char* variant : {"avx2", "avx512", "neon"}) {
+    if (!select_kernels(variant)) {
+      std::cout << variant << ": not supported on this CPU, skipped" << std::endl;
+      continue;
+    }
+    std::mt19937 rng(20240601);
+    check_sum_into(variant, rng);
+    check_half(variant, rng);
+    check_optimizer_step(variant, rng);
+    check_quantize(variant, rng);
+    std::cout << variant << ": checked" << std::endl;
+    checked++;
+  }
+  select_kernels("auto");
+
+  if (failures > 0) {
+    std::cerr << failures << " mismatches" << std::endl;
+    return 1;
+  }
+  std::cout << checked << " variants match scalar" << std::endl;
+  return 0;
+}